@@ -0,0 +1,1164 @@
+/*
+Benchmarks for the CMS(ConfigurationManagement Service) control point.
+Same license as cms_cp.c.
+
+1.Compile:(assumed that libupnp are installed in /usr/local)
+	gcc -O2 -DCMS_CP_NO_MAIN -I/usr/local/include -I/usr/local/include/upnp -L/usr/local/lib \
+	cms_cp.c cms_bench.c -o cms_bench -lupnp -lthreadutil -lixml -lpthread
+
+2.Run:
+	export LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH
+	./cms_bench events [<devices> [<threads> [<seconds>]]]
+	./cms_bench shards [<devices> [<workers> [<seconds>]]]
+	./cms_bench parse [<iterations> [<pcap>]]
+	./cms_bench escape [<iterations>]
+	./cms_bench micro [text|csv|json] [<ms>] [<filter>]
+
+  events: fills the device table with <devices> subscribed devices and
+    delivers UPNP_EVENT_RECEIVED callbacks from 1 up to <threads> threads,
+    the way libupnp worker threads do, printing events/s for each thread
+    count.  Each thread sends the events of its share of the devices with
+    EventKeys in sequence, so none is dropped as stale.  The output of the control point is sent to /dev/null.
+
+  shards: fills the device table the same way and runs the dispatch
+    workers with 1 up to <workers> workers.  <workers> producer threads
+    share the devices, each sending the events of its devices in order
+    with ConfigurationUpdate versions 1 to 16 over and over, and wait
+    when a worker queue is full.  Prints the events/s processed and the
+    devices whose last version processed is not the last one sent, which
+    stays 0 as the events of a device are kept on one worker.
+
+  parse: extracts the ConfigurationUpdate values of the NOTIFY requests
+    in <pcap> (doc/cms.pcap by default), adds a generated value with a
+    4KB document, and parses each of them <iterations> times with the
+    former sscanf/Unescaped/DOM path and with ParseConfigurationUpdate and
+    ParseParameterValueList, printing ns per value and the parameters
+    each path found.
+
+  escape: runs Escaped and Unescaped over ParameterValueList documents of
+    about 0.5KB, 4KB and 64KB, next to the former five-pass str_sub chain,
+    checking that both give the same result.  Build with -mavx2 (or
+    -march=native) to use AVX2, SSE2 is the x86-64 default.
+
+  micro: times str_sub, Escaped, Unescaped, GetFirstDocumentItem,
+    FindAndParseService, StateVarUpdate and PrintParameters one by one,
+    on the values captured in doc/cms.pcap and doc/cms.log, the captured
+    description, and generated documents of 1 up to 5000 parameters.
+    Each case is calibrated to take about <ms> (200 by default) per
+    sample, then timed over 5 samples; the median and the fastest sample
+    are reported in ns per call, with MB/s of input at the median.  The
+    inputs are fixed, so runs compare as long as the machine is the same.
+    Cases whose name does not contain <filter> are skipped.  csv and
+    json write one row or object per case for regression tracking.
+*/
+#include "cms_cp.h"
+
+#include <sys/time.h>
+#include <unistd.h>
+
+extern ithread_rwlock_t g_deviceListLock;
+extern struct DeviceIndex g_sidIndex;
+extern ithread_mutex_t g_timerMutex;
+extern ithread_cond_t g_timerCond;
+extern ithread_rwlock_t g_dispatchLock;
+extern ithread_mutex_t g_dispatchGate;
+extern ithread_mutex_t g_dispatchRouteMutex;
+extern ithread_rwlock_t g_internLock;
+extern int g_eventLog;
+
+/* GENA NOTIFY body captured in doc/cms.pcap */
+static const char g_eventBody[] =
+"<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\n"
+"<e:property>\n"
+"<ConfigurationUpdate>21,2015-07-27T19:23:51,&lt;?xml version=&quot;1.0&quot; encoding=&quot;UTF-8&quot;?&gt;"
+"&lt;cms:ParameterValueList xmlns:cms=&quot;urn:schemas-upnp-org:dm:cms&quot; "
+"xmlns:xsi=&quot;http://www.w3.org/2001/XMLSchema-instance&quot; "
+"xsi:schemaLocation=&quot;urn:schemas-upnp-org:dm:cms http://www.upnp.org/schemas/dm/cms.xsd&quot;&gt;"
+"&lt;Parameter&gt;&lt;ParameterPath&gt;/BBF/VoiceService/0/SIP/Network/0/Status&lt;/ParameterPath&gt;"
+"&lt;Value&gt;Up&lt;/Value&gt;&lt;/Parameter&gt;&lt;/cms:ParameterValueList&gt;</ConfigurationUpdate>\n"
+"</e:property>\n"
+"</e:propertyset>\n";
+
+static FILE *g_report = NULL;
+static unsigned long g_parameters = 0;
+static volatile int g_benchRun = 0;
+static int g_benchDevices = 0;
+
+struct EventWorker {
+	ithread_t thread;
+	unsigned int seed;
+	int index;
+	int threads;
+	unsigned long count;
+	struct Upnp_Event event;
+};
+
+/* Next EventKey of each device, so that no event is dropped as stale */
+static int *g_eventKeys = NULL;
+
+static double NowSeconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int BenchAddDevices(int devices)
+{
+	struct DeviceNode *node;
+	char UDN[NAME_SIZE];
+	/* Short enough for the "/event" and "/control" URLs to fit in NAME_SIZE */
+	char location[NAME_SIZE / 2];
+	int i;
+
+	for (i = 0; i < devices; i++) {
+		snprintf(UDN, sizeof(UDN), "uuid:bench-%d", i);
+		snprintf(location, sizeof(location), "http://127.0.0.%d:%d/ManageableDevice.xml",
+			1 + i / 60000, 1024 + i % 60000);
+		node = CtrlPointCreateNode(UDN, location, "B2BUA (bench)", location, 1800);
+		if (NULL == node)
+			return -1;
+		snprintf(node->device.service[SERVICE_CONTROL].SID,
+			sizeof(node->device.service[SERVICE_CONTROL].SID), "uuid:bench-sid-%d", i);
+		snprintf(node->device.service[SERVICE_CONTROL].eventURL,
+			sizeof(node->device.service[SERVICE_CONTROL].eventURL), "%s/event", location);
+		snprintf(node->device.service[SERVICE_CONTROL].controlURL,
+			sizeof(node->device.service[SERVICE_CONTROL].controlURL), "%s/control", location);
+		ithread_rwlock_wrlock(&g_deviceListLock);
+		CtrlPointInsertNode(node);
+		ithread_rwlock_unlock(&g_deviceListLock);
+	}
+	return 0;
+}
+
+static void *EventWorkerLoop(void *args)
+{
+	struct EventWorker *worker = (struct EventWorker *)args;
+	int devices = (g_benchDevices - worker->index + worker->threads - 1) / worker->threads;
+	int dev;
+
+	/* A thread owns every threads-th device, whose EventKeys then go up in order */
+	while (g_benchRun) {
+		dev = worker->index + worker->threads * (rand_r(&worker->seed) % devices);
+		snprintf(worker->event.Sid, sizeof(worker->event.Sid), "uuid:bench-sid-%d", dev);
+		worker->event.EventKey = g_eventKeys[dev]++;
+		CtrlPointCallbackEventHandler(UPNP_EVENT_RECEIVED, &worker->event, NULL);
+		worker->count++;
+	}
+	return NULL;
+}
+
+static double BenchEventsRun(struct EventWorker *workers, int threads, int seconds)
+{
+	unsigned long total = 0;
+	double start, elapsed;
+	int i;
+
+	g_benchRun = 1;
+	start = NowSeconds();
+	for (i = 0; i < threads; i++) {
+		workers[i].count = 0;
+		workers[i].index = i;
+		workers[i].threads = threads;
+		ithread_create(&workers[i].thread, NULL, EventWorkerLoop, &workers[i]);
+	}
+	sleep((unsigned int)seconds);
+	g_benchRun = 0;
+	for (i = 0; i < threads; i++) {
+		ithread_join(workers[i].thread, NULL);
+		total += workers[i].count;
+	}
+	elapsed = NowSeconds() - start;
+	return total / elapsed;
+}
+
+static int BenchEvents(int argc, char **argv)
+{
+	struct EventWorker *workers;
+	int devices = argc > 0 ? atoi(argv[0]) : 1000;
+	int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+	int seconds = argc > 2 ? atoi(argv[2]) : 3;
+	double base = 0, rate;
+	int threads, i;
+
+	if (devices <= 0 || maxThreads <= 0 || maxThreads > devices || seconds <= 0)
+		return -1;
+	g_benchDevices = devices;
+	if (BenchAddDevices(devices) < 0)
+		return -1;
+	workers = (struct EventWorker *)calloc((size_t)maxThreads, sizeof(struct EventWorker));
+	g_eventKeys = (int *)calloc((size_t)devices, sizeof(int));
+	if (NULL == workers || NULL == g_eventKeys)
+		return -1;
+	for (i = 0; i < maxThreads; i++) {
+		workers[i].seed = (unsigned int)i + 1;
+		workers[i].event.ChangedVariables = ixmlParseBuffer(g_eventBody);
+		if (NULL == workers[i].event.ChangedVariables) {
+			fprintf(g_report, "Error parsing the event body\n");
+			return -1;
+		}
+	}
+
+	fprintf(g_report, "# events: devices=%d seconds=%d\n", devices, seconds);
+	fprintf(g_report, "%8s %14s %8s\n", "threads", "events/s", "speedup");
+	for (threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+		rate = BenchEventsRun(workers, threads, seconds);
+		if (1 == threads) base = rate;
+		fprintf(g_report, "%8d %14.0f %8.2f\n", threads, rate, base > 0 ? rate / base : 0);
+		fflush(g_report);
+		if (threads == maxThreads) break;
+	}
+
+	for (i = 0; i < maxThreads; i++)
+		ixmlDocument_free(workers[i].event.ChangedVariables);
+	free(workers);
+	free(g_eventKeys);
+	g_eventKeys = NULL;
+	CtrlPointRemoveAll();
+	return 0;
+}
+
+/* Versions of ConfigurationUpdate cycled through by the shards benchmark */
+#define SHARD_VERSIONS	(16)
+
+struct ShardProducer {
+	ithread_t thread;
+	int index;
+	int producers;
+	unsigned long count;
+	long *sent;				/* last version sent to each device */
+	struct Upnp_Event event;
+};
+
+static IXML_Document *g_shardEvents[SHARD_VERSIONS];
+
+static void *ShardProducerLoop(void *args)
+{
+	struct ShardProducer *producer = (struct ShardProducer *)args;
+	int dev = producer->index;
+
+	/* Each device has a single producer, so its events are sent in order */
+	while (g_benchRun) {
+		snprintf(producer->event.Sid, sizeof(producer->event.Sid), "uuid:bench-sid-%d", dev);
+		producer->event.EventKey = (int)producer->sent[dev];
+		producer->event.ChangedVariables = g_shardEvents[producer->sent[dev] % SHARD_VERSIONS];
+		producer->sent[dev]++;
+		CtrlPointCallbackEventHandler(UPNP_EVENT_RECEIVED, &producer->event, NULL);
+		producer->count++;
+		dev += producer->producers;
+		if (dev >= g_benchDevices)
+			dev = producer->index;
+	}
+	return NULL;
+}
+
+/* Devices whose last event processed is not the last one sent */
+static int ShardCheckOrder(const long *sent)
+{
+	struct DeviceNode *node;
+	char SID[NAME_SIZE];
+	int dev, errors = 0;
+
+	ithread_rwlock_rdlock(&g_deviceListLock);
+	for (dev = 0; dev < g_benchDevices; dev++) {
+		snprintf(SID, sizeof(SID), "uuid:bench-sid-%d", dev);
+		node = IndexLookup(&g_sidIndex, SID, NULL);
+		if (sent[dev] > 0 && (NULL == node
+			|| node->cache.version != (sent[dev] - 1) % SHARD_VERSIONS + 1))
+			errors++;
+	}
+	ithread_rwlock_unlock(&g_deviceListLock);
+	return errors;
+}
+
+static double BenchShardsRun(struct ShardProducer *producers, int count, int seconds)
+{
+	unsigned long before = MetricRead(METRIC_EVENTS_ROUTED);
+	double start, elapsed;
+	int i;
+
+	CtrlPointStartDispatch();
+	g_benchRun = 1;
+	start = NowSeconds();
+	for (i = 0; i < count; i++)
+		ithread_create(&producers[i].thread, NULL, ShardProducerLoop, &producers[i]);
+	sleep((unsigned int)seconds);
+	g_benchRun = 0;
+	for (i = 0; i < count; i++)
+		ithread_join(producers[i].thread, NULL);
+	/* Processes what is still queued */
+	CtrlPointStopDispatch();
+	elapsed = NowSeconds() - start;
+	return (MetricRead(METRIC_EVENTS_ROUTED) - before) / elapsed;
+}
+
+static int BenchShards(int argc, char **argv)
+{
+	struct ShardProducer *producers;
+	long *sent;
+	char value[16];
+	int devices = argc > 0 ? atoi(argv[0]) : 1000;
+	int maxWorkers = argc > 1 ? atoi(argv[1]) : 8;
+	int seconds = argc > 2 ? atoi(argv[2]) : 3;
+	double base = 0, rate;
+	int workers, errors, i;
+
+	if (devices <= 0 || maxWorkers <= 0 || maxWorkers > DISPATCH_MAX_WORKERS || seconds <= 0)
+		return -1;
+	g_benchDevices = devices;
+	if (BenchAddDevices(devices) < 0)
+		return -1;
+	for (i = 0; i < SHARD_VERSIONS; i++) {
+		char *body = (char *)malloc(sizeof(g_eventBody) + 16);
+		const char *rest = strchr(g_eventBody, ',');
+
+		if (NULL == body)
+			return -1;
+		snprintf(body, sizeof(g_eventBody) + 16, "%.*s%d%s",
+			(int)(strstr(g_eventBody, "<ConfigurationUpdate>") - g_eventBody + strlen("<ConfigurationUpdate>")),
+			g_eventBody, i + 1, rest);
+		g_shardEvents[i] = ixmlParseBuffer(body);
+		free(body);
+		if (NULL == g_shardEvents[i]) {
+			fprintf(g_report, "Error parsing the event body\n");
+			return -1;
+		}
+	}
+	producers = (struct ShardProducer *)calloc((size_t)maxWorkers, sizeof(struct ShardProducer));
+	sent = (long *)calloc((size_t)devices, sizeof(long));
+	if (NULL == producers || NULL == sent)
+		return -1;
+	for (i = 0; i < maxWorkers; i++) {
+		producers[i].index = i;
+		producers[i].producers = maxWorkers;
+		producers[i].sent = sent;
+	}
+
+	/* Producers wait for room rather than lose events */
+	CtrlPointSetOption("dispatchPolicy", "0");
+	fprintf(g_report, "# shards: devices=%d producers=%d seconds=%d\n",
+		devices, maxWorkers < devices ? maxWorkers : devices, seconds);
+	fprintf(g_report, "%8s %14s %8s %10s\n", "workers", "events/s", "speedup", "misordered");
+	for (workers = 1; ; workers = workers * 2 < maxWorkers ? workers * 2 : maxWorkers) {
+		snprintf(value, sizeof(value), "%d", workers);
+		CtrlPointSetOption("dispatchWorkers", value);
+		rate = BenchShardsRun(producers, maxWorkers < devices ? maxWorkers : devices, seconds);
+		errors = ShardCheckOrder(sent);
+		if (1 == workers) base = rate;
+		fprintf(g_report, "%8d %14.0f %8.2f %10d\n", workers, rate, base > 0 ? rate / base : 0, errors);
+		fflush(g_report);
+		if (workers == maxWorkers) break;
+	}
+
+	for (i = 0; i < SHARD_VERSIONS; i++)
+		ixmlDocument_free(g_shardEvents[i]);
+	free(sent);
+	free(producers);
+	CtrlPointRemoveAll();
+	return 0;
+}
+
+/* The ConfigurationUpdate handling of StateVarUpdate before the streaming
+* parser, the xml being cut at MAX_BUFFER instead of overflowing */
+static void LegacyParse(const char *value)
+{
+	IXML_Document *doc;
+	IXML_NodeList *params;
+	IXML_NodeList *pathNodeList;
+	IXML_NodeList *valueNodeList;
+	IXML_Element *element;
+	char *tmpState = strdup(value);
+	char *unescaped;
+	char *pathNodeValue;
+	char *valueNodeValue;
+	char version[NAME_SIZE]={0};
+	char lastDateTime[NAME_SIZE]={0};
+	char xmlBuffer[MAX_BUFFER]={0};
+	unsigned int i;
+
+	if (3 != sscanf(tmpState,"%[^,],%[^,],%2047[^,]",version,lastDateTime,xmlBuffer)) {
+		free(tmpState);
+		return;
+	}
+	unescaped = Unescaped(xmlBuffer);
+	doc = unescaped ? ixmlParseBuffer(unescaped) : NULL;
+	params = doc ? ixmlDocument_getElementsByTagName(doc,"Parameter") : NULL;
+	for (i = 0; params && i < ixmlNodeList_length(params); i++) {
+		element = (IXML_Element *)ixmlNodeList_item(params, i);
+		pathNodeList = ixmlElement_getElementsByTagName(element,"ParameterPath");
+		if (NULL == pathNodeList)
+			continue;
+		pathNodeValue = GetElementValue((IXML_Element *)ixmlNodeList_item(pathNodeList, 0));
+		valueNodeList = ixmlElement_getElementsByTagName(element,"Value");
+		if (valueNodeList) {
+			valueNodeValue = GetElementValue((IXML_Element *)ixmlNodeList_item(valueNodeList, 0));
+			if (valueNodeValue) {
+				g_parameters++;
+				free(valueNodeValue);
+			}
+			ixmlNodeList_free(valueNodeList);
+		}
+		if (pathNodeValue) free(pathNodeValue);
+		ixmlNodeList_free(pathNodeList);
+	}
+	if (params) ixmlNodeList_free(params);
+	if (doc) ixmlDocument_free(doc);
+	if (unescaped) free(unescaped);
+	free(tmpState);
+}
+
+static void CountParameter(const char *path, const char *value, void *cookie)
+{
+	(void)path;
+	(void)value;
+	(void)cookie;
+	g_parameters++;
+}
+
+static void StreamParse(const char *value)
+{
+	struct ConfigurationUpdate update;
+
+	if (0 == ParseConfigurationUpdate(value, &update) && update.xml)
+		ParseParameterValueList(update.xml, CountParameter, NULL);
+}
+
+/* Appends the ConfigurationUpdate values found in file to values */
+static int LoadConfigurationUpdates(const char *file, char **values, int max)
+{
+	static const char startTag[] = "<ConfigurationUpdate>";
+	static const char endTag[] = "</ConfigurationUpdate>";
+	FILE *fp = fopen(file, "rb");
+	IXML_Document *doc;
+	char *data, *chunk, *p, *end, *element;
+	long size;
+	int count = 0;
+
+	if (NULL == fp)
+		return -1;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = (char *)malloc((size_t)size + 1);
+	if (NULL == data || (size_t)size != fread(data, 1, (size_t)size, fp)) {
+		fclose(fp);
+		free(data);
+		return -1;
+	}
+	fclose(fp);
+	data[size] = '\0';
+
+	/* The capture is binary, search it piecewise */
+	for (chunk = data; chunk < data + size && count < max; chunk += strlen(chunk) + 1) {
+		for (p = chunk; count < max && (p = strstr(p, startTag)); p = end) {
+			end = strstr(p, endTag);
+			if (NULL == end)
+				break;
+			element = strndup(p, (size_t)(end - p) + sizeof(endTag) - 1);
+			doc = element ? ixmlParseBuffer(element) : NULL;
+			if (doc) {
+				values[count] = GetFirstDocumentItem(doc, "ConfigurationUpdate");
+				if (values[count] && strchr(values[count], '<'))
+					count++;
+				else if (values[count])
+					free(values[count]);
+				ixmlDocument_free(doc);
+			}
+			free(element);
+		}
+	}
+	free(data);
+	return count;
+}
+
+/* A value whose document is longer than MAX_BUFFER and has commas */
+static char *MakeLargeUpdate(void)
+{
+	struct StrBuf buf;
+	char line[MAX_BUFFER];
+	int i;
+
+	StrBufInit(&buf);
+	snprintf(line, sizeof(line), "99,2015-07-27T20:47:22,<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+		"<cms:ParameterValueList xmlns:cms=\"urn:schemas-upnp-org:dm:cms\">");
+	StrBufAppend(&buf, line, strlen(line));
+	for (i = 0; i < 48; i++) {
+		snprintf(line, sizeof(line), "<Parameter><ParameterPath>/BBF/VoiceService/0/VoiceProfile/0/Line/%d/CallingFeatures/CallerIDName</ParameterPath>"
+			"<Value>Line %d, &quot;Front desk&quot; &amp; lobby</Value></Parameter>", i, i);
+		StrBufAppend(&buf, line, strlen(line));
+	}
+	StrBufAppend(&buf, "</cms:ParameterValueList>", strlen("</cms:ParameterValueList>"));
+	return buf.data;
+}
+
+static int BenchParse(int argc, char **argv)
+{
+	char *values[64];
+	int iterations = argc > 0 ? atoi(argv[0]) : 20000;
+	const char *file = argc > 1 ? argv[1] : "doc/cms.pcap";
+	struct {
+		const char *name;
+		void (*parse)(const char *value);
+	} paths[] = {
+		{"legacy", LegacyParse},
+		{"stream", StreamParse},
+	};
+	double start, elapsed;
+	int count, i, j, k;
+
+	if (iterations <= 0)
+		return -1;
+	count = LoadConfigurationUpdates(file, values, 63);
+	if (count < 0) {
+		fprintf(g_report, "Error reading %s\n", file);
+		return -1;
+	}
+	values[count] = MakeLargeUpdate();
+	if (NULL == values[count])
+		return -1;
+	count++;
+
+	fprintf(g_report, "# parse: values=%d (%d from %s) iterations=%d\n",
+		count, count - 1, file, iterations);
+	fprintf(g_report, "%8s %12s %12s %12s\n", "path", "ns/value", "params", "large");
+	for (k = 0; k < (int)(sizeof(paths) / sizeof(paths[0])); k++) {
+		unsigned long large;
+
+		/* Parameters found in the large value alone */
+		g_parameters = 0;
+		paths[k].parse(values[count - 1]);
+		large = g_parameters;
+
+		g_parameters = 0;
+		start = NowSeconds();
+		for (i = 0; i < iterations; i++) {
+			for (j = 0; j < count; j++)
+				paths[k].parse(values[j]);
+		}
+		elapsed = NowSeconds() - start;
+		fprintf(g_report, "%8s %12.0f %12lu %12lu\n", paths[k].name,
+			elapsed * 1e9 / ((double)iterations * count), g_parameters / iterations, large);
+		fflush(g_report);
+	}
+
+	for (j = 0; j < count; j++)
+		free(values[j]);
+	return 0;
+}
+
+/* str_sub, Escaped and Unescaped as they were before the single pass
+* versions: one realloc and strlen per match, one pass per entity */
+static char *LegacyStrSub(const char *st, const char *orig, const char *repl)
+{
+	char *buffer = strdup("");
+	const char *p = st;
+	const char *ch = strstr(p, orig);
+
+	while (ch != NULL) {
+		buffer = (char *)realloc(buffer, (strlen(buffer) + (ch-p ) + strlen(repl) + 1) * sizeof(char));
+		buffer = strncat(buffer, p, ch-p);
+		buffer = strcat(buffer, repl);
+		p = ch + strlen(orig);
+		ch = strstr(p, orig);
+	}
+	buffer = (char *)realloc(buffer, (strlen(buffer) + strlen(p) + 1) * sizeof(char));
+	buffer = strcat(buffer, p);
+	return buffer;
+}
+
+static const struct {
+	const char *in;
+	const char *out;
+} g_legacyPattern[] = {
+	{ "&amp;",  "&"  },
+	{ "&apos;", "'"  },
+	{ "&lt;",   "<"  },
+	{ "&gt;",   ">"  },
+	{ "&quot;", "\"" }
+};
+
+static char *LegacyEscaped(const char *st)
+{
+	char *st_in = strdup(st);
+	char *st_out;
+	size_t i;
+
+	for (i = 0; i < sizeof(g_legacyPattern)/sizeof(g_legacyPattern[0]); i++) {
+		st_out = LegacyStrSub(st_in, g_legacyPattern[i].out, g_legacyPattern[i].in);
+		free(st_in);
+		st_in = st_out;
+	}
+	return st_in;
+}
+
+static char *LegacyUnescaped(const char *st)
+{
+	char *st_in = strdup(st);
+	char *st_out;
+	size_t i;
+
+	for (i = 0; i < sizeof(g_legacyPattern)/sizeof(g_legacyPattern[0]); i++) {
+		st_out = LegacyStrSub(st_in, g_legacyPattern[i].in, g_legacyPattern[i].out);
+		free(st_in);
+		st_in = st_out;
+	}
+	return st_in;
+}
+
+/* A ParameterValueList document with the given number of parameters */
+static char *MakeParameterValueList(int parameters)
+{
+	struct StrBuf buf;
+	char line[MAX_BUFFER];
+	int i;
+
+	StrBufInit(&buf);
+	snprintf(line, sizeof(line), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+		"<cms:ParameterValueList xmlns:cms=\"urn:schemas-upnp-org:dm:cms\">");
+	StrBufAppend(&buf, line, strlen(line));
+	for (i = 0; i < parameters; i++) {
+		snprintf(line, sizeof(line), "<Parameter><ParameterPath>/BBF/VoiceService/0/VoiceProfile/0/Line/%d/SIP/AuthUserName</ParameterPath>"
+			"<Value>line%d@example.com</Value></Parameter>", i, i);
+		StrBufAppend(&buf, line, strlen(line));
+	}
+	StrBufAppend(&buf, "</cms:ParameterValueList>", strlen("</cms:ParameterValueList>"));
+	return buf.data;
+}
+
+static double BenchEscapeRun(char *(*func)(const char *), const char *st, int iterations)
+{
+	double start = NowSeconds();
+	int i;
+
+	for (i = 0; i < iterations; i++)
+		free(func(st));
+	return (NowSeconds() - start) * 1e9 / iterations;
+}
+
+static int BenchEscape(int argc, char **argv)
+{
+	int iterations = argc > 0 ? atoi(argv[0]) : 2000;
+	int sizes[] = {2, 24, 400};
+	char *plain, *escaped, *legacy;
+	double ns[4];
+	size_t k;
+
+	if (iterations <= 0)
+		return -1;
+	fprintf(g_report, "# escape: iterations=%d simd=%s\n", iterations,
+#if defined(__AVX2__)
+		"avx2"
+#elif defined(__SSE2__)
+		"sse2"
+#else
+		"none"
+#endif
+		);
+	fprintf(g_report, "%8s %12s %12s %12s %12s %12s\n", "bytes",
+		"escape.old", "escape.new", "unesc.old", "unesc.new", "speedup");
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		plain = MakeParameterValueList(sizes[k]);
+		if (NULL == plain)
+			return -1;
+		escaped = Escaped(plain);
+		legacy = LegacyEscaped(plain);
+		if (NULL == escaped || strcmp(escaped, legacy) != 0) {
+			fprintf(g_report, "Escaped differs from the str_sub chain\n");
+			return -1;
+		}
+		free(legacy);
+		legacy = Unescaped(escaped);
+		if (NULL == legacy || strcmp(legacy, plain) != 0) {
+			fprintf(g_report, "Unescaped does not reverse Escaped\n");
+			return -1;
+		}
+		free(legacy);
+
+		ns[0] = BenchEscapeRun(LegacyEscaped, plain, iterations);
+		ns[1] = BenchEscapeRun(Escaped, plain, iterations);
+		ns[2] = BenchEscapeRun(LegacyUnescaped, escaped, iterations);
+		ns[3] = BenchEscapeRun(Unescaped, escaped, iterations);
+		fprintf(g_report, "%8lu %12.0f %12.0f %12.0f %12.0f %5.1f/%5.1f\n",
+			(unsigned long)strlen(plain), ns[0], ns[1], ns[2], ns[3],
+			ns[1] > 0 ? ns[0] / ns[1] : 0, ns[3] > 0 ? ns[2] / ns[3] : 0);
+		fflush(g_report);
+		free(escaped);
+		free(plain);
+	}
+	return 0;
+}
+
+/* Description document of the device in doc/cms.pcap, whose segments are
+* split in the capture */
+static const char g_description[] =
+"<?xml version=\"1.0\"?>\n"
+"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+"  <specVersion>\n"
+"    <major>1</major>\n"
+"    <minor>0</minor>\n"
+"  </specVersion>\n"
+"  <device>\n"
+"    <deviceType>urn:schemas-upnp-org:device:ManageableDevice:2</deviceType>\n"
+"<friendlyName>B2BUA (intelce)</friendlyName>\n"
+"    <manufacturer>baustem</manufacturer>\n"
+"    <manufacturerURL>http://www.baustem.com</manufacturerURL>\n"
+"    <modelDescription>B2BUA</modelDescription>\n"
+"    <modelName>B2BUA</modelName>\n"
+"    <modelNumber>1</modelNumber>\n"
+"    <modelURL>http://www.baustem.com</modelURL>\n"
+"    <serialNumber>1234567890</serialNumber>\n"
+"<UDN>uuid:03cc5f92-1dd2-11b2-abfd-C0A000046200</UDN>\n"
+"    <UPC></UPC>\n"
+"    <serviceList>\n"
+"%s"
+"      <service>\n"
+"        <serviceType>urn:schemas-upnp-org:service:BasicManagement:2</serviceType>\n"
+"        <serviceId>urn:upnp-org:serviceId:BasicManagement</serviceId>\n"
+"        <SCPDURL>BasicManagement.xml</SCPDURL>\n"
+"        <controlURL>BasicManagement</controlURL>\n"
+"        <eventSubURL>BasicManagement</eventSubURL>\n"
+"      </service>\n"
+"      <service>\n"
+"        <serviceType>urn:schemas-upnp-org:service:ConfigurationManagement:2</serviceType>\n"
+"        <serviceId>urn:upnp-org:serviceId:ConfigurationManagement</serviceId>\n"
+"        <SCPDURL>ConfigurationManagement.xml</SCPDURL>\n"
+"        <controlURL>ConfigurationManagement</controlURL>\n"
+"        <eventSubURL>ConfigurationManagement</eventSubURL>\n"
+"      </service>\n"
+"      <service>\n"
+"        <serviceType>urn:schemas-upnp-org:service:DeviceProtection:1</serviceType>\n"
+"        <serviceId>urn:upnp-org:serviceId:DeviceProtection</serviceId>\n"
+"        <SCPDURL>DeviceProtection.xml</SCPDURL>\n"
+"        <controlURL>DeviceProtection</controlURL>\n"
+"        <eventSubURL>DeviceProtection</eventSubURL>\n"
+"      </service>\n"
+"      </serviceList>\n"
+"    <presentationURL></presentationURL>\n"
+"  </device>\n"
+"</root>\n";
+
+/* One function on one input */
+struct MicroCase {
+	const char *function;
+	char input[NAME_SIZE];
+	size_t bytes;			/* size of the input */
+	void (*run)(void *arg);
+	void *arg;
+	unsigned long iterations;	/* per sample */
+	double median;			/* ns per call */
+	double best;
+};
+
+#define MICRO_CASES		(64)
+#define MICRO_SAMPLES	(5)
+
+static char *g_microState[CP_MAXVARS];
+static struct ParameterCache g_microCache = {{NULL, 0, NULL, 0, NULL}, 0, -1, NULL};
+static char g_microUDN[] = "uuid:03cc5f92-1dd2-11b2-abfd-C0A000046200";
+
+static void MicroStrSub(void *arg)
+{
+	free(str_sub((const char *)arg, "&lt;", "<"));
+}
+
+static void MicroEscaped(void *arg)
+{
+	free(Escaped((const char *)arg));
+}
+
+static void MicroUnescaped(void *arg)
+{
+	free(Unescaped((const char *)arg));
+}
+
+static void MicroGetFirstDocumentItem(void *arg)
+{
+	free(GetFirstDocumentItem((IXML_Document *)arg, "ParameterValueList"));
+}
+
+static void MicroFindAndParseService(void *arg)
+{
+	char *serviceId = NULL, *eventURL = NULL, *controlURL = NULL;
+
+	FindAndParseService((IXML_Document *)arg, "http://192.168.1.202:50174/ManageableDevice.xml",
+		"urn:schemas-upnp-org:service:ConfigurationManagement:2", &serviceId, &eventURL, &controlURL);
+	free(serviceId);
+	free(eventURL);
+	free(controlURL);
+}
+
+static void MicroStateVarUpdate(void *arg)
+{
+	int i;
+
+	/* Start from nothing known, so every call inserts and notifies every value */
+	ParameterCacheFree(&g_microCache);
+	g_microCache.version = -1;
+	for (i = 0; i < CP_MAXVARS; i++)
+		g_microState[i][0] = '\0';
+	StateVarUpdate(g_microUDN, SERVICE_CONTROL, (IXML_Document *)arg, g_microState, &g_microCache);
+}
+
+static void MicroPrintParameters(void *arg)
+{
+	PrintParameters((const char *)arg);
+}
+
+/* Appends the ConfigurationUpdate values logged in file to values */
+static int LoadLoggedUpdates(const char *file, char **values, int max)
+{
+	static const char prefix[] = "ConfigurationUpdate='";
+	FILE *fp = fopen(file, "r");
+	char line[MAX_BUFFER];
+	char *start, *end;
+	int count = 0;
+
+	if (NULL == fp)
+		return -1;
+	while (count < max && fgets(line, sizeof(line), fp)) {
+		start = strstr(line, prefix);
+		end = start ? strrchr(line, '\'') : NULL;
+		if (NULL == start || end < start + sizeof(prefix) - 1)
+			continue;
+		start += sizeof(prefix) - 1;
+		values[count] = strndup(start, (size_t)(end - start));
+		if (values[count])
+			count++;
+	}
+	fclose(fp);
+	return count;
+}
+
+/* The longest of values, which are freed */
+static char *Longest(char **values, int count)
+{
+	char *longest = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (NULL == longest || strlen(values[i]) > strlen(longest)) {
+			free(longest);
+			longest = values[i];
+		} else {
+			free(values[i]);
+		}
+	}
+	return longest;
+}
+
+/* An action result with list as its ParameterValueList argument */
+static IXML_Document *MakeActionResult(const char *list)
+{
+	struct StrBuf buf;
+	char *escaped = Escaped(list);
+	IXML_Document *doc;
+
+	if (NULL == escaped)
+		return NULL;
+	StrBufInit(&buf);
+	StrBufAppend(&buf, "<u:GetValuesResponse xmlns:u=\"urn:schemas-upnp-org:service:ConfigurationManagement:2\">"
+		"<ParameterValueList>", strlen("<u:GetValuesResponse xmlns:u=\"urn:schemas-upnp-org:service:ConfigurationManagement:2\">"
+		"<ParameterValueList>"));
+	StrBufAppend(&buf, escaped, strlen(escaped));
+	StrBufAppend(&buf, "</ParameterValueList></u:GetValuesResponse>", strlen("</ParameterValueList></u:GetValuesResponse>"));
+	free(escaped);
+	doc = buf.data ? ixmlParseBuffer(buf.data) : NULL;
+	StrBufFree(&buf);
+	return doc;
+}
+
+/* A GENA propertyset with head and value as its ConfigurationUpdate */
+static IXML_Document *MakeEventBody(const char *head, const char *value)
+{
+	struct StrBuf buf;
+	char *escaped = Escaped(value);
+	IXML_Document *doc;
+
+	if (NULL == escaped)
+		return NULL;
+	StrBufInit(&buf);
+	StrBufAppend(&buf, "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\"><e:property><ConfigurationUpdate>",
+		strlen("<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\"><e:property><ConfigurationUpdate>"));
+	StrBufAppend(&buf, head, strlen(head));
+	StrBufAppend(&buf, escaped, strlen(escaped));
+	StrBufAppend(&buf, "</ConfigurationUpdate></e:property></e:propertyset>",
+		strlen("</ConfigurationUpdate></e:property></e:propertyset>"));
+	free(escaped);
+	doc = buf.data ? ixmlParseBuffer(buf.data) : NULL;
+	StrBufFree(&buf);
+	return doc;
+}
+
+/* The captured description with more services in front */
+static char *MakeDescription(int services)
+{
+	struct StrBuf extra;
+	char line[MAX_BUFFER];
+	char *desc;
+	int i;
+
+	StrBufInit(&extra);
+	StrBufAppend(&extra, "", 0);
+	for (i = 0; i < services; i++) {
+		snprintf(line, sizeof(line), "      <service>\n"
+			"        <serviceType>urn:example-com:service:Vendor%d:1</serviceType>\n"
+			"        <serviceId>urn:example-com:serviceId:Vendor%d</serviceId>\n"
+			"        <SCPDURL>Vendor%d.xml</SCPDURL>\n"
+			"        <controlURL>Vendor%d</controlURL>\n"
+			"        <eventSubURL>Vendor%d</eventSubURL>\n"
+			"      </service>\n", i, i, i, i, i);
+		StrBufAppend(&extra, line, strlen(line));
+	}
+	desc = extra.data ? (char *)malloc(sizeof(g_description) + extra.len) : NULL;
+	if (desc)
+		sprintf(desc, g_description, extra.data);
+	StrBufFree(&extra);
+	return desc;
+}
+
+static struct MicroCase *MicroAdd(struct MicroCase *cases, int *count, const char *function,
+	const char *input, size_t bytes, void (*run)(void *arg), void *arg)
+{
+	struct MicroCase *c;
+
+	if (NULL == arg || *count >= MICRO_CASES)
+		return NULL;
+	c = &cases[(*count)++];
+	memset(c, 0, sizeof(*c));
+	c->function = function;
+	snprintf(c->input, sizeof(c->input), "%s", input);
+	c->bytes = bytes;
+	c->run = run;
+	c->arg = arg;
+	return c;
+}
+
+static double MicroSample(struct MicroCase *c)
+{
+	double start = NowSeconds();
+	unsigned long i;
+
+	for (i = 0; i < c->iterations; i++)
+		c->run(c->arg);
+	return (NowSeconds() - start) * 1e9 / c->iterations;
+}
+
+static void MicroRun(struct MicroCase *c, double sampleSeconds)
+{
+	double ns[MICRO_SAMPLES];
+	double elapsed;
+	int i;
+
+	/* Grow the iterations until a sample takes about sampleSeconds */
+	c->run(c->arg);
+	for (c->iterations = 1; ; c->iterations *= 2) {
+		elapsed = MicroSample(c) * c->iterations / 1e9;
+		if (elapsed >= sampleSeconds / 2)
+			break;
+	}
+	if (elapsed > 0 && elapsed < sampleSeconds)
+		c->iterations = (unsigned long)(c->iterations * sampleSeconds / elapsed);
+	for (i = 0; i < MICRO_SAMPLES; i++)
+		ns[i] = MicroSample(c);
+	qsort(ns, MICRO_SAMPLES, sizeof(double), CompareDouble);
+	c->median = ns[MICRO_SAMPLES / 2];
+	c->best = ns[0];
+}
+
+static void MicroReport(const char *format, struct MicroCase *c, int first)
+{
+	double mbs = c->median > 0 ? c->bytes / c->median * 1e3 : 0;
+
+	if (0 == strcmp(format, "csv")) {
+		if (first)
+			fprintf(g_report, "function,input,bytes,iterations,median_ns,best_ns,mb_per_s\n");
+		fprintf(g_report, "%s,%s,%lu,%lu,%.1f,%.1f,%.2f\n", c->function, c->input,
+			(unsigned long)c->bytes, c->iterations, c->median, c->best, mbs);
+	} else if (0 == strcmp(format, "json")) {
+		fprintf(g_report, "%s\n  {\"function\": \"%s\", \"input\": \"%s\", \"bytes\": %lu, "
+			"\"iterations\": %lu, \"median_ns\": %.1f, \"best_ns\": %.1f, \"mb_per_s\": %.2f}",
+			first ? "[" : ",", c->function, c->input, (unsigned long)c->bytes, c->iterations,
+			c->median, c->best, mbs);
+	} else {
+		if (first)
+			fprintf(g_report, "%-20s %-14s %9s %10s %12s %12s %9s\n", "function", "input",
+				"bytes", "iterations", "median ns", "best ns", "MB/s");
+		fprintf(g_report, "%-20s %-14s %9lu %10lu %12.0f %12.0f %9.1f\n", c->function, c->input,
+			(unsigned long)c->bytes, c->iterations, c->median, c->best, mbs);
+	}
+	fflush(g_report);
+}
+
+static int BenchMicro(int argc, char **argv)
+{
+	static const int parameters[] = {1, 10, 100, 1000, 5000};
+	static const int services[] = {0, 30, 300};
+	const char *format = argc > 0 ? argv[0] : "text";
+	double sampleSeconds = (argc > 1 ? atoi(argv[1]) : 200) / 1e3;
+	const char *filter = argc > 2 ? argv[2] : "";
+	struct MicroCase cases[MICRO_CASES];
+	struct ConfigurationUpdate update;
+	char *values[64];
+	char *plain[8];
+	char *escaped[8];
+	char *lists[8];
+	char names[8][32];
+	char listNames[8][32];
+	IXML_Document *docs[32];
+	char *descs[4];
+	char name[NAME_SIZE];
+	int nplain = 0, ndocs = 0, ndescs = 0, nlists = 0;
+	int count = 0, reported = 0;
+	int i, n;
+
+	if (sampleSeconds <= 0 || (strcmp(format, "text") && strcmp(format, "csv") && strcmp(format, "json")))
+		return -1;
+	for (i = 0; i < CP_MAXVARS; i++) {
+		g_microState[i] = (char *)calloc(1, MAX_VAL_LEN);
+		if (NULL == g_microState[i])
+			return -1;
+	}
+
+	/* The longest captured and logged values, then generated ones */
+	/* The inputs are named after their source, or their number of parameters */
+	n = LoadConfigurationUpdates("doc/cms.pcap", values, 64);
+	if (n > 0) {
+		plain[nplain] = Longest(values, n);
+		strcpy(names[nplain], "pcap");
+		if (0 == ParseConfigurationUpdate(plain[nplain], &update) && update.xml) {
+			strcpy(listNames[nlists], "pcap");
+			lists[nlists++] = (char *)update.xml;
+		}
+		nplain++;
+	}
+	n = LoadLoggedUpdates("doc/cms.log", values, 64);
+	if (n > 0) {
+		strcpy(names[nplain], "log");
+		plain[nplain++] = Longest(values, n);
+	}
+	for (i = 0; i < (int)(sizeof(parameters) / sizeof(parameters[0])); i++) {
+		plain[nplain] = MakeParameterValueList(parameters[i]);
+		if (NULL == plain[nplain])
+			continue;
+		snprintf(names[nplain], sizeof(names[nplain]), "%dparams", parameters[i]);
+		strcpy(listNames[nlists], names[nplain]);
+		lists[nlists++] = plain[nplain++];
+	}
+	for (i = 0; i < nplain; i++)
+		escaped[i] = Escaped(plain[i]);
+
+	for (i = 0; i < nplain && escaped[i]; i++) {
+		strcpy(name, names[i]);
+		MicroAdd(cases, &count, "str_sub", name, strlen(escaped[i]), MicroStrSub, escaped[i]);
+		MicroAdd(cases, &count, "Escaped", name, strlen(plain[i]), MicroEscaped, plain[i]);
+		MicroAdd(cases, &count, "Unescaped", name, strlen(escaped[i]), MicroUnescaped, escaped[i]);
+		/* The generated documents get the version and dateTime of an update */
+		docs[ndocs] = MakeEventBody(strstr(name, "params") ? "2,2015-07-27T19:23:29," : "", plain[i]);
+		MicroAdd(cases, &count, "StateVarUpdate", name, strlen(escaped[i]), MicroStateVarUpdate, docs[ndocs]);
+		if (docs[ndocs]) ndocs++;
+	}
+	for (i = 0; i < nlists; i++) {
+		strcpy(name, listNames[i]);
+		docs[ndocs] = MakeActionResult(lists[i]);
+		MicroAdd(cases, &count, "GetFirstDocumentItem", name, strlen(lists[i]), MicroGetFirstDocumentItem, docs[ndocs]);
+		if (docs[ndocs]) ndocs++;
+		MicroAdd(cases, &count, "PrintParameters", name, strlen(lists[i]), MicroPrintParameters, lists[i]);
+	}
+	for (i = 0; i < (int)(sizeof(services) / sizeof(services[0])); i++) {
+		snprintf(name, sizeof(name), "%dservices", services[i] + 3);
+		descs[ndescs] = MakeDescription(services[i]);
+		if (NULL == descs[ndescs])
+			continue;
+		docs[ndocs] = ixmlParseBuffer(descs[ndescs]);
+		MicroAdd(cases, &count, "FindAndParseService", name, strlen(descs[ndescs]), MicroFindAndParseService, docs[ndocs]);
+		if (docs[ndocs]) ndocs++;
+		ndescs++;
+	}
+
+	if (0 == strcmp(format, "text"))
+		fprintf(g_report, "# micro: sample=%.0fms samples=%d simd=%s\n", sampleSeconds * 1e3, MICRO_SAMPLES,
+#if defined(__AVX2__)
+			"avx2"
+#elif defined(__SSE2__)
+			"sse2"
+#else
+			"none"
+#endif
+			);
+	for (i = 0; i < count; i++) {
+		if (NULL == strstr(cases[i].function, filter) && NULL == strstr(cases[i].input, filter))
+			continue;
+		MicroRun(&cases[i], sampleSeconds);
+		MicroReport(format, &cases[i], 0 == reported++);
+	}
+	if (0 == strcmp(format, "json"))
+		fprintf(g_report, "%s\n", reported ? "\n]" : "[]");
+
+	for (i = 0; i < ndocs; i++)
+		ixmlDocument_free(docs[i]);
+	for (i = 0; i < ndescs; i++)
+		free(descs[i]);
+	for (i = 0; i < nplain; i++) {
+		free(plain[i]);
+		free(escaped[i]);
+	}
+	for (i = 0; i < CP_MAXVARS; i++)
+		free(g_microState[i]);
+	ParameterCacheFree(&g_microCache);
+	return 0;
+}
+
+/*! Mappings between benchmark names and their entry points */
+static struct {
+	const char *name;
+	int (*run)(int argc, char **argv);
+	const char *args;
+} g_benchList[] = {
+	{"events", BenchEvents, "[<devices> [<threads> [<seconds>]]]"},
+	{"shards", BenchShards, "[<devices> [<workers> [<seconds>]]]"},
+	{"parse", BenchParse, "[<iterations> [<pcap>]]"},
+	{"escape", BenchEscape, "[<iterations>]"},
+	{"micro", BenchMicro, "[text|csv|json] [<ms>] [<filter>]"},
+};
+
+int main(int argc, char **argv)
+{
+	int numOfBench = (int)(sizeof(g_benchList) / sizeof(g_benchList[0]));
+	int i, rc = -1;
+
+	/* Keep the report, silence the control point. Per-event prints are
+	 * off rather than just sent to /dev/null, where the stdio lock of
+	 * stdout would still be contended by every thread. */
+	g_report = fdopen(dup(fileno(stdout)), "w");
+	if (NULL == g_report || NULL == freopen("/dev/null", "w", stdout))
+		return 1;
+	g_eventLog = 0;
+	ithread_rwlock_init(&g_deviceListLock, NULL);
+	ithread_mutex_init(&g_timerMutex, NULL);
+	ithread_cond_init(&g_timerCond, NULL);
+	ithread_rwlock_init(&g_dispatchLock, NULL);
+	ithread_mutex_init(&g_dispatchGate, NULL);
+	ithread_mutex_init(&g_dispatchRouteMutex, NULL);
+	ithread_rwlock_init(&g_internLock, NULL);
+
+	for (i = 0; argc > 1 && i < numOfBench; i++) {
+		if (0 == strcasecmp(argv[1], g_benchList[i].name)) {
+			rc = g_benchList[i].run(argc - 2, argv + 2);
+			break;
+		}
+	}
+	if (argc <= 1 || i == numOfBench) {
+		fprintf(g_report, "Usage:\n");
+		for (i = 0; i < numOfBench; i++)
+			fprintf(g_report, "  %s %s %s\n", argv[0], g_benchList[i].name, g_benchList[i].args);
+	} else if (rc < 0) {
+		fprintf(g_report, "%s failed\n", argv[1]);
+	}
+
+	ithread_cond_destroy(&g_timerCond);
+	ithread_mutex_destroy(&g_timerMutex);
+	ithread_rwlock_destroy(&g_deviceListLock);
+	fclose(g_report);
+	return rc < 0 ? 1 : 0;
+}
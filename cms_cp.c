@@ -39,37 +39,213 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 #include "cms_cp.h"
 
+/* Entity scanning uses AVX2 or SSE2 when the compiler targets them */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 UpnpClient_Handle g_cpHandle = -1;
 
+/* Downloads the description documents, cms_replay serves captured ones */
+int (*g_downloadXmlDoc)(const char *url, IXML_Document **xmlDoc) = UpnpDownloadXmlDoc;
+
 /* Timeout to request during subscriptions */
 int g_defaultTimeout = 1801;
 
 /* The first node in the global device list, or NULL if empty */
 struct DeviceNode *g_deviceList = NULL;
-ithread_mutex_t g_deviceListMutex;
+/* The last node in the global device list, or NULL if empty */
+struct DeviceNode *g_deviceListTail = NULL;
+int g_deviceCount = 0;
+/* UDN -> device node, protected by g_deviceListLock */
+struct DeviceIndex g_udnIndex;
+/* SID, controlURL and eventURL -> device node and service, for event routing */
+struct DeviceIndex g_sidIndex;
+struct DeviceIndex g_controlURLIndex;
+struct DeviceIndex g_eventURLIndex;
+/* descDocURL -> device node, so that adverts of embedded devices and
+* services of a known device are recognized without a download */
+struct DeviceIndex g_locationIndex;
+
+/* Locations whose description document is being downloaded */
+struct PendingDownload {
+	char location[LINE_SIZE];
+	struct PendingDownload *next;
+};
+struct PendingDownload *g_downloadList = NULL;
+ithread_mutex_t g_downloadMutex;
+
+/* Locations whose description did not match g_deviceType/g_friendlyName,
+* ignored until their advertisement expires */
+struct RejectedLocation {
+	char location[LINE_SIZE];
+	time_t expires;
+	struct RejectedLocation *next;
+};
+struct RejectedLocation *g_rejectedList[DEVICE_HASH_SIZE];
+int g_rejectedCount = 0;
+unsigned long g_filterDropped = 0;
+/* Guards the filter settings and the rejected locations */
+ithread_mutex_t g_filterMutex;
+/* Readers (event routing, List, actions) share the device list, structural
+* changes (add, remove, expire, SID change) take it exclusively.  The service
+* state of one device is additionally guarded by its own node mutex. */
+ithread_rwlock_t g_deviceListLock;
 
 char g_varCount[SERVICE_SERVCOUNT] ={ CONTROL_VARCOUNT };
 int g_cpTimerLoopRun = 1;
+ithread_t g_timerThread;
+
+/* Min-heap of the devices on their next deadline: renewal search,
+* advertisement expiry or subscription retry */
+struct DeviceNode **g_timerHeap = NULL;
+int g_timerHeapCount = 0;
+int g_timerHeapSize = 0;
+/* Guards the heap and the deadline fields of the device nodes */
+ithread_mutex_t g_timerMutex;
+/* Wakes the timer thread for an earlier deadline or to stop */
+ithread_cond_t g_timerCond;
+
+/* Budget of renewal searches, refilled at g_searchRate per second */
+int g_searchRate = SEARCH_RATE;
+double g_searchTokens = SEARCH_RATE;
+double g_searchTokensTime = 0;
+/* Renewals due together that are coalesced into one device type search */
+int g_renewBurst = RENEW_BURST;
+/* Renewals are covered by the last device type search until then */
+time_t g_typeSearchUntil = 0;
+
+/* Counters of each thread that updated one; never freed, so that their
+* counts stay in the totals. g_metricShared takes the counts of a thread
+* that could not get a slot of its own, with atomic adds. */
+struct MetricSlot g_metricShared;
+static __thread struct MetricSlot *t_metricSlot = NULL;
+ithread_mutex_t g_metricsMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Time spent parsing the changes of each routed event */
+struct LatencyHistogram g_eventParseTime;
+/* Metrics are written to g_statsFile every g_statsPeriod seconds, 0 for never */
+int g_statsPeriod = 0;
+char g_statsFile[LINE_SIZE] = STATS_FILE;
+ithread_mutex_t g_statsFileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef CMS_LOCK_PROFILE
+/* Lock profiling is compiled in, and measures while this is set */
+int g_lockProfile = 0;
+/* Call sites that took the device list lock, pushed on first use */
+struct LockSite *g_lockSites = NULL;
+/* The longest single holds, longest first, guarded by g_lockTopMutex */
+struct LockHold g_lockTop[LOCK_PROFILE_TOP];
+ithread_mutex_t g_lockTopMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Locks the calling thread holds, innermost last */
+static __thread struct {
+	void *lock;
+	struct LockSite *site;
+	double start;
+} t_lockHeld[LOCK_PROFILE_DEPTH];
+static __thread int t_lockDepth = 0;
+#endif
+
+/*! Names and help of the counters, in the order of enum MetricId */
+static const struct {
+	const char *name;
+	const char *help;
+} g_metricList[METRIC_COUNT] = {
+	{"cms_cp_events_received_total", "GENA events received"},
+	{"cms_cp_events_routed_total", "GENA events routed to a device by their SID"},
+	{"cms_cp_events_unknown_sid_total", "GENA events dropped because no device has their SID"},
+	{"cms_cp_descriptions_downloaded_total", "device descriptions downloaded"},
+	{"cms_cp_description_errors_total", "device descriptions that failed to download"},
+	{"cms_cp_subscribe_failures_total", "subscriptions that failed"},
+	{"cms_cp_renew_failures_total", "subscription renewals that failed"},
+	{"cms_cp_actions_sent_total", "actions and GetVar requests sent"},
+	{"cms_cp_actions_completed_total", "actions and GetVar requests completed"},
+	{"cms_cp_cache_hits_total", "GetValues paths answered from the parameter cache"},
+	{"cms_cp_cache_misses_total", "GetValues paths sent to the device while the cache is on"},
+	{"cms_cp_dispatch_queued_total", "callback events queued for the dispatch workers"},
+	{"cms_cp_dispatch_dropped_total", "callback events dropped because the dispatch queue was full"},
+	{"cms_cp_dispatch_blocked_total", "callback events that waited for room in the dispatch queue"},
+	{"cms_cp_events_stale_total", "GENA events dropped because their EventKey was already seen"},
+	{"cms_cp_events_missed_total", "GENA events missing from the EventKey sequence of a subscription"},
+	{"cms_cp_resyncs_total", "GetVar requests of ConfigurationUpdate sent after missed events"},
+	{"cms_cp_parameters_changed_total", "parameter values received that were new or differed from the cache"},
+	{"cms_cp_parameters_unchanged_total", "parameter values received that the cache already had"},
+};
 
 /*  Device type for manageable device. */
-const char g_deviceType[] = "urn:schemas-upnp-org:device:ManageableDevice:2";
-const char g_friendlyName[] = "B2BUA";
+char g_deviceType[NAME_SIZE] = "urn:schemas-upnp-org:device:ManageableDevice:2";
+/* Prefix the friendlyName of a managed device must have, "" for any */
+char g_friendlyName[NAME_SIZE] = "B2BUA";
 /* Service types for config services. */
 const char *g_serviceType[] = {"urn:schemas-upnp-org:service:ConfigurationManagement:2",};
 
-static const char g_getValuesFormat[]= 
+static const char g_getValuesHeader[]= 
 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\
 <cms:ContentPathList xmlns=\"urn:schemas-upnp-org:dm:ConfigurationManagement\" \
-xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"urn:schemas-upnp-org:dm:ConfigurationManagement http://www.upnp.org/schemas/dm/ConfigurationManagement-v2.xsd\">\
-<ContentPath>%s</ContentPath></cms:ContentPathList>";
+xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"urn:schemas-upnp-org:dm:ConfigurationManagement http://www.upnp.org/schemas/dm/ConfigurationManagement-v2.xsd\">";
+static const char g_getValuesFooter[]= "</cms:ContentPathList>";
+
+/* Upper bound of the ContentPathList or ParameterValueList of one action */
+int g_maxActionSize = MAX_ACTION_SIZE;
+/* Actions outstanding at once when a command goes to a set of devices */
+int g_maxInFlight = MAX_IN_FLIGHT;
+/* Age in seconds of a cached value GetValues answers with, 0 to always ask */
+int g_cacheMaxAge = CACHE_MAX_AGE;
+/* Print every GENA event and the values it changes, 0 to only count them */
+int g_eventLog = 1;
+/* One shard per dispatch worker, the set is replaced under g_dispatchLock.
+ * g_dispatchGate is held on the way in, so that a writer waiting for the
+ * lock is not starved by a stream of producers. */
+struct DispatchShard *g_dispatchShards = NULL;
+int g_dispatchShardCount = 0;
+int g_dispatchRun = 0;
+ithread_rwlock_t g_dispatchLock;
+ithread_mutex_t g_dispatchGate;
+/* SID, controlURL and eventURL -> hash of the UDN, kept in step with the
+ * indexes of the device list but under their own mutex */
+struct DispatchRoute *g_dispatchRoutes[DEVICE_HASH_SIZE];
+ithread_mutex_t g_dispatchRouteMutex;
+int g_dispatchWorkers = DISPATCH_WORKERS;
+int g_dispatchDepth = DISPATCH_DEPTH;
+int g_dispatchPolicy = DISPATCH_DROP_DISCOVERY;
+struct LatencyHistogram g_dispatchWait;
+/* Components of the parameter paths, shared by the trees of all devices */
+struct InternEntry *g_internTable[INTERN_HASH_SIZE];
+int g_internCount = 0;
+ithread_rwlock_t g_internLock;
+
+/*! Run time settings, shown and changed with the Option command */
+static struct {
+	const char *name;
+	int *value;
+	int min;
+	int max;
+	const char *desc;
+} g_optionList[] = {
+	{"maxActionSize", &g_maxActionSize, 1024, 1024*1024, "bytes of paths and values per GetValues/SetValues action"},
+	{"maxInFlight", &g_maxInFlight, 1, 65536, "actions outstanding at once when a command goes to a device set"},
+	{"searchRate", &g_searchRate, 1, 1000, "renewal searches sent per second at most"},
+	{"renewBurst", &g_renewBurst, 2, 100000, "renewals due at once that are sent as one device type search"},
+	{"statsPeriod", &g_statsPeriod, 0, 86400, "seconds between writes of the metrics to the Stats file, 0 for never"},
+	{"cacheMaxAge", &g_cacheMaxAge, 0, 86400, "seconds a cached value answers GetValues of a device, 0 to always ask it"},
+	{"eventLog", &g_eventLog, 0, 1, "print every event received and the values it changes, 0 for none"},
+	{"dispatchWorkers", &g_dispatchWorkers, 0, DISPATCH_MAX_WORKERS, "threads processing the callback events, 0 for the SDK threads"},
+	{"dispatchDepth", &g_dispatchDepth, 1, DISPATCH_QUEUE_SIZE, "callback events queued per worker before dispatchPolicy applies"},
+	{"dispatchPolicy", &g_dispatchPolicy, DISPATCH_BLOCK, DISPATCH_DROP_EVENTS, "when full: 0 wait, 1 drop adverts, 2 drop adverts and GENA events"},
+#ifdef CMS_LOCK_PROFILE
+	{"lockProfile", &g_lockProfile, 0, 1, "measure waits and holds of the device list lock, see Locks"},
+#endif
+};
 
-static const char g_setValuesFormat[]= 
+static const char g_setValuesHeader[]= 
 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\
 <cms:ParameterValueList xmlns=\"urn:schemas-upnp-org:dm:ConfigurationManagement\" \
-xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"urn:schemas-upnp-org:dm:ConfigurationManagement http://www.upnp.org/schemas/dm/ConfigurationManagement-v2.xsd\">\
-<Parameter><ParameterPath>%s</ParameterPath><Value>%s</Value></Parameter></cms:ParameterValueList>";
+xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"urn:schemas-upnp-org:dm:ConfigurationManagement http://www.upnp.org/schemas/dm/ConfigurationManagement-v2.xsd\">";
+static const char g_setValuesFooter[]= "</cms:ParameterValueList>";
 
 const char *g_serviceName[] = { "ConfigurationManagement", "" };
+const char *g_subscribeStateName[] = { "none", "pending", "subscribed", "renewing", "failed" };
 const char *g_varName[SERVICE_SERVCOUNT][CP_MAXVARS] = {
 	{"ConfigurationUpdate","SupportedDataModelsUpdate","SupportedParametersUpdate","AttributeValuesUpdate","InconsistentStatus","AlarmsEnabled"}
 };
@@ -84,9 +260,19 @@ enum cmdloop_cmds {
 	SetAlarmsEnabled,
 	GetValues,
 	SetValues,
+	Filter,
+	Option,
+	Latency,
+	Stats,
+	Locks,
+	Cache,
+	Diff,
 	ExitCmd
 };
 
+/* Send to complete latency of each action type, GetVar included */
+struct LatencyHistogram g_actionLatency[ExitCmd];
+
 /*! Data structure for parsing commands from the command line. */
 struct cmdloop_commands {
 	const char *str;/* the string  */
@@ -104,8 +290,15 @@ static struct cmdloop_commands g_cmdList[] = {
 	{"List", ListDev,      2, "<devnum>"},
 	{"GetVar", GetVar,  2, "<devnum> <varName (string)>"},
 	{"SetAlarmsEnabled", SetAlarmsEnabled,  2, "<devnum> <0|1> "},
-	{"GetValues", GetValues,  2, "<devnum> <nodePath (string)>"},
-	{"SetValues", SetValues,  3, "<devnum> <nodePath (string)> <nodeValue (string)>"},
+	{"GetValues", GetValues,  2, "<devnum|devset> <nodePath (string)> [<nodePath> ...] | @<file>"},
+	{"SetValues", SetValues,  3, "<devnum|devset> <nodePath (string)> <nodeValue (string)> [<nodePath> <nodeValue> ...] | @<file>"},
+	{"Filter", Filter,  1, "[deviceType|friendlyName|clear] [<value>]"},
+	{"Option", Option,  1, "[<name> [<value>]]"},
+	{"Latency", Latency,  1, "[<devnum>|devices|reset]"},
+	{"Stats", Stats,  1, "[<file>]"},
+	{"Locks", Locks,  1, "[reset]"},
+	{"Cache", Cache,  2, "<devnum> [<path>|<path>/#]"},
+	{"Diff", Diff,  3, "<devnum> <devnum> [<path>|<path>/#]"},
 	{"Exit", ExitCmd, 1, ""}
 };
 void CtrlPointPrintHelp(void)
@@ -115,9 +308,16 @@ void CtrlPointPrintHelp(void)
 		"  Refresh\n"
 		"  List		[<devnum>]\n"
 		"  GetVar	<devnum> <varname>\n"
-		"  GetValues	<devnum> <nodePath>\n"
+		"  GetValues	<devnum|devset> <nodePath> [<nodePath> ...] | @<file>\n"
 		"  SetAlarmsEnabled	 <devnum> <0|1>\n"
-		"  SetValues	<devnum> <nodePath> <nodeValue>\n"
+		"  SetValues	<devnum|devset> <nodePath> <nodeValue> [<nodePath> <nodeValue> ...] | @<file>\n"
+		"  Filter		[deviceType|friendlyName|clear] [<value>]\n"
+		"  Option		[<name> [<value>]]\n"
+		"  Latency	[<devnum>|devices|reset]\n"
+		"  Stats		[<file>]\n"
+		"  Locks		[reset]\n"
+		"  Cache		<devnum> [<path>|<path>/#]\n"
+		"  Diff		<devnum> <devnum> [<path>|<path>/#]\n"
 		"  Exit\n");
 	printf("\n"
 		"Detail:\n"
@@ -135,10 +335,19 @@ void CtrlPointPrintHelp(void)
 		"       Requests the value of a variable specified by the string <varname>\n"
 		"         from the Control Service of device <devnum>.\n"
 		"         (e.g., \" GetVar  1  ConfigurationUpdate \")\n"
-		"  GetValues <devnum> <nodepath> \n"
+		"  GetValues <devnum> <nodepath> [<nodepath> ...] | @<file>\n"
 		"       Sends an action request specified by the string <GetValues>\n"
 		"         to the Control Service of device <devnum>.\n"
 		"         (e.g., \" GetValues  1  /BBF/VoiceService/0/SIP/Network/0/ProxyServer \")\n"
+		"       Several paths, or a file with one path per line, are packed into as few\n"
+		"         requests as the maximum action size allows, and the values returned\n"
+		"         are matched back to the paths asked for.\n"
+		"         (e.g., \" GetValues  1  @paths.txt \")\n"
+		"       Values seen in events and answers are cached per device; with the\n"
+		"         cacheMaxAge option set, paths cached no longer than that many seconds\n"
+		"         ago are answered from the cache. A new ConfigurationUpdate version\n"
+		"         makes the values it does not carry stale, so SetAlarmsEnabled 1 on\n"
+		"         the paths read keeps them fresh.\n"
 		"  SetAlarmsEnabled <devnum> <0|1>\n"
 		"       1:will force the Parent Device from including the pair name-value for 'alarmed' parameters,if any in the ConfigurationUpdate state;\n"
 		"       0:will prevent the Parent Device to include the pair name-value for 'alarmed' parameters,when they change their value.\n"
@@ -147,12 +356,288 @@ void CtrlPointPrintHelp(void)
 		"       Sends an action request specified by the string <SetValues>\n"
 		"         to the Control Service of device <devnum>.\n"
 		"         (e.g., \" SetValues  1 /BBF/VoiceService/0/SIP/Network/0/ProxyServer 192.168.9.130 \")\n"
+		"       Several pairs, or a file with a path and a value on each line, go into\n"
+		"         one ParameterValueList, split only when the maximum action size is reached.\n"
+		"         (e.g., \" SetValues  1  @voice.txt \")\n"
+		"       GetValues and SetValues take a devset instead of a <devnum> to go to\n"
+		"         several devices at once: * for all, or numbers and ranges such as\n"
+		"         1-100,150,200-. At most maxInFlight actions are outstanding, and a\n"
+		"         summary of the results and latencies follows the last answer.\n"
+		"         (e.g., \" SetValues  *  @voice.txt \")\n"
+		"  Filter [deviceType|friendlyName|clear] [<value>]\n"
+		"       Without arguments, print the discovery filter. Adverts of other device or\n"
+		"         service types are dropped before the description is downloaded, and\n"
+		"         locations whose description does not match are ignored until they expire.\n"
+		"       deviceType <urn> and friendlyName <prefix> change the filter, clear forgets\n"
+		"         the rejected locations.\n"
+		"         (e.g., \" Filter  friendlyName  B2BUA \")\n"
+		"  Option [<name> [<value>]]\n"
+		"       Print the run time options, or set one of them.\n"
+		"         (e.g., \" Option  maxActionSize  65536 \")\n"
+		"  Latency [<devnum>|devices|reset]\n"
+		"       Print the count, errors and send to complete latency percentiles of\n"
+		"         each action type, of device <devnum>, or one line for each device.\n"
+		"       reset clears all of them.\n"
+		"         (e.g., \" Latency  devices \")\n"
+		"  Stats [<file>]\n"
+		"       Print the metrics of the control point in Prometheus text format.\n"
+		"       With <file>, write them there instead; the statsPeriod option\n"
+		"         rewrites that file periodically.\n"
+		"         (e.g., \" Stats  /var/lib/node_exporter/cms_cp.prom \")\n"
+		"  Locks [reset]\n"
+		"       Print the waits and holds of the device list lock at each call site,\n"
+		"         and the longest holds, while the lockProfile option is 1.\n"
+		"       Needs a build with -DCMS_LOCK_PROFILE.\n"
+		"  Cache <devnum> [<path>|<path>/#]\n"
+		"       Print the cached values of device <devnum> under <path>, all of them\n"
+		"         without it, with their age or stale when a newer version came.\n"
+		"         (e.g., \" Cache  1  /BBF/VoiceService/0/SIP/# \")\n"
+		"  Diff <devnum> <devnum> [<path>|<path>/#]\n"
+		"       Compare the cached values of two devices under <path>: - is only in\n"
+		"         the first, + only in the second, ! differs. Fill the caches with\n"
+		"         GetValues of the subtree first.\n"
+		"         (e.g., \" Diff  1  2  /BBF/VoiceService/0/SIP/ \")\n"
 		"  Exit\n"
 		"       Exits the control point application.\n");
 }
 
-int CtrlPointDeleteNode( struct DeviceNode *node )
+unsigned int HashString(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int IndexInsert(struct DeviceIndex *index, const char *key,
+	struct DeviceNode *node, int service)
+{
+	struct IndexEntry *entry;
+	unsigned int slot;
+
+	if (NULL == key || '\0' == key[0])
+		return 0;
+	entry = (struct IndexEntry *)malloc(sizeof(struct IndexEntry));
+	if (NULL == entry) {
+		printf("ERROR: IndexInsert: out of memory\n");
+		return -1;
+	}
+	slot = HashString(key) & (DEVICE_HASH_SIZE - 1);
+	entry->key = key;
+	entry->node = node;
+	entry->service = service;
+	entry->next = index->bucket[slot];
+	index->bucket[slot] = entry;
+	index->count++;
+	return 0;
+}
+
+struct DeviceNode *IndexLookup(struct DeviceIndex *index, const char *key, int *service)
+{
+	struct IndexEntry *entry;
+
+	if (NULL == key || '\0' == key[0])
+		return NULL;
+	entry = index->bucket[HashString(key) & (DEVICE_HASH_SIZE - 1)];
+	while (entry) {
+		if (strcmp(entry->key, key) == 0) {
+			if (service) *service = entry->service;
+			return entry->node;
+		}
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+int IndexRemove(struct DeviceIndex *index, const char *key, const struct DeviceNode *node)
+{
+	struct IndexEntry **link;
+	struct IndexEntry *entry;
+
+	if (NULL == key || '\0' == key[0])
+		return -1;
+	link = &index->bucket[HashString(key) & (DEVICE_HASH_SIZE - 1)];
+	while ((entry = *link)) {
+		if (entry->node == node && strcmp(entry->key, key) == 0) {
+			*link = entry->next;
+			free(entry);
+			index->count--;
+			return 0;
+		}
+		link = &entry->next;
+	}
+	return -1;
+}
+
+void IndexClear(struct DeviceIndex *index)
+{
+	struct IndexEntry *entry, *next;
+	int slot;
+
+	for (slot = 0; slot < DEVICE_HASH_SIZE; slot++) {
+		entry = index->bucket[slot];
+		while (entry) {
+			next = entry->next;
+			free(entry);
+			entry = next;
+		}
+		index->bucket[slot] = NULL;
+	}
+	index->count = 0;
+}
+
+int DispatchRouteAdd(const char *key, const char *UDN)
+{
+	struct DispatchRoute *route;
+	unsigned int slot;
+
+	if (NULL == key || '\0' == key[0])
+		return 0;
+	route = (struct DispatchRoute *)malloc(sizeof(struct DispatchRoute));
+	if (NULL == route || NULL == (route->key = strdup(key))) {
+		printf("ERROR: DispatchRouteAdd: out of memory\n");
+		free(route);
+		return -1;
+	}
+	route->hash = HashString(UDN);
+	slot = HashString(key) & (DEVICE_HASH_SIZE - 1);
+	ithread_mutex_lock(&g_dispatchRouteMutex);
+	route->next = g_dispatchRoutes[slot];
+	g_dispatchRoutes[slot] = route;
+	ithread_mutex_unlock(&g_dispatchRouteMutex);
+	return 0;
+}
+
+int DispatchRouteLookup(const char *key, unsigned int *hash)
+{
+	struct DispatchRoute *route;
+	int rc = -1;
+
+	if (NULL == key || '\0' == key[0])
+		return -1;
+	ithread_mutex_lock(&g_dispatchRouteMutex);
+	for (route = g_dispatchRoutes[HashString(key) & (DEVICE_HASH_SIZE - 1)]; route; route = route->next) {
+		if (strcmp(route->key, key) == 0) {
+			*hash = route->hash;
+			rc = 0;
+			break;
+		}
+	}
+	ithread_mutex_unlock(&g_dispatchRouteMutex);
+	return rc;
+}
+
+void DispatchRouteRemove(const char *key, const char *UDN)
+{
+	struct DispatchRoute **link;
+	struct DispatchRoute *route;
+	unsigned int hash;
+
+	if (NULL == key || '\0' == key[0])
+		return;
+	hash = HashString(UDN);
+	ithread_mutex_lock(&g_dispatchRouteMutex);
+	link = &g_dispatchRoutes[HashString(key) & (DEVICE_HASH_SIZE - 1)];
+	while ((route = *link)) {
+		if (route->hash == hash && strcmp(route->key, key) == 0) {
+			*link = route->next;
+			free(route->key);
+			free(route);
+			break;
+		}
+		link = &route->next;
+	}
+	ithread_mutex_unlock(&g_dispatchRouteMutex);
+}
+
+void DispatchRouteClear(void)
+{
+	struct DispatchRoute *route, *next;
+	int slot;
+
+	ithread_mutex_lock(&g_dispatchRouteMutex);
+	for (slot = 0; slot < DEVICE_HASH_SIZE; slot++) {
+		for (route = g_dispatchRoutes[slot]; route; route = next) {
+			next = route->next;
+			free(route->key);
+			free(route);
+		}
+		g_dispatchRoutes[slot] = NULL;
+	}
+	ithread_mutex_unlock(&g_dispatchRouteMutex);
+}
+
+int CtrlPointInsertNode(struct DeviceNode *node)
+{
+	struct Service *svc;
+	int service;
+
+	if (IndexInsert(&g_udnIndex, node->device.UDN, node, 0) < 0)
+		return -1;
+	IndexInsert(&g_locationIndex, node->device.descDocURL, node, 0);
+	for (service = 0; service < SERVICE_SERVCOUNT; service++) {
+		svc = &node->device.service[service];
+		IndexInsert(&g_sidIndex, svc->SID, node, service);
+		IndexInsert(&g_controlURLIndex, svc->controlURL, node, service);
+		IndexInsert(&g_eventURLIndex, svc->eventURL, node, service);
+		DispatchRouteAdd(svc->SID, node->device.UDN);
+		DispatchRouteAdd(svc->controlURL, node->device.UDN);
+		DispatchRouteAdd(svc->eventURL, node->device.UDN);
+	}
+	node->next = NULL;
+	node->prev = g_deviceListTail;
+	if (g_deviceListTail)
+		g_deviceListTail->next = node;
+	else
+		g_deviceList = node;
+	g_deviceListTail = node;
+	g_deviceCount++;
+
+	ithread_mutex_lock(&g_timerMutex);
+	CtrlPointScheduleNode(node);
+	ithread_mutex_unlock(&g_timerMutex);
+	return 0;
+}
+
+void CtrlPointUnlinkNode(struct DeviceNode *node)
+{
+	struct Service *svc;
+	int service;
+
+	IndexRemove(&g_udnIndex, node->device.UDN, node);
+	IndexRemove(&g_locationIndex, node->device.descDocURL, node);
+	for (service = 0; service < SERVICE_SERVCOUNT; service++) {
+		svc = &node->device.service[service];
+		IndexRemove(&g_sidIndex, svc->SID, node);
+		IndexRemove(&g_controlURLIndex, svc->controlURL, node);
+		IndexRemove(&g_eventURLIndex, svc->eventURL, node);
+		DispatchRouteRemove(svc->SID, node->device.UDN);
+		DispatchRouteRemove(svc->controlURL, node->device.UDN);
+		DispatchRouteRemove(svc->eventURL, node->device.UDN);
+	}
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		g_deviceList = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	else
+		g_deviceListTail = node->prev;
+	node->next = NULL;
+	node->prev = NULL;
+	g_deviceCount--;
+
+	ithread_mutex_lock(&g_timerMutex);
+	TimerHeapRemove(node);
+	ithread_mutex_unlock(&g_timerMutex);
+}
+
+int CtrlPointDeleteNode( struct DeviceNode *node, struct OrphanSID **orphans )
 {
+	struct OrphanSID *orphan;
 	int rc, service, var;
 
 	if (NULL == node) {
@@ -161,7 +646,18 @@ int CtrlPointDeleteNode( struct DeviceNode *node )
 	}
 	for (service = 0; service < SERVICE_SERVCOUNT; service++) {
 		/* If we have a valid control SID, then unsubscribe */
-		if (strcmp(node->device.service[service].SID, "") != 0) {
+		if (strcmp(node->device.service[service].SID, "") != 0 && orphans) {
+			/* The device may be gone: not waiting for it with the list locked */
+			orphan = (struct OrphanSID *)malloc(sizeof(struct OrphanSID));
+			if (orphan) {
+				memcpy(orphan->SID, node->device.service[service].SID, sizeof(orphan->SID));
+				orphan->service = service;
+				orphan->next = *orphans;
+				*orphans = orphan;
+			} else {
+				printf("Error unsubscribing to %s eventURL -- out of memory\n",g_serviceName[service]);
+			}
+		} else if (strcmp(node->device.service[service].SID, "") != 0) {
 			rc = UpnpUnSubscribe(g_cpHandle,node->device.service[service].SID);
 			if (UPNP_E_SUCCESS == rc) {
 				printf("Unsubscribed from %s eventURL with SID=%s\n",
@@ -182,65 +678,89 @@ int CtrlPointDeleteNode( struct DeviceNode *node )
 	/*Notify New Device Added */
 	NotifyStateUpdate(NULL, NULL, node->device.UDN, DEVICE_REMOVED);
 
+	ithread_mutex_destroy(&node->mutex);
+	ParameterCacheFree(&node->cache);
+	if (node->latency) free(node->latency);
 	free(node);
 	node = NULL;
 	return 0;
 }
 
+void CtrlPointUnsubscribeOrphans(struct OrphanSID *orphans)
+{
+	struct OrphanSID *orphan;
+	int rc;
+
+	while ((orphan = orphans)) {
+		orphans = orphan->next;
+		/* The SDK copies the SID, the answer goes to the callback */
+		rc = UpnpUnSubscribeAsync(g_cpHandle, orphan->SID, CtrlPointCallbackEventHandler, NULL);
+		if (UPNP_E_SUCCESS == rc) {
+			printf("Unsubscribing from %s eventURL with SID=%s\n",
+				g_serviceName[orphan->service],orphan->SID);
+		} else {
+			printf("Error unsubscribing to %s eventURL -- %d\n",g_serviceName[orphan->service],rc);
+		}
+		free(orphan);
+	}
+}
+
 int CtrlPointRemoveDevice(const char *UDN)
 {
 	struct DeviceNode *curDevNode;
-	struct DeviceNode *prevDevNode;
+	struct OrphanSID *orphans = NULL;
 
-	ithread_mutex_lock(&g_deviceListMutex);
-	curDevNode = g_deviceList;
+	DEVICE_LIST_WRLOCK();
+	curDevNode = IndexLookup(&g_udnIndex, UDN, NULL);
 	if (curDevNode) {
-		if (0 == strcmp(curDevNode->device.UDN, UDN)) {
-			g_deviceList = curDevNode->next;
-			CtrlPointDeleteNode(curDevNode);
-		} else {
-			prevDevNode = curDevNode;
-			curDevNode = curDevNode->next;
-			while (curDevNode) {
-				if (strcmp(curDevNode->device.UDN, UDN) == 0) {
-					prevDevNode->next = curDevNode->next;
-					CtrlPointDeleteNode(curDevNode);
-					break;
-				}
-				prevDevNode = curDevNode;
-				curDevNode = curDevNode->next;
-			}
-		}
+		CtrlPointUnlinkNode(curDevNode);
+		CtrlPointDeleteNode(curDevNode, &orphans);
 	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+	DEVICE_LIST_UNLOCK();
+	CtrlPointUnsubscribeOrphans(orphans);
 	return 0;
 }
 
 int CtrlPointRemoveAll(void)
 {
 	struct DeviceNode *curDevNode, *next;
+	struct OrphanSID *orphans = NULL;
 
-	ithread_mutex_lock(&g_deviceListMutex);
+	DEVICE_LIST_WRLOCK();
 	curDevNode = g_deviceList;
 	g_deviceList = NULL;
+	g_deviceListTail = NULL;
+	g_deviceCount = 0;
+	IndexClear(&g_udnIndex);
+	IndexClear(&g_locationIndex);
+	IndexClear(&g_sidIndex);
+	IndexClear(&g_controlURLIndex);
+	IndexClear(&g_eventURLIndex);
+	DispatchRouteClear();
 	while (curDevNode) {
 		next = curDevNode->next;
-		CtrlPointDeleteNode(curDevNode);
+		CtrlPointDeleteNode(curDevNode, &orphans);
 		curDevNode = next;
 	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+	DEVICE_LIST_UNLOCK();
+	CtrlPointUnsubscribeOrphans(orphans);
 	return 0;
 }
 
 int CtrlPointRefresh(void)
 {
 	int rc;
+	char deviceType[NAME_SIZE];
 
 	CtrlPointRemoveAll();
 
+	ithread_mutex_lock(&g_filterMutex);
+	strcpy(deviceType, g_deviceType);
+	ithread_mutex_unlock(&g_filterMutex);
+
 	/* Search for all devices of type ManageableDevice version 1,
 	* waiting for up to 5 seconds for the response */
-	rc = UpnpSearchAsync(g_cpHandle, 5, g_deviceType, NULL);
+	rc = UpnpSearchAsync(g_cpHandle, 5, deviceType, NULL);
 	if (UPNP_E_SUCCESS != rc) {
 		printf("Error sending search request%d\n", rc);
 		return rc;
@@ -253,21 +773,36 @@ int CtrlPointGetVar(int service, int devnum, const char *varname)
 	struct DeviceNode *devNode;
 	int rc;
 
-	ithread_mutex_lock(&g_deviceListMutex);
+	DEVICE_LIST_RDLOCK();
 	rc = CtrlPointGetDevice(devnum, &devNode);
-	if (0 == rc) {
-		rc = UpnpGetServiceVarStatusAsync(
-			g_cpHandle,devNode->device.service[service].controlURL,
-			varname,CtrlPointCallbackEventHandler,NULL);
-		if (rc != UPNP_E_SUCCESS) {
-			printf("Error in UpnpGetServiceVarStatusAsync -- %d\n",rc);
-			rc = -1;
-		}
-	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+	if (0 == rc)
+		rc = CtrlPointSendGetVar(devNode, devnum, service, varname);
+	DEVICE_LIST_UNLOCK();
 	return rc;
 }
 
+int CtrlPointSendGetVar(struct DeviceNode *devNode, int devnum, int service, const char *varname)
+{
+	struct ActionRequest *request;
+	int rc;
+
+	request = CtrlPointNewRequest(GetVar, devnum, devNode->device.UDN, &varname, 1, 1);
+	if (NULL == request)
+		return -1;
+	/* The request comes back as the cookie of UPNP_CONTROL_GET_VAR_COMPLETE */
+	request->sendTime = CtrlPointNow();
+	rc = UpnpGetServiceVarStatusAsync(
+		g_cpHandle,devNode->device.service[service].controlURL,
+		varname,CtrlPointCallbackEventHandler,request);
+	if (rc != UPNP_E_SUCCESS) {
+		printf("Error in UpnpGetServiceVarStatusAsync -- %d\n",rc);
+		CtrlPointFreeRequest(request);
+		return -1;
+	}
+	MetricAdd(METRIC_ACTIONS_SENT, 1);
+	return 0;
+}
+
 int CtrlPointGetDevice(int devnum, struct DeviceNode **devnode)
 {
 	int count = devnum;
@@ -292,7 +827,7 @@ int CtrlPointPrintList()
 	struct DeviceNode *tmpDevNode;
 	int i = 0;
 
-	ithread_mutex_lock(&g_deviceListMutex);
+	DEVICE_LIST_RDLOCK();
 	printf("CtrlPointPrintList:\n");
 	tmpDevNode = g_deviceList;
 	while (tmpDevNode) {
@@ -300,7 +835,7 @@ int CtrlPointPrintList()
 		tmpDevNode = tmpDevNode->next;
 	}
 	printf("\n");
-	ithread_mutex_unlock(&g_deviceListMutex);
+	DEVICE_LIST_UNLOCK();
 
 	return 0;
 }
@@ -316,7 +851,7 @@ int CtrlPointPrintDevice(int devnum)
 		return 0;
 	}
 
-	ithread_mutex_lock(&g_deviceListMutex);
+	DEVICE_LIST_RDLOCK();
 	printf("PrintDevice:\n");
 	tmpDevNode = g_deviceList;
 	while (tmpDevNode) {
@@ -327,6 +862,11 @@ int CtrlPointPrintDevice(int devnum)
 	if (!tmpDevNode) {
 		printf("Error in PrintDevice: ""invalid devnum = %d  --  actual device count = %d\n",devnum, i);
 	} else {
+		int remaining;
+
+		ithread_mutex_lock(&g_timerMutex);
+		remaining = (int)(tmpDevNode->expireTime - time(NULL));
+		ithread_mutex_unlock(&g_timerMutex);
 		printf("  Device -- %d\n"
 			"    |                  \n"
 			"    +- UDN        = %s\n"
@@ -339,7 +879,8 @@ int CtrlPointPrintDevice(int devnum)
 			tmpDevNode->device.descDocURL,
 			tmpDevNode->device.friendlyName,
 			tmpDevNode->device.presURL,
-			tmpDevNode->device.advrTimeOut);
+			remaining);
+		ithread_mutex_lock(&tmpDevNode->mutex);
 		for (service = 0; service < SERVICE_SERVCOUNT; service++) {
 			if (service < SERVICE_SERVCOUNT-1) sprintf(spacer, "    |    ");
 			else sprintf(spacer, "         ");
@@ -350,6 +891,8 @@ int CtrlPointPrintDevice(int devnum)
 				"%s+- eventURL        = %s\n"
 				"%s+- controlURL      = %s\n"
 				"%s+- SID             = %s\n"
+				"%s+- SubState        = %s (%d)\n"
+				"%s+- EventKey        = %d%s\n"
 				"%s+- ServiceStateTable\n",
 				g_serviceName[service],
 				spacer,
@@ -362,18 +905,64 @@ int CtrlPointPrintDevice(int devnum)
 				tmpDevNode->device.service[service].controlURL,
 				spacer,
 				tmpDevNode->device.service[service].SID,
+				spacer,
+				g_subscribeStateName[tmpDevNode->device.service[service].subState],
+				tmpDevNode->device.service[service].subTimeOut,
+				spacer,
+				tmpDevNode->device.service[service].eventKey,
+				tmpDevNode->device.service[service].resync ? " (resyncing)" : "",
 				spacer);
 			for (var = 0; var < g_varCount[service]; var++) {
 				printf("%s     +- %-10s = %s\n",spacer,g_varName[service][var],tmpDevNode->device.service[service].varStrVal[var]);
 			}
 		}
+		ithread_mutex_unlock(&tmpDevNode->mutex);
 	}
 	printf("\n");
-	ithread_mutex_unlock(&g_deviceListMutex);
+	DEVICE_LIST_UNLOCK();
 	return 0;
 }
 
-void CtrlPointAddDevice(IXML_Document *doc,const char *location,int expires)
+struct DeviceNode *CtrlPointCreateNode(const char *UDN, const char *location,
+	const char *friendlyName, const char *presURL, int expires)
+{
+	struct DeviceNode *deviceNode;
+	int service, var;
+
+	deviceNode = (struct DeviceNode *)malloc(sizeof(struct DeviceNode));
+	if (NULL == deviceNode)
+		return NULL;
+	memset(deviceNode, 0, sizeof(*deviceNode));
+	if (UDN)
+		strncpy(deviceNode->device.UDN, UDN, sizeof(deviceNode->device.UDN)-1);
+	if (location)
+		strncpy(deviceNode->device.descDocURL, location, sizeof(deviceNode->device.descDocURL)-1);
+	if (friendlyName)
+		strncpy(deviceNode->device.friendlyName, friendlyName, sizeof(deviceNode->device.friendlyName)-1);
+	if (presURL)
+		strncpy(deviceNode->device.presURL, presURL, sizeof(deviceNode->device.presURL)-1);
+	deviceNode->device.advrTimeOut = expires;
+	deviceNode->expireTime = time(NULL) + expires;
+	deviceNode->renewTime = CtrlPointRenewTime(deviceNode);
+	deviceNode->heapIndex = -1;
+	deviceNode->cache.version = -1;
+	deviceNode->cache.owner = deviceNode->device.UDN;
+	for (service = 0; service < SERVICE_SERVCOUNT; service++) {
+		if (NULL != g_serviceType[service])
+			strncpy(deviceNode->device.service[service].serviceType, g_serviceType[service],
+				sizeof(deviceNode->device.service[service].serviceType)-1);
+		deviceNode->device.service[service].eventKey = -1;
+		for (var = 0; var < g_varCount[service]; var++) {
+			deviceNode->device.service[service].varStrVal[var] = (char *)malloc(MAX_VAL_LEN);
+			if (deviceNode->device.service[service].varStrVal[var])
+				memset(deviceNode->device.service[service].varStrVal[var], 0, MAX_VAL_LEN);
+		}
+	}
+	ithread_mutex_init(&deviceNode->mutex, NULL);
+	return deviceNode;
+}
+
+int CtrlPointAddDevice(IXML_Document *doc,const char *location,int expires)
 {
 	char *deviceType = NULL;
 	char *friendlyName = NULL;
@@ -381,20 +970,16 @@ void CtrlPointAddDevice(IXML_Document *doc,const char *location,int expires)
 	char *baseURL = NULL;
 	char *relURL = NULL;
 	char *UDN = NULL;
-	char uuid[NAME_SIZE]={0};
 	char *serviceId[SERVICE_SERVCOUNT] = { NULL };
 	char *eventURL[SERVICE_SERVCOUNT] = { NULL };
 	char *controlURL[SERVICE_SERVCOUNT] = { NULL };
-	Upnp_SID eventSID[SERVICE_SERVCOUNT]={0};
-	int timeOut[SERVICE_SERVCOUNT] = {g_defaultTimeout};
 	struct DeviceNode *deviceNode = NULL;
 	struct DeviceNode *tmpDevNode = NULL;
+	struct OrphanSID *orphans = NULL;
+	int added = 0;
+	int match = 0;
 	int ret = 1;
-	int found = 0;
 	int service;
-	int var;
-
-	ithread_mutex_lock(&g_deviceListMutex);
 
 	/* Read key elements from description document */
 	UDN = GetFirstDocumentItem(doc, "UDN");
@@ -404,96 +989,84 @@ void CtrlPointAddDevice(IXML_Document *doc,const char *location,int expires)
 	relURL = GetFirstDocumentItem(doc, "presentationURL");
 
 	ret = UpnpResolveURL((baseURL ? baseURL : location), relURL, presURL);
-	if (NULL != deviceType 
+	if (ret != UPNP_E_SUCCESS) {
+		/* The presentationURL is optional */
+		if (relURL)
+			printf("Error generating presURL from %s + %s\n",(baseURL ? baseURL : location),relURL);
+		presURL[0] = '\0';
+	}
+	ithread_mutex_lock(&g_filterMutex);
+	match = NULL != deviceType 
 		&& 0 == strncasecmp(deviceType, g_deviceType,strlen(g_deviceType))
-		&& 0 == strncasecmp(friendlyName, g_friendlyName,strlen(g_friendlyName))) {
+		&& NULL != friendlyName
+		&& 0 == strncasecmp(friendlyName, g_friendlyName,strlen(g_friendlyName));
+	ithread_mutex_unlock(&g_filterMutex);
+	if (match) {
 
+			DEVICE_LIST_WRLOCK();
 			/* Check if this device is already in the list */
-			tmpDevNode = g_deviceList;
-			while (tmpDevNode) {
-				if ( NULL != UDN && strcmp(tmpDevNode->device.UDN, UDN) == 0) {
-					found = 1;
-					break;
-				}
-				tmpDevNode = tmpDevNode->next;
+			tmpDevNode = IndexLookup(&g_udnIndex, UDN, NULL);
+			if (tmpDevNode && location
+				&& strcmp(tmpDevNode->device.descDocURL, location) != 0) {
+				/* Same UDN at a new location: the device restarted, start over */
+				printf("Device %s moved to %s\n", UDN, location);
+				CtrlPointUnlinkNode(tmpDevNode);
+				/* The old location is likely gone: unsubscribed once unlocked */
+				CtrlPointDeleteNode(tmpDevNode, &orphans);
+				tmpDevNode = NULL;
 			}
 
-			if (found) {
+			if (tmpDevNode) {
 				/* The device is already there, so just update  */
 				/* the advertisement timeout field */
-				tmpDevNode->device.advrTimeOut = expires;
+				CtrlPointRenewNode(tmpDevNode, expires);
 			} else {
 				for (service = 0; service < SERVICE_SERVCOUNT;service++) {
-					if (FindAndParseService(doc, location, g_serviceType[service],
-						&serviceId[service], &eventURL[service],&controlURL[service])) {
-							printf("Subscribing to eventURL %s...\n", eventURL[service]);
-							ret = UpnpSubscribe(g_cpHandle,eventURL[service],&timeOut[service],eventSID[service]);
-							if (ret == UPNP_E_SUCCESS) {
-								printf("Subscribed to eventURL with SID=%s\n",eventSID[service]);
-							} else {
-								printf("Error Subscribing to eventURL -- %d\n",ret);
-								strcpy(eventSID[service], "");
-							}
-					} 
+					FindAndParseService(doc, location, g_serviceType[service],
+						&serviceId[service], &eventURL[service],&controlURL[service]);
 				}
 				/* Create a new device node */
-				deviceNode =(struct DeviceNode *)malloc(sizeof(struct DeviceNode));
-				memset(deviceNode,0, sizeof(deviceNode));
-				memset(deviceNode->device.UDN,0,sizeof(deviceNode->device.UDN));
-				if(UDN)
-					strncpy(deviceNode->device.UDN, UDN, sizeof(deviceNode->device.UDN)-1);
-				memset(deviceNode->device.descDocURL,0,sizeof(deviceNode->device.descDocURL));
-				if(location)
-					strncpy(deviceNode->device.descDocURL,location,sizeof(deviceNode->device.descDocURL)-1);
-				memset(deviceNode->device.friendlyName,0,sizeof(deviceNode->device.friendlyName));
-				if(friendlyName)
-					strncpy(deviceNode->device.friendlyName,friendlyName,sizeof(deviceNode->device.friendlyName)-1);
-				memset(deviceNode->device.presURL,0,sizeof(deviceNode->device.presURL));
-				strncpy(deviceNode->device.presURL,presURL,sizeof(deviceNode->device.presURL)-1);
-				deviceNode->device.advrTimeOut = expires;
+				deviceNode = CtrlPointCreateNode(UDN, location, friendlyName, presURL, expires);
+				if (NULL == deviceNode) {
+					printf("ERROR: CtrlPointAddDevice: out of memory\n");
+					DEVICE_LIST_UNLOCK();
+					goto epilogue;
+				}
 				for (service = 0; service < SERVICE_SERVCOUNT;service++) {
-					memset(deviceNode->device.service[service].serviceId,0,sizeof(deviceNode->device.service[service].serviceId));
+					struct Service *svc = &deviceNode->device.service[service];
+
 					if(NULL != serviceId[service]) 
-						strcpy(deviceNode->device.service[service].serviceId, serviceId[service]);
-					memset(deviceNode->device.service[service].serviceType ,0, sizeof(deviceNode->device.service[service].serviceType));
-					if(NULL != g_serviceType[service])
-						strcpy(deviceNode->device.service[service].serviceType, g_serviceType[service]);
-					memset( deviceNode->device.service[service].controlURL,0,sizeof(deviceNode->device.service[service].controlURL) );
+						strncpy(svc->serviceId, serviceId[service], sizeof(svc->serviceId)-1);
 					if(NULL != controlURL[service])
-						strcpy(deviceNode->device.service[service].controlURL, controlURL[service]);
-					memset(deviceNode->device.service[service].eventURL ,0,sizeof(deviceNode->device.service[service].eventURL) );
-					if(NULL != eventURL[service])
-						strcpy(deviceNode->device.service[service].eventURL, eventURL[service]);
-					memset( deviceNode->device.service[service].SID,0,sizeof(deviceNode->device.service[service].SID) );
-					if(NULL != eventSID[service])
-						strcpy(deviceNode->device.service[service].SID, eventSID[service]);
-					for (var = 0; var < g_varCount[service]; var++) {
-						deviceNode->device.service[service].varStrVal[var] =	(char *)malloc(MAX_VAL_LEN);
-						memset(deviceNode->device.service[service].varStrVal[var],0,MAX_VAL_LEN);
-						strcpy(deviceNode->device.service[service].varStrVal[var], "");
+						strncpy(svc->controlURL, controlURL[service], sizeof(svc->controlURL)-1);
+					if(NULL != eventURL[service]) {
+						strncpy(svc->eventURL, eventURL[service], sizeof(svc->eventURL)-1);
+						/* Subscribed once the device is in the list */
+						svc->subState = SUBSCRIBE_PENDING;
 					}
 				}
-				deviceNode->next = NULL;
-				/* Insert the new device node in the list */
-				if ((tmpDevNode = g_deviceList)) {
-					while (tmpDevNode) {
-						if (tmpDevNode->next) {
-							tmpDevNode = tmpDevNode->next;
-						} else {
-							tmpDevNode->next = deviceNode;
-							break;
-						}
-					}
+				/* Insert the new device node at the tail of the list */
+				if (CtrlPointInsertNode(deviceNode) < 0) {
+					printf("ERROR: CtrlPointAddDevice: out of memory\n");
+					CtrlPointDeleteNode(deviceNode, &orphans);
 				} else {
-					g_deviceList = deviceNode;
+					added = 1;
+					/*Notify New Device Added */
+					NotifyStateUpdate(NULL, NULL,deviceNode->device.UDN,DEVICE_ADDED);
 				}
-				/*Notify New Device Added */
-				NotifyStateUpdate(NULL, NULL,deviceNode->device.UDN,DEVICE_ADDED);
 			}
+			DEVICE_LIST_UNLOCK();
 	}
 
-	ithread_mutex_unlock(&g_deviceListMutex);
+	/* Subscribe outside the device list lock; the SID is filled in when
+	* UPNP_EVENT_SUBSCRIBE_COMPLETE arrives */
+	for (service = 0; added && service < SERVICE_SERVCOUNT; service++) {
+		if (eventURL[service])
+			CtrlPointSubscribe(eventURL[service], SUBSCRIBE_PENDING);
+	}
 
+epilogue:
+	CtrlPointUnsubscribeOrphans(orphans);
 	if (deviceType) free(deviceType);
 	if (friendlyName) free(friendlyName);
 	if (UDN) free(UDN);
@@ -504,416 +1077,3206 @@ void CtrlPointAddDevice(IXML_Document *doc,const char *location,int expires)
 		if (controlURL[service]) free(controlURL[service]);
 		if (eventURL[service]) free(eventURL[service]);
 	}
+	return match ? 0 : -1;
 }
 
-char *str_sub(const char *st, const char *orig, char *repl) 
+int CtrlPointRefreshDevice(const char *UDN, const char *location, int expires)
 {
-	char *buffer = strdup("");
-	const char *p = st;
-	const char *ch = strstr(p, orig);
+	struct DeviceNode *tmpDevNode;
+	int rc = -1;
 
-	while (ch != NULL) {
-		buffer = (char *)realloc(buffer, (strlen(buffer) + (ch-p ) + strlen(repl) + 1) * sizeof(char));
-		buffer = strncat(buffer, p, ch-p);
-		buffer = strcat(buffer, repl);
-		p = ch + strlen(orig);
-		ch = strstr(p, orig);
+	DEVICE_LIST_RDLOCK();
+	tmpDevNode = IndexLookup(&g_udnIndex, UDN, NULL);
+	if (NULL == tmpDevNode) {
+		/* Embedded device or service of a device known by its location */
+		tmpDevNode = IndexLookup(&g_locationIndex, location, NULL);
 	}
-	buffer = (char *)realloc(buffer, (strlen(buffer) + strlen(p) + 1) * sizeof(char));
-	buffer = strcat(buffer, p);
-	return buffer;
+	if (tmpDevNode && location && strcmp(tmpDevNode->device.descDocURL, location) == 0) {
+		CtrlPointRenewNode(tmpDevNode, expires);
+		rc = 0;
+	}
+	DEVICE_LIST_UNLOCK();
+	return rc;
 }
 
-char *Unescaped(const char *st)
+int CtrlPointBeginDownload(const char *location)
 {
-	char *st_in = strdup(st);
-	char *st_out;
-	int i;
+	struct PendingDownload *pending;
+	int rc = 0;
 
-	struct {
-		char *in;
-		char *out;
-	} pattern[] = {
-		{ "&amp;",  "&"  },
-		{ "&apos;", "'"  },
-		{ "&lt;",   "<"  },
-		{ "&gt;",   ">"  },
-		{ "&quot;", "\"" }
-	};
+	ithread_mutex_lock(&g_downloadMutex);
+	for (pending = g_downloadList; pending; pending = pending->next) {
+		if (strcmp(pending->location, location) == 0) {
+			rc = -1;
+			break;
+		}
+	}
+	if (0 == rc) {
+		pending = (struct PendingDownload *)malloc(sizeof(struct PendingDownload));
+		if (pending) {
+			memset(pending, 0, sizeof(*pending));
+			strncpy(pending->location, location, sizeof(pending->location)-1);
+			pending->next = g_downloadList;
+			g_downloadList = pending;
+		}
+	}
+	ithread_mutex_unlock(&g_downloadMutex);
+	return rc;
+}
 
-	for (i=0; i<sizeof(pattern)/sizeof(pattern[0]); i++) {
-		st_out = str_sub(st_in, pattern[i].in, pattern[i].out );
-		free(st_in);
-		st_in = st_out;
+void CtrlPointEndDownload(const char *location)
+{
+	struct PendingDownload **link;
+	struct PendingDownload *pending;
+
+	ithread_mutex_lock(&g_downloadMutex);
+	for (link = &g_downloadList; (pending = *link); link = &pending->next) {
+		if (strcmp(pending->location, location) == 0) {
+			*link = pending->next;
+			free(pending);
+			break;
+		}
 	}
-	return st_in;
+	ithread_mutex_unlock(&g_downloadMutex);
 }
 
-char *Escaped(const char *st) 
+int CtrlPointFilterDiscovery(const struct Upnp_Discovery *dEvent)
 {
-	char *st_in = strdup(st);
-	char *st_out;
+	struct RejectedLocation *rejected;
+	time_t now = time(NULL);
 	int i;
+	int rc = 0;
 
-	struct {
-		char *in;
-		char *out;
-	} pattern[] = {
-		{ "&amp;",  "&"  },
-		{ "&apos;", "'"  },
-		{ "&lt;",   "<"  },
-		{ "&gt;",   ">"  },
-		{ "&quot;", "\"" }
-	};
-
-	for (i=0; i<sizeof(pattern)/sizeof(pattern[0]); i++) {
-		st_out = str_sub(st_in, pattern[i].out, pattern[i].in );
-		free(st_in);
-		st_in = st_out;
+	ithread_mutex_lock(&g_filterMutex);
+	/* Device and service adverts carry their type, root and uuid adverts don't */
+	if ('\0' != dEvent->DeviceType[0]
+		&& 0 != strncasecmp(dEvent->DeviceType, g_deviceType, strlen(g_deviceType)))
+		rc = -1;
+	if (0 == rc && '\0' != dEvent->ServiceType[0]) {
+		rc = -1;
+		for (i = 0; i < SERVICE_SERVCOUNT; i++) {
+			if (0 == strcasecmp(dEvent->ServiceType, g_serviceType[i]))
+				rc = 0;
+		}
+	}
+	if (0 == rc) {
+		rejected = g_rejectedList[HashString(dEvent->Location) & (DEVICE_HASH_SIZE - 1)];
+		while (rejected) {
+			if (rejected->expires > now && strcmp(rejected->location, dEvent->Location) == 0) {
+				rc = -1;
+				break;
+			}
+			rejected = rejected->next;
+		}
 	}
-	return st_in;
+	if (rc < 0)
+		g_filterDropped++;
+	ithread_mutex_unlock(&g_filterMutex);
+	return rc;
 }
 
-
-/* 
-״̬g_varName仯֪ͨ޸Ľڵ仯֪ͨ(AlarmsEnabled=1):
-ConfigurationUpdate='24,2015-07-27T20:47:22,<?xml version="1.0" encoding="UTF-8"?>
-<cms:ParameterValueList xmlns:cms="urn:schemas-upnp-org:dm:cms" xmlns:xsi="http://www.w3.org/2001/XMLSchema-instance" xsi:schemaLocation="urn:schemas-upnp-org:dm:cms http://www.upnp.org/schemas/dm/cms.xsd">
-	<Parameter>
-		<ParameterPath>/BBF/VoiceService/0/SIP/Network/0/Status</ParameterPath>
-		<Value>Up</Value>
-	</Parameter>
-</cms:ParameterValueList>'
-*/
-void StateVarUpdate(char *UDN, int service, IXML_Document *changedVariables,char **state)
+void CtrlPointRejectLocation(const char *location, int expires)
 {
-	IXML_NodeList *properties;
-	IXML_NodeList *variables;
-	IXML_Element *property;
-	IXML_Element *variable;
-	unsigned int length;
-	unsigned int length1;
-	unsigned int i;
-	int j;
+	struct RejectedLocation *rejected;
+	unsigned int slot = HashString(location) & (DEVICE_HASH_SIZE - 1);
 
-	printf("StateUpdate (service %d):\n", service);
-
-	/* Find all of the e:property tags in the document */
-	properties = ixmlDocument_getElementsByTagName(changedVariables,"e:property");
-	if (properties) 
-	{
-		length = ixmlNodeList_length(properties);
-		for (i = 0; i < length; i++) 
-		{
-			/* Loop through each property change found */
-			property = (IXML_Element *)ixmlNodeList_item(properties, i);
-			/* For each variable name in the state table,check if this is a corresponding property change */
-			for (j = 0; j < g_varCount[service]; j++) 
-			{
-				variables = ixmlElement_getElementsByTagName(property,g_varName[service][j]);
-				/* If a match is found, extract the value, and update the state table */
-				if (variables) 
-				{
-					length1 = ixmlNodeList_length(variables);
-					if (length1) 
-					{
-						char *tmpState = NULL;
-						variable = (IXML_Element *)ixmlNodeList_item(variables, 0);
-						tmpState = GetElementValue(variable);
-						if (tmpState) 
-						{
-							int ret = 0;
-							char version[NAME_SIZE]={0};
-							char lastDateTime[NAME_SIZE]={0};
-							char xmlBuffer[MAX_BUFFER]={0};
-							strncpy(state[j], tmpState,MAX_VAL_LEN-1);
-							printf(" %s='%s'\n", g_varName[service][j],tmpState);
-							ret = sscanf(tmpState,"%[^,],%[^,],%[^,]",version,lastDateTime,xmlBuffer);
-							if (3 == ret ) 
-							{
-								char *unescaped = NULL;
-								unescaped = Unescaped(xmlBuffer);
-								if( NULL != unescaped)
-								{
-									PrintParameters(unescaped);
-									free(unescaped);
-								}
-							}
-							free(tmpState);
-						}
-					}
-					ixmlNodeList_free(variables);
-					variables = NULL;
-				}
-			}
+	ithread_mutex_lock(&g_filterMutex);
+	for (rejected = g_rejectedList[slot]; rejected; rejected = rejected->next) {
+		if (strcmp(rejected->location, location) == 0)
+			break;
+	}
+	if (NULL == rejected) {
+		rejected = (struct RejectedLocation *)malloc(sizeof(struct RejectedLocation));
+		if (rejected) {
+			memset(rejected, 0, sizeof(*rejected));
+			strncpy(rejected->location, location, sizeof(rejected->location)-1);
+			rejected->next = g_rejectedList[slot];
+			g_rejectedList[slot] = rejected;
+			g_rejectedCount++;
 		}
-		ixmlNodeList_free(properties);
 	}
-	return;
+	if (rejected)
+		rejected->expires = time(NULL) + expires;
+	ithread_mutex_unlock(&g_filterMutex);
 }
 
-void CtrlPointHandleEvent(const char *sid,int evntkey,IXML_Document *changes)
+void CtrlPointPurgeRejected(int all)
 {
-	struct DeviceNode *tmpDevNode;
-	int service;
-
-	ithread_mutex_lock(&g_deviceListMutex);
-	tmpDevNode = g_deviceList;
-	while (tmpDevNode) {
-		for (service = 0; service < SERVICE_SERVCOUNT; ++service) {
-			if (strcmp(tmpDevNode->device.service[service].SID, sid)== 0) {
-				printf("Received %s Event: %d for SID %s\n",g_serviceName[service],evntkey,sid);
-				StateVarUpdate(tmpDevNode->device.UDN,service,changes,
-					(char **)&tmpDevNode->device.service[service].varStrVal);
-				break;
+	struct RejectedLocation **link;
+	struct RejectedLocation *rejected;
+	time_t now = time(NULL);
+	int slot;
+
+	ithread_mutex_lock(&g_filterMutex);
+	for (slot = 0; slot < DEVICE_HASH_SIZE; slot++) {
+		link = &g_rejectedList[slot];
+		while ((rejected = *link)) {
+			if (all || rejected->expires <= now) {
+				*link = rejected->next;
+				free(rejected);
+				g_rejectedCount--;
+			} else {
+				link = &rejected->next;
 			}
 		}
-		tmpDevNode = tmpDevNode->next;
 	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+	ithread_mutex_unlock(&g_filterMutex);
 }
 
-void CtrlPointHandleSubscribeUpdate(const char *eventURL,const Upnp_SID sid,int timeout)
+int CtrlPointSetFilter(const char *name, const char *value)
 {
-	struct DeviceNode *tmpDevNode;
-	int service;
+	int rc = 0;
 
-	ithread_mutex_lock(&g_deviceListMutex);
-	tmpDevNode = g_deviceList;
-	while (tmpDevNode) {
-		for (service = 0; service < SERVICE_SERVCOUNT; service++){
-			if (strcmp(tmpDevNode->device.service[service].eventURL,eventURL) == 0) {
-				printf("Received %s Event Renewal for eventURL %s\n",
-					g_serviceName[service], eventURL);
-				strcpy(tmpDevNode->device.service[service].SID, sid);
-				break;
-			}
-		}
-		tmpDevNode = tmpDevNode->next;
+	ithread_mutex_lock(&g_filterMutex);
+	if (NULL == name || '\0' == name[0]) {
+		printf("Filter:\n"
+			"  deviceType   = %s\n"
+			"  friendlyName = %s*\n"
+			"  rejected locations = %d, adverts dropped = %lu\n",
+			g_deviceType, g_friendlyName, g_rejectedCount, g_filterDropped);
+	} else if (0 == strcasecmp(name, "deviceType") && value && value[0]) {
+		memset(g_deviceType, 0, sizeof(g_deviceType));
+		strncpy(g_deviceType, value, sizeof(g_deviceType)-1);
+	} else if (0 == strcasecmp(name, "friendlyName")) {
+		memset(g_friendlyName, 0, sizeof(g_friendlyName));
+		if (value)
+			strncpy(g_friendlyName, value, sizeof(g_friendlyName)-1);
+	} else if (0 != strcasecmp(name, "clear")) {
+		printf("Unknown filter %s\n", name);
+		rc = -1;
 	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+	ithread_mutex_unlock(&g_filterMutex);
 
-	return;
-	timeout = timeout;
+	/* Earlier rejections may not hold under the new settings */
+	if (0 == rc && name && name[0])
+		CtrlPointPurgeRejected(1);
+	return rc;
 }
 
-void CtrlPointHandleGetVar(const char *controlURL,const char *varName,const DOMString varValue)
+int CtrlPointSubscribe(const char *eventURL, subscribeState state)
 {
 	struct DeviceNode *tmpDevNode;
 	int service;
+	int rc;
 
-	ithread_mutex_lock(&g_deviceListMutex);
-	tmpDevNode = g_deviceList;
-	while (tmpDevNode) {
-		for (service = 0; service < SERVICE_SERVCOUNT; service++) {
-			if (strcmp(tmpDevNode->device.service[service].controlURL,controlURL) == 0) {
-				NotifyStateUpdate(varName,varValue,tmpDevNode->device.UDN,GET_VAR_COMPLETE);
-				break;
-			}
-		}
-		tmpDevNode = tmpDevNode->next;
+	DEVICE_LIST_WRLOCK();
+	tmpDevNode = IndexLookup(&g_eventURLIndex, eventURL, &service);
+	if (tmpDevNode)
+		tmpDevNode->device.service[service].subState = state;
+	DEVICE_LIST_UNLOCK();
+	if (NULL == tmpDevNode)
+		return -1;
+
+	printf("Subscribing to eventURL %s...\n", eventURL);
+	rc = UpnpSubscribeAsync(g_cpHandle, eventURL, g_defaultTimeout,
+		CtrlPointCallbackEventHandler, NULL);
+	if (rc != UPNP_E_SUCCESS) {
+		printf("Error Subscribing to eventURL -- %d\n", rc);
+		CtrlPointHandleSubscribeFailed(eventURL, rc);
+		return -1;
 	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+	return 0;
 }
 
-void CtrlPointVerifyTimeouts(int incr)
+char *str_sub(const char *st, const char *orig, char *repl) 
 {
-	int ret;
-	struct DeviceNode *prevDevNode = NULL;
-	struct DeviceNode *curDevNode = NULL;
+	size_t origLen = strlen(orig);
+	size_t replLen = strlen(repl);
+	size_t count = 0;
+	const char *p = st;
+	const char *ch;
+	char *buffer;
+	char *out;
+
+	if (0 == origLen)
+		return strdup(st);
+	/* Count the matches first, so that the result is allocated once */
+	for (ch = strstr(p, orig); ch != NULL; ch = strstr(ch + origLen, orig))
+		count++;
+	buffer = (char *)malloc(strlen(st) - count * origLen + count * replLen + 1);
+	if (NULL == buffer)
+		return NULL;
+	out = buffer;
+	while ((ch = strstr(p, orig)) != NULL) {
+		memcpy(out, p, (size_t)(ch - p));
+		out += ch - p;
+		memcpy(out, repl, replLen);
+		out += replLen;
+		p = ch + origLen;
+	}
+	strcpy(out, p);
+	return buffer;
+}
 
-	ithread_mutex_lock(&g_deviceListMutex);
-	curDevNode = g_deviceList;
-	while (curDevNode) {
-		curDevNode->device.advrTimeOut -= incr;
-		/*printf("Advertisement Timeout: %d\n", curDevNode->device.advrTimeOut); */
-		if (curDevNode->device.advrTimeOut <= 0) {
-			/* This advertisement has expired, so we should remove the device from the list */
-			if (g_deviceList == curDevNode) g_deviceList = curDevNode->next;
-			else prevDevNode->next = curDevNode->next;
-			CtrlPointDeleteNode(curDevNode);
-			if (prevDevNode) curDevNode = prevDevNode->next;
-			else curDevNode = g_deviceList;
+const char *FindEntityChar(const char *st, const char *end, int escape)
+{
+#if defined(__AVX2__)
+	const __m256i amp = _mm256_set1_epi8('&');
+	const __m256i lt = _mm256_set1_epi8('<');
+	const __m256i gt = _mm256_set1_epi8('>');
+	const __m256i quot = _mm256_set1_epi8('"');
+	const __m256i apos = _mm256_set1_epi8('\'');
+	__m256i chunk, match;
+	unsigned int mask;
+
+	while (end - st >= 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)st);
+		match = _mm256_cmpeq_epi8(chunk, amp);
+		if (escape) {
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, lt));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, gt));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, quot));
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi8(chunk, apos));
+		}
+		mask = (unsigned int)_mm256_movemask_epi8(match);
+		if (mask)
+			return st + __builtin_ctz(mask);
+		st += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i apos = _mm_set1_epi8('\'');
+	__m128i chunk, match;
+	unsigned int mask;
+
+	while (end - st >= 16) {
+		chunk = _mm_loadu_si128((const __m128i *)st);
+		match = _mm_cmpeq_epi8(chunk, amp);
+		if (escape) {
+			match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, lt));
+			match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, gt));
+			match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, quot));
+			match = _mm_or_si128(match, _mm_cmpeq_epi8(chunk, apos));
+		}
+		mask = (unsigned int)_mm_movemask_epi8(match);
+		if (mask)
+			return st + __builtin_ctz(mask);
+		st += 16;
+	}
+#endif
+	for (; st < end; st++) {
+		if ('&' == *st)
+			return st;
+		if (escape && ('<' == *st || '>' == *st || '"' == *st || '\'' == *st))
+			return st;
+	}
+	return end;
+}
+
+/* The entity of a character escaped by Escaped, or NULL */
+const char *EntityOf(char ch)
+{
+	switch (ch) {
+		case '&': return "&amp;";
+		case '\'': return "&apos;";
+		case '<': return "&lt;";
+		case '>': return "&gt;";
+		case '"': return "&quot;";
+		default: return NULL;
+	}
+}
+
+char *Unescaped(const char *st)
+{
+	size_t len = strlen(st);
+	const char *end = st + len;
+	const char *amp;
+	const char *semi;
+	char *buffer;
+	char *out;
+	int decoded;
+
+	/* Decoding never makes the string longer */
+	buffer = (char *)malloc(len + 1);
+	if (NULL == buffer)
+		return NULL;
+	out = buffer;
+	while (st < end) {
+		amp = FindEntityChar(st, end, 0);
+		memcpy(out, st, (size_t)(amp - st));
+		out += amp - st;
+		if (amp == end)
+			break;
+		semi = (const char *)memchr(amp, ';', (size_t)(end - amp));
+		/* DecodeEntity writes at most 4 bytes, no more than "&lt;" takes */
+		decoded = semi ? DecodeEntity(amp + 1, (size_t)(semi - amp - 1), out) : 0;
+		if (decoded > 0) {
+			out += decoded;
+			st = semi + 1;
 		} else {
-			if (curDevNode->device.advrTimeOut < 2 * incr) {
-				/* This advertisement is about to expire, so
-				* send out a search request for this device UDN to try to renew */
-				ret = UpnpSearchAsync(g_cpHandle, incr,curDevNode->device.UDN,NULL);
-				printf("sending search request for Device UDN: %s -- ret = %d\n",curDevNode->device.UDN, ret);
-				if (ret != UPNP_E_SUCCESS)
-					printf("Error sending search request for Device UDN: %s -- err = %d\n",
-					curDevNode->device.UDN, ret);
+			*out++ = '&';
+			st = amp + 1;
+		}
+	}
+	*out = '\0';
+	return buffer;
+}
+
+char *Escaped(const char *st) 
+{
+	size_t len = strlen(st);
+	const char *end = st + len;
+	const char *p;
+	const char *entity;
+	char *buffer;
+	char *out;
+	size_t entityLen;
+
+	/* Size the result first */
+	for (p = FindEntityChar(st, end, 1); p < end; p = FindEntityChar(p + 1, end, 1))
+		len += strlen(EntityOf(*p)) - 1;
+	buffer = (char *)malloc(len + 1);
+	if (NULL == buffer)
+		return NULL;
+	out = buffer;
+	while (st < end) {
+		p = FindEntityChar(st, end, 1);
+		memcpy(out, st, (size_t)(p - st));
+		out += p - st;
+		if (p == end)
+			break;
+		entity = EntityOf(*p);
+		entityLen = strlen(entity);
+		memcpy(out, entity, entityLen);
+		out += entityLen;
+		st = p + 1;
+	}
+	*out = '\0';
+	return buffer;
+}
+
+void StrBufInit(struct StrBuf *buf)
+{
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
+}
+
+void StrBufReset(struct StrBuf *buf)
+{
+	buf->len = 0;
+	if (buf->data)
+		buf->data[0] = '\0';
+}
+
+int StrBufAppend(struct StrBuf *buf, const char *st, size_t len)
+{
+	char *data;
+	size_t size;
+
+	if (buf->len + len + 1 > buf->size) {
+		size = buf->size ? buf->size : NAME_SIZE;
+		while (size < buf->len + len + 1)
+			size *= 2;
+		data = (char *)realloc(buf->data, size);
+		if (NULL == data)
+			return -1;
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, st, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+	return 0;
+}
+
+void StrBufFree(struct StrBuf *buf)
+{
+	if (buf->data)
+		free(buf->data);
+	StrBufInit(buf);
+}
+
+/* Decode the entity between '&' and ';' into out, returns its length or 0 */
+int DecodeEntity(const char *name, size_t len, char *out)
+{
+	unsigned long code;
+	char *end;
+
+	if (2 == len && 0 == strncmp(name, "lt", 2)) {
+		out[0] = '<';
+	} else if (2 == len && 0 == strncmp(name, "gt", 2)) {
+		out[0] = '>';
+	} else if (3 == len && 0 == strncmp(name, "amp", 3)) {
+		out[0] = '&';
+	} else if (4 == len && 0 == strncmp(name, "quot", 4)) {
+		out[0] = '"';
+	} else if (4 == len && 0 == strncmp(name, "apos", 4)) {
+		out[0] = '\'';
+	} else if (len > 1 && '#' == name[0]) {
+		if ('x' == name[1] || 'X' == name[1])
+			code = strtoul(name + 2, &end, 16);
+		else
+			code = strtoul(name + 1, &end, 10);
+		if (end != name + len || 0 == code || code > 0x10FFFF)
+			return 0;
+		/* UTF-8 encoding of the character reference */
+		if (code < 0x80) {
+			out[0] = (char)code;
+			return 1;
+		} else if (code < 0x800) {
+			out[0] = (char)(0xC0 | (code >> 6));
+			out[1] = (char)(0x80 | (code & 0x3F));
+			return 2;
+		} else if (code < 0x10000) {
+			out[0] = (char)(0xE0 | (code >> 12));
+			out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+			out[2] = (char)(0x80 | (code & 0x3F));
+			return 3;
+		}
+		out[0] = (char)(0xF0 | (code >> 18));
+		out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+		out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+		out[3] = (char)(0x80 | (code & 0x3F));
+		return 4;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* Append the character data [st, end) with its entities decoded */
+int StrBufAppendDecoded(struct StrBuf *buf, const char *st, const char *end)
+{
+	const char *amp;
+	const char *semi;
+	char decoded[4];
+	int len;
+
+	while (st < end) {
+		amp = (const char *)memchr(st, '&', (size_t)(end - st));
+		if (NULL == amp)
+			return StrBufAppend(buf, st, (size_t)(end - st));
+		if (StrBufAppend(buf, st, (size_t)(amp - st)) < 0)
+			return -1;
+		semi = (const char *)memchr(amp, ';', (size_t)(end - amp));
+		len = semi ? DecodeEntity(amp + 1, (size_t)(semi - amp - 1), decoded) : 0;
+		if (len > 0) {
+			if (StrBufAppend(buf, decoded, (size_t)len) < 0)
+				return -1;
+			st = semi + 1;
+		} else {
+			/* Not an entity, keep the '&' as is */
+			if (StrBufAppend(buf, amp, 1) < 0)
+				return -1;
+			st = amp + 1;
+		}
+	}
+	return 0;
+}
+
+int ParseConfigurationUpdate(const char *st, struct ConfigurationUpdate *update)
+{
+	const char *comma;
+
+	memset(update, 0, sizeof(*update));
+	if (NULL == st)
+		return -1;
+	comma = strchr(st, ',');
+	if (NULL == comma)
+		return -1;
+	update->version = st;
+	update->versionLen = (size_t)(comma - st);
+	update->dateTime = comma + 1;
+	/* The XML document is the rest of the value, commas included */
+	comma = strchr(update->dateTime, ',');
+	if (NULL == comma) {
+		update->dateTimeLen = strlen(update->dateTime);
+	} else {
+		update->dateTimeLen = (size_t)(comma - update->dateTime);
+		update->xml = comma + 1;
+	}
+	return 0;
+}
+
+/* Compare the local name [name, name+len) of a tag with tag */
+int TagNameIs(const char *name, size_t len, const char *tag)
+{
+	return len == strlen(tag) && 0 == strncmp(name, tag, len);
+}
+
+int ParseParameterValueList(const char *xml, ParameterCallback callback, void *cookie)
+{
+	struct StrBuf path;
+	struct StrBuf value;
+	struct StrBuf *text = NULL;
+	char *unescaped = NULL;
+	const char *p = xml;
+	const char *lt;
+	const char *gt;
+	const char *end;
+	const char *name;
+	const char *colon;
+	size_t len;
+	int closing;
+	int empty;
+	int inParameter = 0;
+	int hasPath = 0;
+	int count = 0;
+	int rc = 0;
+
+	if (NULL == xml)
+		return -1;
+	/* Some devices escape the document once more */
+	if (0 == strncmp(xml, "&lt;", 4)) {
+		unescaped = Unescaped(xml);
+		if (NULL == unescaped)
+			return -1;
+		p = unescaped;
+	}
+	StrBufInit(&path);
+	StrBufInit(&value);
+
+	while (0 == rc && NULL != (lt = strchr(p, '<'))) {
+		/* Character data before the tag */
+		if (text && lt > p)
+			rc = StrBufAppendDecoded(text, p, lt);
+		if (0 == strncmp(lt, "<!--", 4)) {
+			end = strstr(lt + 4, "-->");
+			if (NULL == end) {
+				rc = -1;
+				break;
+			}
+			p = end + 3;
+			continue;
+		}
+		if (0 == strncmp(lt, "<![CDATA[", 9)) {
+			end = strstr(lt + 9, "]]>");
+			if (NULL == end) {
+				rc = -1;
+				break;
+			}
+			if (text)
+				rc = StrBufAppend(text, lt + 9, (size_t)(end - lt - 9));
+			p = end + 3;
+			continue;
+		}
+		gt = strchr(lt, '>');
+		if (NULL == gt) {
+			rc = -1;
+			break;
+		}
+		p = gt + 1;
+		/* XML declaration, processing instruction or DOCTYPE */
+		if ('?' == lt[1] || '!' == lt[1])
+			continue;
+
+		closing = '/' == lt[1];
+		empty = !closing && '/' == gt[-1];
+		name = lt + 1 + closing;
+		len = strcspn(name, " \t\r\n/>");
+		/* Ignore the namespace prefix */
+		colon = (const char *)memchr(name, ':', len);
+		if (colon) {
+			len -= (size_t)(colon + 1 - name);
+			name = colon + 1;
+		}
+
+		text = NULL;
+		if (TagNameIs(name, len, "Parameter")) {
+			if (!closing) {
+				inParameter = 1;
+				hasPath = 0;
+				StrBufReset(&path);
+				StrBufReset(&value);
+			}
+			if ((closing || empty) && inParameter) {
+				if (hasPath) {
+					callback(path.data ? path.data : "", value.data ? value.data : "", cookie);
+					count++;
+				}
+				inParameter = 0;
+			}
+		} else if (inParameter && TagNameIs(name, len, "ParameterPath")) {
+			if (!closing) {
+				hasPath = 1;
+				StrBufReset(&path);
+				if (!empty)
+					text = &path;
+			}
+		} else if (inParameter && TagNameIs(name, len, "Value")) {
+			if (!closing) {
+				StrBufReset(&value);
+				if (!empty)
+					text = &value;
 			}
-			prevDevNode = curDevNode;
-			curDevNode = curDevNode->next;
 		}
 	}
-	ithread_mutex_unlock(&g_deviceListMutex);
+
+	StrBufFree(&path);
+	StrBufFree(&value);
+	if (unescaped)
+		free(unescaped);
+	return rc < 0 ? -1 : count;
 }
 
-void *CtrlPointTimerLoop(void *args)
+/* Called with g_internLock held */
+const char *ParameterInternFind(const char *name)
 {
-	/* how often to verify the timeouts, in seconds */
-	int incr = 30;
+	struct InternEntry *entry;
 
-	while (g_cpTimerLoopRun) {
-		isleep((unsigned int)incr);
-		CtrlPointVerifyTimeouts(incr);
+	for (entry = g_internTable[HashString(name) & (INTERN_HASH_SIZE - 1)]; entry; entry = entry->next) {
+		if (0 == strcmp(entry->name, name))
+			return entry->name;
 	}
-	ithread_detach(ithread_self());
 	return NULL;
 }
 
-int CtrlPointStart()
+const char *ParameterIntern(const char *name, int add)
 {
-	ithread_t timerThread;
-	int rc;
-	unsigned short port = 0;
-	char *ipAddress = NULL;
+	struct InternEntry *entry;
+	const char *found;
+	unsigned int slot = HashString(name) & (INTERN_HASH_SIZE - 1);
+
+	ithread_rwlock_rdlock(&g_internLock);
+	found = ParameterInternFind(name);
+	ithread_rwlock_unlock(&g_internLock);
+	if (found || !add)
+		return found;
+
+	ithread_rwlock_wrlock(&g_internLock);
+	/* Another thread may have added it in between */
+	for (entry = g_internTable[slot]; entry; entry = entry->next) {
+		if (0 == strcmp(entry->name, name))
+			break;
+	}
+	if (NULL == entry) {
+		entry = (struct InternEntry *)malloc(sizeof(struct InternEntry));
+		if (entry && NULL == (entry->name = strdup(name))) {
+			free(entry);
+			entry = NULL;
+		}
+		if (entry) {
+			entry->next = g_internTable[slot];
+			g_internTable[slot] = entry;
+			g_internCount++;
+		}
+	}
+	ithread_rwlock_unlock(&g_internLock);
+	return entry ? entry->name : NULL;
+}
 
-	ithread_mutex_init(&g_deviceListMutex, 0);
-	printf("CtrlPointStart with paddress=%s port=%u\n",ipAddress ? ipAddress :"{NULL}",port);
-	rc = UpnpInit(ipAddress, port);
-	if (rc != UPNP_E_SUCCESS) {
-		printf("WinCEStart: UpnpInit() Error: %d\n", rc);
-		UpnpFinish();
+void ParameterInternClear(void)
+{
+	struct InternEntry *entry;
+	int i;
+
+	ithread_rwlock_wrlock(&g_internLock);
+	for (i = 0; i < INTERN_HASH_SIZE; i++) {
+		while ((entry = g_internTable[i])) {
+			g_internTable[i] = entry->next;
+			free(entry->name);
+			free(entry);
+		}
+	}
+	g_internCount = 0;
+	ithread_rwlock_unlock(&g_internLock);
+}
+
+int ParameterSplitPath(const char *path, const char **components, int add)
+{
+	char buf[MAX_VAL_LEN];
+	char *names[PARAMETER_MAX_DEPTH];
+	char *saveptr = NULL;
+	char *token;
+	size_t len = strlen(path);
+	int missing = 0;
+	int count = 0;
+	int i;
+
+	if (len >= sizeof(buf))
 		return -1;
+	memcpy(buf, path, len + 1);
+	for (token = strtok_r(buf, "/", &saveptr); token; token = strtok_r(NULL, "/", &saveptr)) {
+		if (PARAMETER_MAX_DEPTH == count)
+			return -1;
+		names[count++] = token;
 	}
-	if (!ipAddress)  ipAddress = UpnpGetServerIpAddress();
-	if (!port)  port = UpnpGetServerPort();
+	/* Known components, the common case, take the lock once */
+	ithread_rwlock_rdlock(&g_internLock);
+	for (i = 0; i < count; i++) {
+		components[i] = ParameterInternFind(names[i]);
+		if (NULL == components[i])
+			missing++;
+	}
+	ithread_rwlock_unlock(&g_internLock);
+	for (i = 0; i < count && missing > 0; i++) {
+		/* A component never seen is in no tree */
+		if (NULL == components[i] && (!add || NULL == (components[i] = ParameterIntern(names[i], 1))))
+			return -1;
+	}
+	return count;
+}
 
-	printf("UPnP CP Initialized ipaddress=%s port=%u\n",ipAddress ? ipAddress:"{NULL}",port);
-	rc = UpnpRegisterClient(CtrlPointCallbackEventHandler,&g_cpHandle,&g_cpHandle);
-	if (rc != UPNP_E_SUCCESS) {
-		printf("Error registering CP: %d\n", rc);
-		UpnpFinish();
+/* Binary search of the child whose label starts with component, else -1 and
+ * the position to insert it at */
+int ParameterNodeChild(const struct ParameterNode *node, const char *component, int *pos)
+{
+	int low = 0, high = node->childCount - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (node->children[mid]->label[0] == component)
+			return mid;
+		if ((uintptr_t)component < (uintptr_t)node->children[mid]->label[0])
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+	if (pos)
+		*pos = low;
+	return -1;
+}
+
+struct ParameterNode *ParameterNodeFind(struct ParameterCache *cache, const char **components, int count)
+{
+	struct ParameterNode *node = &cache->root;
+	int i = 0, k, child;
+
+	while (i < count) {
+		child = ParameterNodeChild(node, components[i], NULL);
+		if (child < 0)
+			return NULL;
+		node = node->children[child];
+		for (k = 0; k < node->labelCount && i < count; k++, i++) {
+			if (node->label[k] != components[i])
+				return NULL;
+		}
+		/* The path ends inside the label */
+		if (k < node->labelCount)
+			return NULL;
+	}
+	return node;
+}
+
+struct CachedParameter *ParameterCacheFind(struct ParameterCache *cache, const char *path)
+{
+	const char *components[PARAMETER_MAX_DEPTH];
+	struct ParameterNode *node;
+	int count = ParameterSplitPath(path, components, 0);
+
+	if (count <= 0)
+		return NULL;
+	node = ParameterNodeFind(cache, components, count);
+	return node ? node->param : NULL;
+}
+
+struct ParameterNode *ParameterNodeNew(const char **label, int labelCount)
+{
+	struct ParameterNode *node = (struct ParameterNode *)calloc(1, sizeof(struct ParameterNode));
+
+	if (NULL == node)
+		return NULL;
+	node->label = (const char **)malloc((size_t)labelCount * sizeof(const char *));
+	if (NULL == node->label) {
+		free(node);
+		return NULL;
+	}
+	memcpy(node->label, label, (size_t)labelCount * sizeof(const char *));
+	node->labelCount = labelCount;
+	return node;
+}
+
+int ParameterNodeAddChild(struct ParameterNode *node, struct ParameterNode *child, int pos)
+{
+	struct ParameterNode **grown;
+
+	/* Grow by doubling, the array is sized for powers of 2 */
+	if (0 == (node->childCount & (node->childCount - 1))) {
+		grown = (struct ParameterNode **)realloc(node->children,
+			(size_t)(node->childCount ? node->childCount * 2 : 1) * sizeof(struct ParameterNode *));
+		if (NULL == grown)
+			return -1;
+		node->children = grown;
+	}
+	memmove(node->children + pos + 1, node->children + pos,
+		(size_t)(node->childCount - pos) * sizeof(struct ParameterNode *));
+	node->children[pos] = child;
+	node->childCount++;
+	return 0;
+}
+
+int ParameterCacheUpdate(struct ParameterCache *cache, const char *path, const char *value, long version, time_t now,
+	char **previous)
+{
+	const char *components[PARAMETER_MAX_DEPTH];
+	struct ParameterNode *node = &cache->root;
+	struct ParameterNode *child;
+	struct ParameterNode *split;
+	char *copy;
+	int count = ParameterSplitPath(path, components, 1);
+	int i = 0, k, pos, index;
+	int changed = 0;
+
+	if (previous)
+		*previous = NULL;
+	if (count <= 0)
+		return -1;
+	while (i < count) {
+		index = ParameterNodeChild(node, components[i], &pos);
+		if (index < 0) {
+			/* The rest of the path becomes one new leaf */
+			child = ParameterNodeNew(components + i, count - i);
+			if (NULL == child || ParameterNodeAddChild(node, child, pos) < 0) {
+				ParameterNodeFree(child);
+				return -1;
+			}
+			node = child;
+			break;
+		}
+		child = node->children[index];
+		for (k = 1; k < child->labelCount && i + k < count && child->label[k] == components[i + k]; k++)
+			;
+		if (k < child->labelCount) {
+			/* Split the label: the common part goes to a new parent */
+			split = ParameterNodeNew(child->label, k);
+			if (NULL == split || ParameterNodeAddChild(split, child, 0) < 0) {
+				ParameterNodeFree(split);
+				return -1;
+			}
+			memmove(child->label, child->label + k, (size_t)(child->labelCount - k) * sizeof(const char *));
+			child->labelCount -= k;
+			node->children[index] = split;
+			child = split;
+		}
+		node = child;
+		i += k;
+	}
+
+	if (NULL == node->param) {
+		node->param = (struct CachedParameter *)calloc(1, sizeof(struct CachedParameter));
+		if (NULL == node->param)
+			return -1;
+		cache->count++;
+	}
+	if (NULL == node->param->value || strcmp(node->param->value, value) != 0) {
+		copy = strdup(value);
+		if (NULL == copy)
+			return -1;
+		if (previous)
+			*previous = node->param->value;
+		else
+			free(node->param->value);
+		node->param->value = copy;
+		changed = 1;
+	}
+	node->param->updated = now;
+	node->param->version = version;
+	return changed;
+}
+
+void ParameterNodeFree(struct ParameterNode *node)
+{
+	int i;
+
+	if (NULL == node)
+		return;
+	for (i = 0; i < node->childCount; i++)
+		ParameterNodeFree(node->children[i]);
+	free(node->children);
+	free(node->label);
+	if (node->param) {
+		free(node->param->value);
+		free(node->param);
+	}
+	free(node);
+}
+
+/* Remove the value at components from the subtree of node, dropping the
+ * nodes left empty and merging the ones left with a single child.
+ * Returns 1 if a value was removed. */
+int ParameterNodeRemove(struct ParameterNode *node, const char **components, int count)
+{
+	struct ParameterNode *child;
+	struct ParameterNode *only;
+	const char **label;
+	int index, k, removed;
+
+	if (0 == count) {
+		if (NULL == node->param)
+			return 0;
+		free(node->param->value);
+		free(node->param);
+		node->param = NULL;
+		return 1;
+	}
+	index = ParameterNodeChild(node, components[0], NULL);
+	if (index < 0)
+		return 0;
+	child = node->children[index];
+	if (child->labelCount > count)
+		return 0;
+	for (k = 1; k < child->labelCount; k++) {
+		if (child->label[k] != components[k])
+			return 0;
+	}
+	removed = ParameterNodeRemove(child, components + k, count - k);
+	if (!removed || child->param)
+		return removed;
+	if (0 == child->childCount) {
+		memmove(node->children + index, node->children + index + 1,
+			(size_t)(node->childCount - index - 1) * sizeof(struct ParameterNode *));
+		node->childCount--;
+		ParameterNodeFree(child);
+	} else if (1 == child->childCount) {
+		/* child and its only child become one node */
+		only = child->children[0];
+		label = (const char **)realloc(child->label,
+			(size_t)(child->labelCount + only->labelCount) * sizeof(const char *));
+		if (NULL == label)
+			return removed;
+		memcpy(label + child->labelCount, only->label, (size_t)only->labelCount * sizeof(const char *));
+		free(only->label);
+		only->label = label;
+		only->labelCount += child->labelCount;
+		node->children[index] = only;
+		child->label = NULL;
+		child->childCount = 0;
+		ParameterNodeFree(child);
+	}
+	return removed;
+}
+
+void ParameterCacheRemove(struct ParameterCache *cache, const char *path)
+{
+	const char *components[PARAMETER_MAX_DEPTH];
+	int count = ParameterSplitPath(path, components, 0);
+
+	if (count > 0 && ParameterNodeRemove(&cache->root, components, count))
+		cache->count--;
+}
+
+void ParameterCacheFree(struct ParameterCache *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->root.childCount; i++)
+		ParameterNodeFree(cache->root.children[i]);
+	free(cache->root.children);
+	cache->root.children = NULL;
+	cache->root.childCount = 0;
+	cache->count = 0;
+}
+
+int ParameterNodeWalk(struct ParameterNode *node, struct StrBuf *path, CachedParameterCallback callback, void *cookie)
+{
+	size_t len = path->len;
+	int count = 0;
+	int i, rc;
+
+	for (i = 0; i < node->labelCount; i++) {
+		if (StrBufAppend(path, "/", 1) < 0 || StrBufAppend(path, node->label[i], strlen(node->label[i])) < 0)
+			return -1;
+	}
+	if (node->param) {
+		callback(path->data, node->param, cookie);
+		count++;
+	}
+	for (i = 0; i < node->childCount; i++) {
+		rc = ParameterNodeWalk(node->children[i], path, callback, cookie);
+		if (rc < 0)
+			return -1;
+		count += rc;
+	}
+	path->len = len;
+	if (path->data)
+		path->data[len] = '\0';
+	return count;
+}
+
+int ParameterCacheWalk(struct ParameterCache *cache, const char *prefix, CachedParameterCallback callback, void *cookie)
+{
+	const char *components[PARAMETER_MAX_DEPTH];
+	struct ParameterNode *node = &cache->root;
+	struct ParameterNode *child;
+	struct StrBuf path;
+	int count = prefix ? ParameterSplitPath(prefix, components, 0) : 0;
+	int i = 0, k, index, rc;
+
+	if (count < 0)
+		return 0;
+	/* Down to the node holding the prefix, which may end inside its label */
+	StrBufInit(&path);
+	while (node && i < count) {
+		index = ParameterNodeChild(node, components[i], NULL);
+		child = index < 0 ? NULL : node->children[index];
+		for (k = 0; child && k < child->labelCount && i + k < count; k++) {
+			if (child->label[k] != components[i + k])
+				child = NULL;
+		}
+		node = child;
+		i += child ? k : 0;
+		for (k = 0; child && i < count && k < child->labelCount; k++) {
+			StrBufAppend(&path, "/", 1);
+			StrBufAppend(&path, child->label[k], strlen(child->label[k]));
+		}
+	}
+	rc = node ? ParameterNodeWalk(node, &path, callback, cookie) : 0;
+	StrBufFree(&path);
+	return rc;
+}
+
+int ParameterCacheChange(struct ParameterCache *cache, const char *path, const char *value)
+{
+	char *previous = NULL;
+	int rc;
+
+	rc = ParameterCacheUpdate(cache, path, value, cache->version, time(NULL),
+		cache->owner ? &previous : NULL);
+	if (rc > 0) {
+		MetricAdd(METRIC_PARAMETERS_CHANGED, 1);
+		if (cache->owner)
+			NotifyParameterChange(cache->owner, path, previous, value, cache->version);
+	} else if (0 == rc) {
+		MetricAdd(METRIC_PARAMETERS_UNCHANGED, 1);
+	}
+	free(previous);
+	return rc;
+}
+
+void ParameterCacheCallback(const char *path, const char *value, void *cookie)
+{
+	ParameterCacheChange((struct ParameterCache *)cookie, path, value);
+}
+
+void ParameterNodeStale(struct ParameterNode *node)
+{
+	int i;
+
+	if (node->param)
+		node->param->updated = 0;
+	for (i = 0; i < node->childCount; i++)
+		ParameterNodeStale(node->children[i]);
+}
+
+void ParameterCacheSetVersion(struct ParameterCache *cache, const struct ConfigurationUpdate *update)
+{
+	long version = strtol(update->version, NULL, 10);
+
+	if (version == cache->version)
+		return;
+	/* The next version lists what changed, the other values are still
+	 * good. After a gap, or without the list, what changed is unknown. */
+	if (NULL == update->xml || cache->version < 0
+		|| version != ((cache->version + 1) & 0xFFFFFFFFL))
+		ParameterNodeStale(&cache->root);
+	cache->version = version;
+}
+
+int ParameterVersionOlder(long version, long current)
+{
+	unsigned long behind;
+
+	if (current < 0 || version < 0)
+		return 0;
+	/* Serial number arithmetic: less than half the ui4 range behind is older */
+	behind = ((unsigned long)current - (unsigned long)version) & 0xFFFFFFFFUL;
+	return behind > 0 && behind < 0x80000000UL;
+}
+
+int ParameterCacheApply(struct ParameterCache *cache, const char *configurationUpdate)
+{
+	struct ConfigurationUpdate update;
+
+	if (ParseConfigurationUpdate(configurationUpdate, &update) < 0)
 		return -1;
+	/* An answer sent before the events already applied would roll them back */
+	if (ParameterVersionOlder(strtol(update.version, NULL, 10), cache->version))
+		return 1;
+	ParameterCacheSetVersion(cache, &update);
+	if (update.xml)
+		ParseParameterValueList(update.xml, ParameterCacheCallback, cache);
+	return 0;
+}
+
+
+/* 
+״̬g_varName仯֪ͨ޸Ľڵ仯֪ͨ(AlarmsEnabled=1):
+ConfigurationUpdate='24,2015-07-27T20:47:22,<?xml version="1.0" encoding="UTF-8"?>
+<cms:ParameterValueList xmlns:cms="urn:schemas-upnp-org:dm:cms" xmlns:xsi="http://www.w3.org/2001/XMLSchema-instance" xsi:schemaLocation="urn:schemas-upnp-org:dm:cms http://www.upnp.org/schemas/dm/cms.xsd">
+	<Parameter>
+		<ParameterPath>/BBF/VoiceService/0/SIP/Network/0/Status</ParameterPath>
+		<Value>Up</Value>
+	</Parameter>
+</cms:ParameterValueList>'
+*/
+void StateVarUpdate(char *UDN, int service, IXML_Document *changedVariables,char **state,
+	struct ParameterCache *cache)
+{
+	IXML_NodeList *properties;
+	IXML_NodeList *variables;
+	IXML_Element *property;
+	IXML_Element *variable;
+	unsigned int length;
+	unsigned int length1;
+	unsigned int i;
+	int j;
+
+	if (g_eventLog)
+		printf("StateUpdate (service %d):\n", service);
+
+	/* Find all of the e:property tags in the document */
+	properties = ixmlDocument_getElementsByTagName(changedVariables,"e:property");
+	if (properties) 
+	{
+		length = ixmlNodeList_length(properties);
+		for (i = 0; i < length; i++) 
+		{
+			/* Loop through each property change found */
+			property = (IXML_Element *)ixmlNodeList_item(properties, i);
+			/* For each variable name in the state table,check if this is a corresponding property change */
+			for (j = 0; j < g_varCount[service]; j++) 
+			{
+				variables = ixmlElement_getElementsByTagName(property,g_varName[service][j]);
+				/* If a match is found, extract the value, and update the state table */
+				if (variables) 
+				{
+					length1 = ixmlNodeList_length(variables);
+					if (length1) 
+					{
+						const char *tmpState = NULL;
+						variable = (IXML_Element *)ixmlNodeList_item(variables, 0);
+						tmpState = GetElementText(variable);
+						if (tmpState) 
+						{
+							struct ConfigurationUpdate update;
+							struct ParameterCache *values = NULL;
+							/* state keeps MAX_VAL_LEN-1 characters: a longer value cannot be
+							 * compared in full, and is taken as changed */
+							int changed = strlen(tmpState) >= MAX_VAL_LEN-1
+								|| strncmp(state[j], tmpState, MAX_VAL_LEN-1) != 0;
+							int cached = cache && 0 == strcmp(g_varName[service][j], "ConfigurationUpdate");
+							/* Values of ConfigurationUpdate are notified and printed one by one by the cache */
+							if (changed && !cached)
+								NotifyStateUpdate(g_varName[service][j], tmpState, UDN, STATE_UPDATE);
+							strncpy(state[j], tmpState,MAX_VAL_LEN-1);
+							if (changed && !cached && g_eventLog)
+								printf(" %s='%s'\n", g_varName[service][j],tmpState);
+							/* version,dateTime,xml: the xml is parsed in place */
+							if (0 == ParseConfigurationUpdate(tmpState, &update)) 
+							{
+								/* Only ConfigurationUpdate carries parameter values */
+								if (cached) {
+									if (g_eventLog)
+										printf(" ConfigurationUpdate version %.*s\n", (int)update.versionLen, update.version);
+									ParameterCacheSetVersion(cache, &update);
+									values = cache;
+								}
+								/* Without the log, the values are only worth parsing for the cache */
+								if (update.xml && (g_eventLog || values)
+									&& ParseParameterValueList(update.xml,
+										g_eventLog ? PrintParameter : ParameterCacheCallback, values) < 0)
+									printf("Error parsing ParameterValueList\n");
+							}
+						}
+					}
+					ixmlNodeList_free(variables);
+					variables = NULL;
+				}
+			}
+		}
+		ixmlNodeList_free(properties);
+	}
+	return;
+}
+
+int EventKeyMissed(int last, int key)
+{
+	/* The key after 2147483647 is 1, 0 being only the initial event */
+	int next = (last < 0 || INT_MAX == last) ? 1 : last + 1;
+
+	if (last < 0)
+		return key;
+	if (key == next)
+		return 0;
+	/* Just wrapped: keys up to half the range are ahead, the others older */
+	if (1 == next)
+		return key > 0 && key <= INT_MAX / 2 ? key - next : -1;
+	if (key > last)
+		return key - next;
+	/* Here last < INT_MAX, so neither term overflows */
+	if (key > 0 && last - key > INT_MAX / 2)
+		return (INT_MAX - last) + (key - 1);
+	return -1;
+}
+
+void CtrlPointHandleEvent(const char *sid,int evntkey,IXML_Document *changes)
+{
+	struct DeviceNode *tmpDevNode;
+	struct Service *svc;
+	int service;
+	int missed;
+	double start;
+
+	MetricAdd(METRIC_EVENTS_RECEIVED, 1);
+	DEVICE_LIST_RDLOCK();
+	tmpDevNode = IndexLookup(&g_sidIndex, sid, &service);
+	if (tmpDevNode) {
+		if (g_eventLog)
+			printf("Received %s Event: %d for SID %s\n",g_serviceName[service],evntkey,sid);
+		MetricAdd(METRIC_EVENTS_ROUTED, 1);
+		ithread_mutex_lock(&tmpDevNode->mutex);
+		svc = &tmpDevNode->device.service[service];
+		missed = EventKeyMissed(svc->eventKey, evntkey);
+		if (missed < 0) {
+			/* Already applied, or older than what was */
+			printf("Dropped %s Event: %d, EventKey %d already seen\n",
+				g_serviceName[service], evntkey, svc->eventKey);
+			MetricAdd(METRIC_EVENTS_STALE, 1);
+			ithread_mutex_unlock(&tmpDevNode->mutex);
+			DEVICE_LIST_UNLOCK();
+			return;
+		}
+		svc->eventKey = evntkey;
+		if (missed > 0) {
+			MetricAdd(METRIC_EVENTS_MISSED, (unsigned long)missed);
+			/* What the missed events changed is unknown */
+			ParameterNodeStale(&tmpDevNode->cache.root);
+			/* One GetVar at a time brings back the version, the cache knows
+			 * its values are stale from there */
+			if (!svc->resync) {
+				printf("Missed %d %s Event(s) before %d for SID %s, resyncing ConfigurationUpdate\n",
+					missed, g_serviceName[service], evntkey, sid);
+				if (0 == CtrlPointSendGetVar(tmpDevNode, 0, service, "ConfigurationUpdate")) {
+					svc->resync = 1;
+					MetricAdd(METRIC_RESYNCS, 1);
+				}
+			}
+		}
+		start = CtrlPointNow();
+		StateVarUpdate(tmpDevNode->device.UDN,service,changes,
+			(char **)&tmpDevNode->device.service[service].varStrVal,&tmpDevNode->cache);
+		LatencyRecord(&g_eventParseTime, CtrlPointNow() - start, UPNP_E_SUCCESS);
+		ithread_mutex_unlock(&tmpDevNode->mutex);
+	} else {
+		MetricAdd(METRIC_EVENTS_UNKNOWN_SID, 1);
+	}
+	DEVICE_LIST_UNLOCK();
+}
+
+void CtrlPointHandleSubscribeUpdate(const char *eventURL,const Upnp_SID sid,int timeout)
+{
+	struct DeviceNode *tmpDevNode;
+	Upnp_SID orphanSID;
+	int service;
+
+	DEVICE_LIST_WRLOCK();
+	tmpDevNode = IndexLookup(&g_eventURLIndex, eventURL, &service);
+	if (tmpDevNode) {
+		struct Service *svc = &tmpDevNode->device.service[service];
+
+		printf("Subscribed to %s eventURL %s with SID=%s\n",
+			g_serviceName[service], eventURL, sid);
+		if (strcmp(svc->SID, sid) != 0) {
+			/* Keep the SID index in step with the new subscription */
+			IndexRemove(&g_sidIndex, svc->SID, tmpDevNode);
+			DispatchRouteRemove(svc->SID, tmpDevNode->device.UDN);
+			memset(svc->SID, 0, sizeof(svc->SID));
+			strncpy(svc->SID, sid, sizeof(svc->SID)-1);
+			IndexInsert(&g_sidIndex, svc->SID, tmpDevNode, service);
+			DispatchRouteAdd(svc->SID, tmpDevNode->device.UDN);
+			/* EventKeys start over with the new subscription */
+			svc->eventKey = -1;
+		}
+		svc->subState = SUBSCRIBE_SUBSCRIBED;
+		svc->subTimeOut = timeout;
+	}
+	DEVICE_LIST_UNLOCK();
+
+	if (NULL == tmpDevNode) {
+		/* The device went away while the subscription was in flight */
+		memset(orphanSID, 0, sizeof(orphanSID));
+		strncpy(orphanSID, sid, sizeof(orphanSID)-1);
+		UpnpUnSubscribeAsync(g_cpHandle, orphanSID, CtrlPointCallbackEventHandler, NULL);
+	}
+}
+
+void CtrlPointHandleSubscribeFailed(const char *eventURL, int errCode)
+{
+	struct DeviceNode *tmpDevNode;
+	int service;
+
+	DEVICE_LIST_WRLOCK();
+	tmpDevNode = IndexLookup(&g_eventURLIndex, eventURL, &service);
+	if (tmpDevNode) {
+		struct Service *svc = &tmpDevNode->device.service[service];
+
+		printf("Error Subscribing to %s eventURL %s -- %d\n",
+			g_serviceName[service], eventURL, errCode);
+		MetricAdd(SUBSCRIBE_RENEWING == svc->subState ?
+			METRIC_RENEW_FAILURES : METRIC_SUBSCRIBE_FAILURES, 1);
+		/* The old subscription, if any, is gone; retried by the timer */
+		IndexRemove(&g_sidIndex, svc->SID, tmpDevNode);
+		DispatchRouteRemove(svc->SID, tmpDevNode->device.UDN);
+		memset(svc->SID, 0, sizeof(svc->SID));
+		svc->subState = SUBSCRIBE_FAILED;
+		ithread_mutex_lock(&g_timerMutex);
+		if (0 == tmpDevNode->retryTime) {
+			tmpDevNode->retryTime = time(NULL) + SUBSCRIBE_RETRY_DELAY;
+			CtrlPointScheduleNode(tmpDevNode);
+		}
+		ithread_mutex_unlock(&g_timerMutex);
+	}
+	DEVICE_LIST_UNLOCK();
+}
+
+void CtrlPointHandleGetVar(const char *controlURL,const char *varName,const DOMString varValue)
+{
+	struct DeviceNode *tmpDevNode;
+	int service;
+	int var;
+	int rc = -1;
+
+	DEVICE_LIST_RDLOCK();
+	tmpDevNode = IndexLookup(&g_controlURLIndex, controlURL, &service);
+	if (tmpDevNode) {
+		if (varValue)
+			NotifyStateUpdate(varName,varValue,tmpDevNode->device.UDN,GET_VAR_COMPLETE);
+		if (0 == strcmp(varName, "ConfigurationUpdate")) {
+			struct Service *svc = &tmpDevNode->device.service[service];
+
+			ithread_mutex_lock(&tmpDevNode->mutex);
+			if (varValue)
+				rc = ParameterCacheApply(&tmpDevNode->cache, varValue);
+			if (rc > 0)
+				printf("Dropped %s of %s older than version %ld\n", varName,
+					tmpDevNode->device.UDN, tmpDevNode->cache.version);
+			if (svc->resync) {
+				/* Answers the GetVar sent after missed events, newer events may have come first */
+				svc->resync = 0;
+				for (var = 0; 0 == rc && var < g_varCount[service]; var++) {
+					if (0 == strcmp(g_varName[service][var], varName) && svc->varStrVal[var]) {
+						strncpy(svc->varStrVal[var], varValue, MAX_VAL_LEN-1);
+						printf("Resynced %s of %s\n", varName, tmpDevNode->device.UDN);
+					}
+				}
+			}
+			ithread_mutex_unlock(&tmpDevNode->mutex);
+		}
+	}
+	DEVICE_LIST_UNLOCK();
+}
+
+void TimerHeapSwap(int i, int j)
+{
+	struct DeviceNode *node = g_timerHeap[i];
+
+	g_timerHeap[i] = g_timerHeap[j];
+	g_timerHeap[j] = node;
+	g_timerHeap[i]->heapIndex = i;
+	g_timerHeap[j]->heapIndex = j;
+}
+
+void TimerHeapUp(int i)
+{
+	while (i > 0 && g_timerHeap[(i - 1) / 2]->deadline > g_timerHeap[i]->deadline) {
+		TimerHeapSwap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+void TimerHeapDown(int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < g_timerHeapCount) {
+		if (child + 1 < g_timerHeapCount
+			&& g_timerHeap[child + 1]->deadline < g_timerHeap[child]->deadline)
+			child++;
+		if (g_timerHeap[i]->deadline <= g_timerHeap[child]->deadline)
+			break;
+		TimerHeapSwap(i, child);
+		i = child;
+	}
+}
+
+void TimerHeapRemove(struct DeviceNode *node)
+{
+	int i = node->heapIndex;
+
+	if (i < 0)
+		return;
+	node->heapIndex = -1;
+	g_timerHeapCount--;
+	if (i == g_timerHeapCount)
+		return;
+	g_timerHeap[i] = g_timerHeap[g_timerHeapCount];
+	g_timerHeap[i]->heapIndex = i;
+	TimerHeapUp(i);
+	TimerHeapDown(g_timerHeap[i]->heapIndex);
+}
+
+int CtrlPointScheduleNode(struct DeviceNode *node)
+{
+	struct DeviceNode **grown;
+	time_t deadline;
+
+	/* Search for the device a while before it expires, then expire it */
+	deadline = node->renewSent ? node->expireTime : node->renewTime;
+	if (node->retryTime && node->retryTime < deadline)
+		deadline = node->retryTime;
+	node->deadline = deadline;
+
+	if (node->heapIndex < 0) {
+		if (g_timerHeapCount == g_timerHeapSize) {
+			grown = (struct DeviceNode **)realloc(g_timerHeap,
+				(size_t)(g_timerHeapSize ? g_timerHeapSize * 2 : 64) * sizeof(struct DeviceNode *));
+			if (NULL == grown)
+				return -1;
+			g_timerHeap = grown;
+			g_timerHeapSize = g_timerHeapSize ? g_timerHeapSize * 2 : 64;
+		}
+		node->heapIndex = g_timerHeapCount;
+		g_timerHeap[g_timerHeapCount++] = node;
+	}
+	TimerHeapUp(node->heapIndex);
+	TimerHeapDown(node->heapIndex);
+	/* A new earliest deadline, the timer thread may be sleeping past it */
+	if (0 == node->heapIndex)
+		ithread_cond_signal(&g_timerCond);
+	return 0;
+}
+
+void CtrlPointRenewNode(struct DeviceNode *node, int expires)
+{
+	ithread_mutex_lock(&g_timerMutex);
+	node->device.advrTimeOut = expires;
+	node->expireTime = time(NULL) + expires;
+	node->renewTime = CtrlPointRenewTime(node);
+	node->renewSent = 0;
+	if (node->heapIndex >= 0)
+		CtrlPointScheduleNode(node);
+	ithread_mutex_unlock(&g_timerMutex);
+}
+
+time_t CtrlPointRenewTime(struct DeviceNode *node)
+{
+	/* Devices that booted together are spread by a jitter of their own */
+	return node->expireTime - DEVICE_RENEW_LEAD
+		+ (time_t)(HashString(node->device.UDN) % DEVICE_RENEW_JITTER);
+}
+
+int CtrlPointTakeSearchTokens(int count)
+{
+	double now = CtrlPointNow();
+
+	g_searchTokens += (now - g_searchTokensTime) * g_searchRate;
+	if (g_searchTokens > g_searchRate)
+		g_searchTokens = g_searchRate;
+	g_searchTokensTime = now;
+	if (g_searchTokens < count)
+		return -1;
+	g_searchTokens -= count;
+	return 0;
+}
+
+void CtrlPointVerifyTimeouts(time_t now)
+{
+	int ret;
+	int service;
+	int typeSearch = 0;
+	int nrenew = 0;
+	int renewSize = 0;
+	int i;
+	char deviceType[NAME_SIZE];
+	struct DeviceNode **renewNodes = NULL;
+	struct DeviceNode **grown;
+	struct DeviceNode *curDevNode = NULL;
+	struct OrphanSID *orphans = NULL;
+	struct TimerWork {
+		char name[NAME_SIZE];
+		struct TimerWork *next;
+	} *retryList = NULL, *searchList = NULL, *expiredList = NULL, *work;
+
+	DEVICE_LIST_WRLOCK();
+	ithread_mutex_lock(&g_timerMutex);
+	/* Only the devices whose deadline has come are looked at */
+	while (g_timerHeapCount > 0 && g_timerHeap[0]->deadline <= now) {
+		curDevNode = g_timerHeap[0];
+		if (curDevNode->retryTime && curDevNode->retryTime <= now) {
+			/* Collect failed subscriptions, they are retried after unlocking */
+			curDevNode->retryTime = 0;
+			for (service = 0; service < SERVICE_SERVCOUNT; service++) {
+				if (SUBSCRIBE_FAILED != curDevNode->device.service[service].subState)
+					continue;
+				work = (struct TimerWork *)malloc(sizeof(struct TimerWork));
+				if (NULL == work)
+					break;
+				strcpy(work->name, curDevNode->device.service[service].eventURL);
+				work->next = retryList;
+				retryList = work;
+			}
+		}
+		if (curDevNode->expireTime <= now) {
+			/* This advertisement has expired, so we should remove the device from the list */
+			TimerHeapRemove(curDevNode);
+			work = (struct TimerWork *)malloc(sizeof(struct TimerWork));
+			if (work) {
+				strcpy(work->name, curDevNode->device.UDN);
+				work->next = expiredList;
+				expiredList = work;
+			}
+			continue;
+		}
+		if (!curDevNode->renewSent && curDevNode->renewTime <= now) {
+			/* This advertisement is about to expire, the renewal
+			* searches are decided on once all of them are known */
+			curDevNode->renewSent = 1;
+			if (nrenew == renewSize) {
+				grown = (struct DeviceNode **)realloc(renewNodes,
+					(size_t)(renewSize ? renewSize * 2 : 16) * sizeof(struct DeviceNode *));
+				if (grown) {
+					renewNodes = grown;
+					renewSize = renewSize ? renewSize * 2 : 16;
+				}
+			}
+			if (nrenew < renewSize)
+				renewNodes[nrenew++] = curDevNode;
+		}
+		CtrlPointScheduleNode(curDevNode);
+	}
+
+	if (nrenew > 0 && now < g_typeSearchUntil) {
+		/* Answers to the last device type search renew these as well */
+	} else if (nrenew > 0 && nrenew < g_renewBurst && 0 == CtrlPointTakeSearchTokens(nrenew)) {
+		/* Send out a search request for each device UDN to try to renew */
+		for (i = 0; i < nrenew; i++) {
+			work = (struct TimerWork *)malloc(sizeof(struct TimerWork));
+			if (NULL == work)
+				break;
+			strcpy(work->name, renewNodes[i]->device.UDN);
+			work->next = searchList;
+			searchList = work;
+		}
+	} else if (nrenew > 0 && 0 == CtrlPointTakeSearchTokens(1)) {
+		/* Too many at once for the budget: one search for the device type */
+		typeSearch = nrenew;
+		g_typeSearchUntil = now + DEVICE_RENEW_LEAD / 2;
+	} else if (nrenew > 0) {
+		/* Out of budget, try again in a second */
+		for (i = 0; i < nrenew; i++) {
+			renewNodes[i]->renewSent = 0;
+			renewNodes[i]->renewTime = now + 1;
+			CtrlPointScheduleNode(renewNodes[i]);
+		}
+	}
+	ithread_mutex_unlock(&g_timerMutex);
+	if (renewNodes) free(renewNodes);
+
+	while ((work = expiredList)) {
+		expiredList = work->next;
+		curDevNode = IndexLookup(&g_udnIndex, work->name, NULL);
+		if (curDevNode) {
+			printf("Advertisement of %s expired\n", work->name);
+			CtrlPointUnlinkNode(curDevNode);
+			/* The device is likely dead: unsubscribed once unlocked */
+			CtrlPointDeleteNode(curDevNode, &orphans);
+		}
+		free(work);
+	}
+	DEVICE_LIST_UNLOCK();
+	CtrlPointUnsubscribeOrphans(orphans);
+
+	if (typeSearch) {
+		ithread_mutex_lock(&g_filterMutex);
+		strcpy(deviceType, g_deviceType);
+		ithread_mutex_unlock(&g_filterMutex);
+		ret = UpnpSearchAsync(g_cpHandle, DEVICE_RENEW_LEAD / 2, deviceType, NULL);
+		printf("sending search request for %s to renew %d devices -- ret = %d\n",
+			deviceType, typeSearch, ret);
+	}
+	while ((work = searchList)) {
+		searchList = work->next;
+		ret = UpnpSearchAsync(g_cpHandle, DEVICE_RENEW_LEAD / 2, work->name, NULL);
+		printf("sending search request for Device UDN: %s -- ret = %d\n",work->name, ret);
+		if (ret != UPNP_E_SUCCESS)
+			printf("Error sending search request for Device UDN: %s -- err = %d\n",
+			work->name, ret);
+		free(work);
+	}
+	while ((work = retryList)) {
+		retryList = work->next;
+		CtrlPointSubscribe(work->name, SUBSCRIBE_PENDING);
+		free(work);
+	}
+}
+
+void *CtrlPointTimerLoop(void *args)
+{
+	struct timespec deadline;
+	time_t now;
+	time_t wake;
+	time_t nextPurge = time(NULL) + REJECTED_PURGE_PERIOD;
+	time_t nextDump = 0;
+	int due;
+	int dump;
+	char statsFile[LINE_SIZE];
+
+	ithread_mutex_lock(&g_timerMutex);
+	while (g_cpTimerLoopRun) {
+		now = time(NULL);
+		due = g_timerHeapCount > 0 && g_timerHeap[0]->deadline <= now;
+		if (0 == g_statsPeriod)
+			nextDump = 0;
+		else if (0 == nextDump || nextDump > now + g_statsPeriod)
+			nextDump = now + g_statsPeriod;
+		dump = nextDump && now >= nextDump;
+		if (!due && !dump && now < nextPurge) {
+			/* Sleep until the earliest deadline, CtrlPointScheduleNode
+			* and CtrlPointStop wake us up earlier */
+			wake = nextPurge;
+			if (nextDump && nextDump < wake)
+				wake = nextDump;
+			if (g_timerHeapCount > 0 && g_timerHeap[0]->deadline < wake)
+				wake = g_timerHeap[0]->deadline;
+			deadline.tv_sec = wake;
+			deadline.tv_nsec = 0;
+			ithread_cond_timedwait(&g_timerCond, &g_timerMutex, &deadline);
+			continue;
+		}
+		ithread_mutex_unlock(&g_timerMutex);
+		if (due)
+			CtrlPointVerifyTimeouts(now);
+		if (now >= nextPurge) {
+			CtrlPointPurgeRejected(0);
+			nextPurge = now + REJECTED_PURGE_PERIOD;
+		}
+		if (dump) {
+			ithread_mutex_lock(&g_statsFileMutex);
+			strcpy(statsFile, g_statsFile);
+			ithread_mutex_unlock(&g_statsFileMutex);
+			CtrlPointDumpStats(statsFile);
+			nextDump = now + g_statsPeriod;
+		}
+		ithread_mutex_lock(&g_timerMutex);
+	}
+	ithread_mutex_unlock(&g_timerMutex);
+	return NULL;
+}
+
+int CtrlPointStart()
+{
+	int rc;
+	unsigned short port = 0;
+	char *ipAddress = NULL;
+
+	ithread_rwlock_init(&g_deviceListLock, NULL);
+	ithread_mutex_init(&g_downloadMutex, NULL);
+	ithread_mutex_init(&g_filterMutex, NULL);
+	ithread_mutex_init(&g_timerMutex, NULL);
+	ithread_cond_init(&g_timerCond, NULL);
+	ithread_rwlock_init(&g_dispatchLock, NULL);
+	ithread_mutex_init(&g_dispatchGate, NULL);
+	ithread_mutex_init(&g_dispatchRouteMutex, NULL);
+	ithread_rwlock_init(&g_internLock, NULL);
+	printf("CtrlPointStart with paddress=%s port=%u\n",ipAddress ? ipAddress :"{NULL}",port);
+	rc = UpnpInit(ipAddress, port);
+	if (rc != UPNP_E_SUCCESS) {
+		printf("WinCEStart: UpnpInit() Error: %d\n", rc);
+		UpnpFinish();
+		return -1;
+	}
+	if (!ipAddress)  ipAddress = UpnpGetServerIpAddress();
+	if (!port)  port = UpnpGetServerPort();
+
+	printf("UPnP CP Initialized ipaddress=%s port=%u\n",ipAddress ? ipAddress:"{NULL}",port);
+	rc = UpnpRegisterClient(CtrlPointCallbackEventHandler,&g_cpHandle,&g_cpHandle);
+	if (rc != UPNP_E_SUCCESS) {
+		printf("Error registering CP: %d\n", rc);
+		UpnpFinish();
+		return -1;
+	}
+	printf("Config Control Point Registered\n");
+
+	/* start a timer thread */
+	g_cpTimerLoopRun = 1;
+	ithread_create(&g_timerThread, NULL, CtrlPointTimerLoop, NULL);
+
+	/* and the workers the callback hands events to */
+	CtrlPointStartDispatch();
+	
+	return 0;
+}
+
+int CtrlPointStop(void)
+{
+	/* Wake the timer thread and wait for it */
+	ithread_mutex_lock(&g_timerMutex);
+	g_cpTimerLoopRun = 0;
+	ithread_cond_signal(&g_timerCond);
+	ithread_mutex_unlock(&g_timerMutex);
+	ithread_join(g_timerThread, NULL);
+	CtrlPointStopDispatch();
+
+	CtrlPointRemoveAll();
+	ParameterInternClear();
+	UpnpUnRegisterClient(g_cpHandle );
+	UpnpFinish();
+	ithread_rwlock_destroy(&g_deviceListLock);
+	ithread_mutex_destroy(&g_downloadMutex);
+	CtrlPointPurgeRejected(1);
+	ithread_mutex_destroy(&g_filterMutex);
+	if (g_timerHeap) free(g_timerHeap);
+	g_timerHeap = NULL;
+	g_timerHeapSize = 0;
+	ithread_cond_destroy(&g_timerCond);
+	ithread_mutex_destroy(&g_timerMutex);
+	return 0;
+}
+
+void *CtrlPointCommandLoop(void *args)
+{
+	CtrlPointRefresh();
+
+	while (1) {
+		char cmdline[MAX_BUFFER]={0};
+		printf("\n>");
+		fgets(cmdline, sizeof(cmdline)-1, stdin);
+		CtrlPointProcessCommand(cmdline);
+	}
+	ithread_detach(ithread_self());
+	return NULL;
+}
+
+int GetValueSendAction(ActionParam* action)
+{
+	const char *path = action->paramName;
+
+	return GetValuesSendAction(action->devnum, &path, 1) < 0 ? -1 : 0;
+}
+
+struct ActionRequest *CtrlPointNewRequest(int actionType, int devnum, const char *UDN,
+	const char **paths, int count, int copy)
+{
+	struct ActionRequest *request;
+	int i;
+
+	request = (struct ActionRequest *)calloc(1, sizeof(struct ActionRequest));
+	if (NULL == request)
+		return NULL;
+	request->actionType = actionType;
+	request->devnum = devnum;
+	snprintf(request->UDN, sizeof(request->UDN), "%s", UDN);
+	if (0 == count)
+		return request;
+	request->found = (int *)calloc((size_t)count, sizeof(int));
+	if (!copy) {
+		/* The paths belong to a fan-out, which outlives its requests */
+		request->paths = (char **)paths;
+		request->count = count;
+		if (NULL == request->found) {
+			CtrlPointFreeRequest(request);
+			return NULL;
+		}
+		return request;
+	}
+	request->ownsPaths = 1;
+	request->paths = (char **)calloc((size_t)count, sizeof(char *));
+	if (NULL == request->paths || NULL == request->found) {
+		CtrlPointFreeRequest(request);
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		request->paths[i] = strdup(paths[i]);
+		if (NULL == request->paths[i]) {
+			CtrlPointFreeRequest(request);
+			return NULL;
+		}
+		request->count++;
+	}
+	return request;
+}
+
+void CtrlPointFreeRequest(struct ActionRequest *request)
+{
+	int i;
+
+	if (NULL == request)
+		return;
+	for (i = 0; request->ownsPaths && request->paths && i < request->count; i++)
+		free(request->paths[i]);
+	if (request->ownsPaths && request->paths) free(request->paths);
+	if (request->found) free(request->found);
+	free(request);
+}
+
+const char *CtrlPointActionName(int actionType)
+{
+	int numOfCmds = (sizeof g_cmdList)/sizeof (cmdloop_commands);
+	int i;
+
+	for (i = 0; i < numOfCmds; ++i) {
+		if ( actionType == g_cmdList[i].command)
+			return g_cmdList[i].str;
+	}
+	return "";
+}
+
+double CtrlPointNow(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int LatencyBucket(unsigned long us)
+{
+	int shift = 0;
+
+	/* Below LATENCY_SUB_COUNT each microsecond has a bucket, above it each
+	* power of two is split into LATENCY_SUB_COUNT/2 buckets */
+	if (us < LATENCY_SUB_COUNT)
+		return (int)us;
+	while ((us >> shift) >= LATENCY_SUB_COUNT)
+		shift++;
+	if (LATENCY_SUB_COUNT + (shift - 1) * LATENCY_SUB_COUNT / 2 >= LATENCY_BUCKETS)
+		return LATENCY_BUCKETS - 1;
+	return LATENCY_SUB_COUNT + (shift - 1) * LATENCY_SUB_COUNT / 2
+		+ (int)(us >> shift) - LATENCY_SUB_COUNT / 2;
+}
+
+unsigned long LatencyBucketValue(int bucket)
+{
+	int shift;
+	unsigned long top;
+
+	if (bucket < LATENCY_SUB_COUNT)
+		return (unsigned long)bucket;
+	shift = (bucket - LATENCY_SUB_COUNT) / (LATENCY_SUB_COUNT / 2) + 1;
+	top = (unsigned long)((bucket - LATENCY_SUB_COUNT) % (LATENCY_SUB_COUNT / 2) + LATENCY_SUB_COUNT / 2);
+	return ((top + 1) << shift) - 1;
+}
+
+void LatencyRecord(struct LatencyHistogram *histogram, double seconds, int errCode)
+{
+	unsigned long us = seconds > 0 ? (unsigned long)(seconds * 1e6) : 0;
+	unsigned long max = histogram->maxUs;
+
+	__sync_fetch_and_add(&histogram->counts[LatencyBucket(us)], 1);
+	__sync_fetch_and_add(&histogram->sumUs, us);
+	if (errCode != UPNP_E_SUCCESS)
+		__sync_fetch_and_add(&histogram->errors, 1);
+	while (us > max && !__sync_bool_compare_and_swap(&histogram->maxUs, max, us))
+		max = histogram->maxUs;
+}
+
+void LatencyReset(struct LatencyHistogram *histogram)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		__sync_lock_test_and_set(&histogram->counts[i], 0);
+	__sync_lock_test_and_set(&histogram->errors, 0);
+	__sync_lock_test_and_set(&histogram->sumUs, 0);
+	__sync_lock_test_and_set(&histogram->maxUs, 0);
+}
+
+unsigned long LatencyPercentile(const unsigned long *counts, unsigned long total, double percentile)
+{
+	/* The highest latency of the bucket the rank falls into */
+	unsigned long rank = (unsigned long)(total * percentile / 100.0 + 0.5);
+	unsigned long seen = 0;
+	int i;
+
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			return LatencyBucketValue(i);
+	}
+	return LatencyBucketValue(LATENCY_BUCKETS - 1);
+}
+
+void LatencyPrint(const char *name, const struct LatencyHistogram *histogram)
+{
+	unsigned long counts[LATENCY_BUCKETS];
+	unsigned long total = 0;
+	unsigned long max = histogram->maxUs;
+	unsigned long p50, p90, p99;
+	int i;
+
+	/* The buckets are read while others update them, so the total is
+	* taken from the same copy the percentiles are */
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		counts[i] = histogram->counts[i];
+		total += counts[i];
+	}
+	if (0 == total) {
+		printf("%-40s %8d\n", name, 0);
+		return;
+	}
+	/* A bucket may reach past the largest latency seen */
+	p50 = LatencyPercentile(counts, total, 50);
+	p90 = LatencyPercentile(counts, total, 90);
+	p99 = LatencyPercentile(counts, total, 99);
+	printf("%-40s %8lu %6lu %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, total, histogram->errors,
+		histogram->sumUs / 1e3 / total,
+		(p50 < max ? p50 : max) / 1e3, (p90 < max ? p90 : max) / 1e3,
+		(p99 < max ? p99 : max) / 1e3, max / 1e3);
+}
+
+void CtrlPointRecordLatency(struct ActionRequest *request, int errCode)
+{
+	double latency = CtrlPointNow() - request->sendTime;
+	struct DeviceNode *node;
+	struct LatencyHistogram *histogram;
+
+	MetricAdd(METRIC_ACTIONS_COMPLETED, 1);
+	if (request->actionType >= 0 && request->actionType < ExitCmd)
+		LatencyRecord(&g_actionLatency[request->actionType], latency, errCode);
+
+	/* The device may be gone by now; its histogram is made on first use */
+	DEVICE_LIST_RDLOCK();
+	node = IndexLookup(&g_udnIndex, request->UDN, NULL);
+	if (node && NULL == node->latency) {
+		histogram = (struct LatencyHistogram *)calloc(1, sizeof(struct LatencyHistogram));
+		if (histogram && !__sync_bool_compare_and_swap(&node->latency, NULL, histogram))
+			free(histogram);
+	}
+	if (node && node->latency)
+		LatencyRecord(node->latency, latency, errCode);
+	DEVICE_LIST_UNLOCK();
+}
+
+int CtrlPointPrintLatency(const char *arg)
+{
+	struct DeviceNode *node;
+	char name[NAME_SIZE + 16];
+	int devnum = 0;
+	int i;
+
+	if (0 == strcasecmp(arg, "reset")) {
+		for (i = 0; i < ExitCmd; i++)
+			LatencyReset(&g_actionLatency[i]);
+		LatencyReset(&g_dispatchWait);
+		DEVICE_LIST_RDLOCK();
+		for (node = g_deviceList; node; node = node->next) {
+			if (node->latency)
+				LatencyReset(node->latency);
+		}
+		DEVICE_LIST_UNLOCK();
+		return 0;
+	}
+
+	printf("%-40s %8s %6s %9s %9s %9s %9s %9s\n", "", "count", "errors",
+		"mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	if ('\0' == arg[0]) {
+		for (i = 0; i < ExitCmd; i++) {
+			if (GetVar == i || SetAlarmsEnabled == i || GetValues == i || SetValues == i)
+				LatencyPrint(CtrlPointActionName(i), &g_actionLatency[i]);
+		}
+		LatencyPrint("dispatch queue wait", &g_dispatchWait);
+		return 0;
+	}
+
+	DEVICE_LIST_RDLOCK();
+	if (0 == strcasecmp(arg, "devices")) {
+		for (node = g_deviceList; node; node = node->next) {
+			devnum++;
+			if (NULL == node->latency)
+				continue;
+			snprintf(name, sizeof(name), "%d %s", devnum, node->device.UDN);
+			LatencyPrint(name, node->latency);
+		}
+	} else if (0 == CtrlPointGetDevice(atoi(arg), &node)) {
+		if (node->latency) {
+			LatencyPrint(node->device.UDN, node->latency);
+		} else {
+			printf("%-40s %8d\n", node->device.UDN, 0);
+		}
+	}
+	DEVICE_LIST_UNLOCK();
+	return 0;
+}
+
+struct MetricSlot *MetricThreadSlot(void)
+{
+	struct MetricSlot *slot = t_metricSlot;
+
+	if (slot)
+		return slot;
+	slot = (struct MetricSlot *)calloc(1, sizeof(struct MetricSlot));
+	if (NULL == slot)
+		return NULL;
+	ithread_mutex_lock(&g_metricsMutex);
+	slot->next = g_metricShared.next;
+	g_metricShared.next = slot;
+	ithread_mutex_unlock(&g_metricsMutex);
+	t_metricSlot = slot;
+	return slot;
+}
+
+void MetricAdd(int id, unsigned long n)
+{
+	struct MetricSlot *slot = MetricThreadSlot();
+
+	if (NULL == slot) {
+		__sync_fetch_and_add(&g_metricShared.counts[id], n);
+		return;
+	}
+	/* Only this thread writes the slot, readers see either value */
+	__atomic_store_n(&slot->counts[id],
+		__atomic_load_n(&slot->counts[id], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+unsigned long MetricRead(int id)
+{
+	struct MetricSlot *slot;
+	unsigned long total = 0;
+
+	ithread_mutex_lock(&g_metricsMutex);
+	for (slot = &g_metricShared; slot; slot = slot->next)
+		total += __atomic_load_n(&slot->counts[id], __ATOMIC_RELAXED);
+	ithread_mutex_unlock(&g_metricsMutex);
+	return total;
+}
+
+void MetricsWriteSummary(FILE *fp, const char *name, const char *label,
+	const struct LatencyHistogram *histogram)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	unsigned long counts[LATENCY_BUCKETS];
+	unsigned long total = 0;
+	unsigned long max = histogram->maxUs;
+	unsigned long value;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		counts[i] = histogram->counts[i];
+		total += counts[i];
+	}
+	for (i = 0; total > 0 && i < (int)(sizeof(quantiles)/sizeof(quantiles[0])); i++) {
+		value = LatencyPercentile(counts, total, quantiles[i] * 100);
+		fprintf(fp, "%s{%s%squantile=\"%g\"} %g\n", name, label, *label ? "," : "",
+			quantiles[i], (value < max ? value : max) / 1e6);
+	}
+	fprintf(fp, "%s_sum%s%s%s %g\n", name, *label ? "{" : "", label, *label ? "}" : "",
+		histogram->sumUs / 1e6);
+	fprintf(fp, "%s_count%s%s%s %lu\n", name, *label ? "{" : "", label, *label ? "}" : "", total);
+}
+
+int MetricsWrite(FILE *fp)
+{
+	unsigned long sent = MetricRead(METRIC_ACTIONS_SENT);
+	unsigned long completed = MetricRead(METRIC_ACTIONS_COMPLETED);
+	char label[NAME_SIZE];
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", g_metricList[i].name,
+			g_metricList[i].help, g_metricList[i].name, g_metricList[i].name, MetricRead(i));
+	}
+	fprintf(fp, "# HELP cms_cp_actions_in_flight actions and GetVar requests not completed yet\n"
+		"# TYPE cms_cp_actions_in_flight gauge\ncms_cp_actions_in_flight %lu\n",
+		sent > completed ? sent - completed : 0);
+	ithread_rwlock_rdlock(&g_dispatchLock);
+	fprintf(fp, "# HELP cms_cp_dispatch_workers threads processing the callback events\n"
+		"# TYPE cms_cp_dispatch_workers gauge\ncms_cp_dispatch_workers %d\n", g_dispatchShardCount);
+	fprintf(fp, "# HELP cms_cp_dispatch_queue_depth callback events waiting for a dispatch worker\n"
+		"# TYPE cms_cp_dispatch_queue_depth gauge\n");
+	for (i = 0; i < g_dispatchShardCount; i++)
+		fprintf(fp, "cms_cp_dispatch_queue_depth{worker=\"%d\"} %d\n", i, g_dispatchShards[i].count);
+	fprintf(fp, "# HELP cms_cp_dispatch_queue_high_water most callback events waiting at once\n"
+		"# TYPE cms_cp_dispatch_queue_high_water gauge\n");
+	for (i = 0; i < g_dispatchShardCount; i++)
+		fprintf(fp, "cms_cp_dispatch_queue_high_water{worker=\"%d\"} %d\n", i, g_dispatchShards[i].highWater);
+	fprintf(fp, "# HELP cms_cp_dispatch_processed callback events processed by a dispatch worker since it started\n"
+		"# TYPE cms_cp_dispatch_processed gauge\n");
+	for (i = 0; i < g_dispatchShardCount; i++)
+		fprintf(fp, "cms_cp_dispatch_processed{worker=\"%d\"} %lu\n", i, g_dispatchShards[i].processed);
+	ithread_rwlock_unlock(&g_dispatchLock);
+	fprintf(fp, "# HELP cms_cp_dispatch_wait_seconds time a callback event waits in the dispatch queue\n"
+		"# TYPE cms_cp_dispatch_wait_seconds summary\n");
+	MetricsWriteSummary(fp, "cms_cp_dispatch_wait_seconds", "", &g_dispatchWait);
+	DEVICE_LIST_RDLOCK();
+	fprintf(fp, "# HELP cms_cp_devices devices in the device list\n"
+		"# TYPE cms_cp_devices gauge\ncms_cp_devices %d\n", g_deviceCount);
+	DEVICE_LIST_UNLOCK();
+	fprintf(fp, "# HELP cms_cp_event_parse_seconds time to parse the changes of an event\n"
+		"# TYPE cms_cp_event_parse_seconds summary\n");
+	MetricsWriteSummary(fp, "cms_cp_event_parse_seconds", "", &g_eventParseTime);
+	fprintf(fp, "# HELP cms_cp_action_latency_seconds send to complete latency of an action\n"
+		"# TYPE cms_cp_action_latency_seconds summary\n");
+	for (i = 0; i < ExitCmd; i++) {
+		if (GetVar == i || SetAlarmsEnabled == i || GetValues == i || SetValues == i) {
+			snprintf(label, sizeof(label), "action=\"%s\"", CtrlPointActionName(i));
+			MetricsWriteSummary(fp, "cms_cp_action_latency_seconds", label, &g_actionLatency[i]);
+		}
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+#ifdef CMS_LOCK_PROFILE
+void LockProfileAcquired(void *lock, struct LockSite *site, double start, int contended)
+{
+	double now = CtrlPointNow();
+	unsigned long waitUs = (unsigned long)((now - start) * 1e6);
+	unsigned long max = site->maxWaitUs;
+
+	if (!site->registered && __sync_bool_compare_and_swap(&site->registered, 0, 1)) {
+		do {
+			site->next = g_lockSites;
+		} while (!__sync_bool_compare_and_swap(&g_lockSites, site->next, site));
+	}
+	__sync_fetch_and_add(&site->acquired, 1);
+	if (contended) {
+		__sync_fetch_and_add(&site->contended, 1);
+		__sync_fetch_and_add(&site->waitUs, waitUs);
+		while (waitUs > max && !__sync_bool_compare_and_swap(&site->maxWaitUs, max, waitUs))
+			max = site->maxWaitUs;
+	}
+	if (t_lockDepth < LOCK_PROFILE_DEPTH) {
+		t_lockHeld[t_lockDepth].lock = lock;
+		t_lockHeld[t_lockDepth].site = site;
+		t_lockHeld[t_lockDepth].start = now;
+		t_lockDepth++;
+	}
+}
+
+void LockProfileRdLock(ithread_rwlock_t *lock, struct LockSite *site)
+{
+	double start;
+
+	if (!g_lockProfile) {
+		ithread_rwlock_rdlock(lock);
+		return;
+	}
+	start = CtrlPointNow();
+	if (0 == ithread_rwlock_tryrdlock(lock)) {
+		LockProfileAcquired(lock, site, start, 0);
+		return;
+	}
+	ithread_rwlock_rdlock(lock);
+	LockProfileAcquired(lock, site, start, 1);
+}
+
+void LockProfileWrLock(ithread_rwlock_t *lock, struct LockSite *site)
+{
+	double start;
+
+	if (!g_lockProfile) {
+		ithread_rwlock_wrlock(lock);
+		return;
+	}
+	start = CtrlPointNow();
+	if (0 == ithread_rwlock_trywrlock(lock)) {
+		LockProfileAcquired(lock, site, start, 0);
+		return;
+	}
+	ithread_rwlock_wrlock(lock);
+	LockProfileAcquired(lock, site, start, 1);
+}
+
+void LockProfileUnlock(ithread_rwlock_t *lock)
+{
+	struct LockSite *site;
+	unsigned long holdUs;
+	unsigned long max;
+	int i;
+	int j;
+
+	/* Taken before profiling was turned on if it is not on the stack */
+	for (i = t_lockDepth - 1; i >= 0 && t_lockHeld[i].lock != (void *)lock; i--)
+		;
+	if (i < 0) {
+		ithread_rwlock_unlock(lock);
+		return;
+	}
+	site = t_lockHeld[i].site;
+	holdUs = (unsigned long)((CtrlPointNow() - t_lockHeld[i].start) * 1e6);
+	for (; i < t_lockDepth - 1; i++)
+		t_lockHeld[i] = t_lockHeld[i + 1];
+	t_lockDepth--;
+	ithread_rwlock_unlock(lock);
+
+	__sync_fetch_and_add(&site->holdUs, holdUs);
+	max = site->maxHoldUs;
+	while (holdUs > max && !__sync_bool_compare_and_swap(&site->maxHoldUs, max, holdUs))
+		max = site->maxHoldUs;
+
+	/* Most holds are shorter than the shortest of the top ones */
+	if (holdUs <= g_lockTop[LOCK_PROFILE_TOP - 1].holdUs)
+		return;
+	ithread_mutex_lock(&g_lockTopMutex);
+	for (i = 0; i < LOCK_PROFILE_TOP && g_lockTop[i].holdUs >= holdUs; i++)
+		;
+	if (i < LOCK_PROFILE_TOP) {
+		for (j = LOCK_PROFILE_TOP - 1; j > i; j--)
+			g_lockTop[j] = g_lockTop[j - 1];
+		g_lockTop[i].site = site;
+		g_lockTop[i].holdUs = holdUs;
+		g_lockTop[i].when = time(NULL);
+	}
+	ithread_mutex_unlock(&g_lockTopMutex);
+}
+
+int CompareLockSite(const void *a, const void *b)
+{
+	const struct LockSite *siteA = *(const struct LockSite * const *)a;
+	const struct LockSite *siteB = *(const struct LockSite * const *)b;
+
+	/* Most time spent waiting first, then most time held */
+	if (siteA->waitUs != siteB->waitUs)
+		return siteA->waitUs < siteB->waitUs ? 1 : -1;
+	if (siteA->holdUs != siteB->holdUs)
+		return siteA->holdUs < siteB->holdUs ? 1 : -1;
+	return 0;
+}
+#endif
+
+int CtrlPointPrintLocks(const char *arg)
+{
+#ifdef CMS_LOCK_PROFILE
+	struct LockSite *site;
+	struct LockSite **sites;
+	struct LockHold top[LOCK_PROFILE_TOP];
+	char where[NAME_SIZE];
+	int count = 0;
+	int i;
+
+	if (0 == strcasecmp(arg, "reset")) {
+		/* Swapped out atomically, as the lock sites keep updating them */
+		for (site = g_lockSites; site; site = site->next) {
+			__sync_lock_test_and_set(&site->acquired, 0);
+			__sync_lock_test_and_set(&site->contended, 0);
+			__sync_lock_test_and_set(&site->waitUs, 0);
+			__sync_lock_test_and_set(&site->maxWaitUs, 0);
+			__sync_lock_test_and_set(&site->holdUs, 0);
+			__sync_lock_test_and_set(&site->maxHoldUs, 0);
+		}
+		ithread_mutex_lock(&g_lockTopMutex);
+		memset(g_lockTop, 0, sizeof(g_lockTop));
+		ithread_mutex_unlock(&g_lockTopMutex);
+		return 0;
+	}
+	if (!g_lockProfile)
+		printf("Lock profiling is off, see \"Option lockProfile 1\"\n");
+
+	for (site = g_lockSites; site; site = site->next)
+		count++;
+	sites = (struct LockSite **)malloc((size_t)(count ? count : 1) * sizeof(struct LockSite *));
+	if (NULL == sites)
+		return -1;
+	/* Sites are only ever pushed, so the first count of them are still there */
+	site = g_lockSites;
+	for (i = 0; i < count; i++, site = site->next)
+		sites[i] = site;
+	qsort(sites, (size_t)count, sizeof(struct LockSite *), CompareLockSite);
+
+	printf("%-44s %2s %9s %9s %10s %9s %10s %9s\n", "g_deviceListLock", "", "taken",
+		"waited", "wait ms", "max ms", "held ms", "max ms");
+	for (i = 0; i < count; i++) {
+		site = sites[i];
+		snprintf(where, sizeof(where), "%s:%d %s", site->file, site->line, site->func);
+		printf("%-44s %2s %9lu %9lu %10.1f %9.1f %10.1f %9.1f\n", where, site->kind,
+			site->acquired, site->contended, site->waitUs / 1e3, site->maxWaitUs / 1e3,
+			site->holdUs / 1e3, site->maxHoldUs / 1e3);
+	}
+	free(sites);
+
+	ithread_mutex_lock(&g_lockTopMutex);
+	memcpy(top, g_lockTop, sizeof(top));
+	ithread_mutex_unlock(&g_lockTopMutex);
+	printf("\nLongest holds:\n");
+	for (i = 0; i < LOCK_PROFILE_TOP && top[i].site; i++) {
+		printf("  %9.1f ms  %s:%d %s  %s", top[i].holdUs / 1e3, top[i].site->file,
+			top[i].site->line, top[i].site->func, ctime(&top[i].when));
+	}
+	return 0;
+#else
+	(void)arg;
+	printf("Built without lock profiling, add -DCMS_LOCK_PROFILE to the gcc line\n");
+	return -1;
+#endif
+}
+
+int CtrlPointDumpStats(const char *file)
+{
+	char tmpFile[LINE_SIZE + 8];
+	FILE *fp;
+	int rc;
+
+	/* Written aside and renamed, a scraper never reads half a file */
+	snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", file);
+	fp = fopen(tmpFile, "w");
+	if (NULL == fp) {
+		printf("Error opening %s\n", tmpFile);
+		return -1;
+	}
+	rc = MetricsWrite(fp);
+	if (fclose(fp) != 0)
+		rc = -1;
+	if (0 == rc && rename(tmpFile, file) != 0)
+		rc = -1;
+	if (rc < 0) {
+		printf("Error writing %s\n", file);
+		unlink(tmpFile);
+	}
+	return rc;
+}
+
+int CtrlPointSendAction(int actionType, int devnum, const char *UDN, const char *controlURL,
+	const char *list, const char **paths, int count, struct FanOut *fanOut, int slot)
+{
+	int rc;
+	IXML_Document *actionNode = NULL;
+	struct ActionRequest *request;
+	const char *actionName = CtrlPointActionName(actionType);
+	const char *argName = GetValues == actionType ? "Parameters" : "ParameterValueList";
+
+	request = CtrlPointNewRequest(actionType, devnum, UDN, paths, count, NULL == fanOut);
+	if (NULL == request)
+		return -1;
+	actionNode=UpnpMakeAction(actionName, g_serviceType[SERVICE_CONTROL],0, NULL);
+	if(actionNode==NULL){
+		printf("UpnpMakeAction failed\n");
+		CtrlPointFreeRequest(request);
+		return -1;
+	}
+	UpnpAddToAction(&actionNode,actionName,g_serviceType[SERVICE_CONTROL],argName,list);
+
+	if (fanOut) {
+		/* Wait for a free slot in the window of the fan-out */
+		request->fanOut = fanOut;
+		request->slot = slot;
+		CtrlPointFanOutAcquire(fanOut, slot);
+	}
+	request->sendTime = CtrlPointNow();
+	/* The request comes back as the cookie of UPNP_CONTROL_ACTION_COMPLETE */
+	rc = UpnpSendActionAsync(g_cpHandle,controlURL,
+		g_serviceType[SERVICE_CONTROL], NULL,actionNode,CtrlPointCallbackEventHandler, request);
+	ixmlDocument_free(actionNode);
+	if(rc!=UPNP_E_SUCCESS) {
+		printf("Error in UpnpSendActionAsync -- %d\n",rc);
+		if (fanOut)
+			CtrlPointFanOutRelease(fanOut, slot, rc, 1);
+		CtrlPointFreeRequest(request);
+		return -1;
+	}
+	MetricAdd(METRIC_ACTIONS_SENT, 1);
+	return 0;
+}
+
+/* Append the ContentPath of path, or the Parameter of path and value, to list */
+int CtrlPointAppendEntry(struct StrBuf *list, const char *path, const char *value)
+{
+	char *escapedPath = Escaped(path);
+	char *escapedValue = value ? Escaped(value) : NULL;
+	int rc = -1;
+
+	if (escapedPath && (NULL == value || escapedValue)) {
+		if (NULL == value) {
+			rc = StrBufAppend(list, "<ContentPath>", strlen("<ContentPath>"));
+			if (0 == rc) rc = StrBufAppend(list, escapedPath, strlen(escapedPath));
+			if (0 == rc) rc = StrBufAppend(list, "</ContentPath>", strlen("</ContentPath>"));
+		} else {
+			rc = StrBufAppend(list, "<Parameter><ParameterPath>", strlen("<Parameter><ParameterPath>"));
+			if (0 == rc) rc = StrBufAppend(list, escapedPath, strlen(escapedPath));
+			if (0 == rc) rc = StrBufAppend(list, "</ParameterPath><Value>", strlen("</ParameterPath><Value>"));
+			if (0 == rc) rc = StrBufAppend(list, escapedValue, strlen(escapedValue));
+			if (0 == rc) rc = StrBufAppend(list, "</Value></Parameter>", strlen("</Value></Parameter>"));
+		}
+	}
+	if (escapedPath) free(escapedPath);
+	if (escapedValue) free(escapedValue);
+	return rc;
+}
+
+/* Close the list of the last batch and open a new one for paths from first on */
+int CtrlPointAddBatch(struct ActionBatch **batches, int *nbatches, int actionType, int first)
+{
+	struct ActionBatch *grown;
+	const char *header = GetValues == actionType ? g_getValuesHeader : g_setValuesHeader;
+	const char *footer = GetValues == actionType ? g_getValuesFooter : g_setValuesFooter;
+
+	if (*nbatches > 0) {
+		if (StrBufAppend(&(*batches)[*nbatches - 1].list, footer, strlen(footer)) < 0)
+			return -1;
+	}
+	if (first < 0)
+		return 0;
+	grown = (struct ActionBatch *)realloc(*batches, (size_t)(*nbatches + 1) * sizeof(struct ActionBatch));
+	if (NULL == grown)
+		return -1;
+	*batches = grown;
+	StrBufInit(&grown[*nbatches].list);
+	grown[*nbatches].first = first;
+	grown[*nbatches].count = 0;
+	(*nbatches)++;
+	return StrBufAppend(&grown[*nbatches - 1].list, header, strlen(header));
+}
+
+int CtrlPointBuildBatches(int actionType, const char **paths, const char **values, int count,
+	struct ActionBatch **batches, int *nbatches)
+{
+	struct ActionBatch *batch;
+	struct StrBuf entry;
+	const char *footer = GetValues == actionType ? g_getValuesFooter : g_setValuesFooter;
+	int rc;
+	int i;
+
+	*batches = NULL;
+	*nbatches = 0;
+	StrBufInit(&entry);
+	rc = CtrlPointAddBatch(batches, nbatches, actionType, 0);
+	for (i = 0; 0 == rc && i < count; i++) {
+		StrBufReset(&entry);
+		rc = CtrlPointAppendEntry(&entry, paths[i], values ? values[i] : NULL);
+		if (rc < 0)
+			break;
+		/* Close the action when this entry would not fit, an entry
+		* longer than the limit goes alone */
+		batch = &(*batches)[*nbatches - 1];
+		if (batch->count > 0 && batch->list.len + entry.len + strlen(footer) > (size_t)g_maxActionSize) {
+			rc = CtrlPointAddBatch(batches, nbatches, actionType, i);
+			if (rc < 0)
+				break;
+			batch = &(*batches)[*nbatches - 1];
+		}
+		rc = StrBufAppend(&batch->list, entry.data, entry.len);
+		batch->count++;
+	}
+	if (0 == rc)
+		rc = CtrlPointAddBatch(batches, nbatches, actionType, -1);
+	StrBufFree(&entry);
+	if (rc < 0) {
+		CtrlPointFreeBatches(*batches, *nbatches);
+		*batches = NULL;
+		*nbatches = 0;
+	}
+	return rc;
+}
+
+void CtrlPointFreeBatches(struct ActionBatch *batches, int nbatches)
+{
+	int i;
+
+	for (i = 0; i < nbatches; i++)
+		StrBufFree(&batches[i].list);
+	if (batches) free(batches);
+}
+
+int CtrlPointSendBatch(int actionType, int devnum, const char **paths, const char **values, int count)
+{
+	struct DeviceNode *devNode;
+	struct ActionBatch *batches;
+	char controlURL[NAME_SIZE];
+	char UDN[NAME_SIZE];
+	int nbatches;
+	int sent = 0;
+	int i;
+
+	if (count <= 0)
+		return -1;
+	DEVICE_LIST_RDLOCK();
+	if (CtrlPointGetDevice(devnum, &devNode) < 0) {
+		printf("Can't find device %d\n",devnum);
+		DEVICE_LIST_UNLOCK();
+		return -1;
+	}
+	strcpy(controlURL, devNode->device.service[SERVICE_CONTROL].controlURL);
+	strcpy(UDN, devNode->device.UDN);
+	DEVICE_LIST_UNLOCK();
+
+	if (CtrlPointBuildBatches(actionType, paths, values, count, &batches, &nbatches) < 0)
+		return -1;
+	for (i = 0; i < nbatches; i++) {
+		if (0 == CtrlPointSendAction(actionType, devnum, UDN, controlURL, batches[i].list.data,
+			paths + batches[i].first, batches[i].count, NULL, 0))
+			sent++;
+	}
+	CtrlPointFreeBatches(batches, nbatches);
+
+	if (count > 1)
+		printf("%s: %d paths in %d of %d requests to device %d\n",
+			CtrlPointActionName(actionType), count, sent, nbatches, devnum);
+	return sent > 0 ? sent : -1;
+}
+
+int GetValuesSendAction(int devnum, const char **paths, int count)
+{
+	const char **missing;
+	int nmissing;
+	int rc;
+
+	if (0 == g_cacheMaxAge || count <= 0)
+		return CtrlPointSendBatch(GetValues, devnum, paths, NULL, count);
+	missing = (const char **)malloc((size_t)count * sizeof(const char *));
+	if (NULL == missing)
+		return -1;
+	nmissing = CtrlPointServeFromCache(devnum, paths, count, g_cacheMaxAge, missing);
+	if (nmissing < 0)
+		rc = CtrlPointSendBatch(GetValues, devnum, paths, NULL, count);
+	else if (nmissing > 0)
+		rc = CtrlPointSendBatch(GetValues, devnum, missing, NULL, nmissing);
+	else
+		rc = 0;
+	if (count > 1 && nmissing >= 0)
+		printf("GetValues: %d of %d paths of device %d answered from the cache\n",
+			count - nmissing, count, devnum);
+	free(missing);
+	return rc;
+}
+
+int SetValuesSendAction(int devnum, const char **paths, const char **values, int count)
+{
+	return CtrlPointSendBatch(SetValues, devnum, paths, values, count);
+}
+
+int CtrlPointInDevSet(const char *devset, int devnum)
+{
+	const char *p = devset;
+	char *end;
+	long low, high;
+
+	if (0 == strcmp(devset, "*"))
+		return 1;
+	/* Comma separated numbers and ranges: 1-10,15,20- */
+	while (*p) {
+		low = strtol(p, &end, 10);
+		if (end == p)
+			return 0;
+		high = low;
+		p = end;
+		if ('-' == *p) {
+			p++;
+			high = strtol(p, &end, 10);
+			if (end == p)
+				high = 0x7FFFFFFF;
+			p = end;
+		}
+		if (devnum >= low && devnum <= high)
+			return 1;
+		if (',' == *p)
+			p++;
+		else if (*p)
+			return 0;
+	}
+	return 0;
+}
+
+int CtrlPointIsDevSet(const char *devset)
+{
+	const char *p = devset;
+
+	if (0 == strcmp(devset, "*"))
+		return 1;
+	if (!*p)
+		return 0;
+	for (; *p; p++) {
+		if ((*p < '0' || *p > '9') && ',' != *p && '-' != *p)
+			return 0;
+	}
+	/* A plain number is a single device */
+	return NULL != strpbrk(devset, ",-");
+}
+
+void CtrlPointFanOutAcquire(struct FanOut *fanOut, int slot)
+{
+	ithread_mutex_lock(&fanOut->mutex);
+	while (fanOut->inFlight >= fanOut->maxInFlight)
+		ithread_cond_wait(&fanOut->cond, &fanOut->mutex);
+	fanOut->inFlight++;
+	fanOut->results[slot].pending++;
+	ithread_mutex_unlock(&fanOut->mutex);
+}
+
+void CtrlPointFanOutRelease(struct FanOut *fanOut, int slot, int errCode, int inFlight)
+{
+	struct FanOutResult *result = &fanOut->results[slot];
+	int finished = 0;
+
+	ithread_mutex_lock(&fanOut->mutex);
+	if (inFlight) {
+		fanOut->inFlight--;
+		ithread_cond_signal(&fanOut->cond);
+	}
+	if (UPNP_E_SUCCESS != errCode && UPNP_E_SUCCESS == result->errCode)
+		result->errCode = errCode;
+	if (0 == --result->pending) {
+		result->latency = CtrlPointNow() - result->start;
+		fanOut->done++;
+		finished = fanOut->done == fanOut->count && !fanOut->dispatching;
+	}
+	ithread_mutex_unlock(&fanOut->mutex);
+	if (finished)
+		CtrlPointFanOutFinish(fanOut);
+}
+
+int CompareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void CtrlPointFanOutFinish(struct FanOut *fanOut)
+{
+	double *latency;
+	double sum = 0;
+	int ok = 0;
+	int i;
+
+	latency = (double *)malloc((size_t)fanOut->count * sizeof(double));
+	for (i = 0; i < fanOut->count; i++) {
+		struct FanOutResult *result = &fanOut->results[i];
+		if (UPNP_E_SUCCESS == result->errCode) {
+			if (latency) latency[ok] = result->latency * 1000;
+			sum += result->latency * 1000;
+			ok++;
+		} else {
+			printf("%s failed on device %d: %s(%d)\n", CtrlPointActionName(fanOut->actionType),
+				result->devnum, UpnpGetErrorMessage(result->errCode), result->errCode);
+		}
+	}
+	printf("%s on %d devices: %d ok, %d failed, %d parameters in %.3f s\n",
+		CtrlPointActionName(fanOut->actionType), fanOut->count, ok, fanOut->count - ok,
+		fanOut->parameters, CtrlPointNow() - fanOut->start);
+	if (latency && ok > 0) {
+		qsort(latency, (size_t)ok, sizeof(double), CompareDouble);
+		printf("  latency ms: min %.1f avg %.1f p50 %.1f p95 %.1f p99 %.1f max %.1f\n",
+			latency[0], sum / ok, latency[ok / 2], latency[ok * 95 / 100],
+			latency[ok * 99 / 100], latency[ok - 1]);
+	}
+	if (latency) free(latency);
+
+	FreePaths(fanOut->paths, fanOut->pathCount);
+	ithread_cond_destroy(&fanOut->cond);
+	ithread_mutex_destroy(&fanOut->mutex);
+	free(fanOut->results);
+	free(fanOut);
+}
+
+int CtrlPointFanOut(int actionType, const char *devset, const char **paths, const char **values, int count)
+{
+	struct DeviceNode *tmpDevNode;
+	struct FanOutTarget *targets = NULL;
+	struct FanOutTarget *grown;
+	struct ActionBatch *batches = NULL;
+	struct FanOut *fanOut = NULL;
+	int ntargets = 0;
+	int nbatches = 0;
+	int finished;
+	int devnum;
+	int rc = -1;
+	int i, j;
+
+	if (count <= 0)
+		return -1;
+	/* One walk of the list for all of the devices */
+	DEVICE_LIST_RDLOCK();
+	for (tmpDevNode = g_deviceList, devnum = 1; tmpDevNode; tmpDevNode = tmpDevNode->next, devnum++) {
+		if (!CtrlPointInDevSet(devset, devnum))
+			continue;
+		if (0 == (ntargets & (ntargets - 1))) {
+			grown = (struct FanOutTarget *)realloc(targets,
+				(size_t)(ntargets ? ntargets * 2 : 1) * sizeof(struct FanOutTarget));
+			if (NULL == grown)
+				break;
+			targets = grown;
+		}
+		targets[ntargets].devnum = devnum;
+		strcpy(targets[ntargets].UDN, tmpDevNode->device.UDN);
+		strcpy(targets[ntargets].controlURL, tmpDevNode->device.service[SERVICE_CONTROL].controlURL);
+		ntargets++;
+	}
+	DEVICE_LIST_UNLOCK();
+	if (0 == ntargets) {
+		printf("No device in %s\n", devset);
+		goto epilogue;
+	}
+	if (CtrlPointBuildBatches(actionType, paths, values, count, &batches, &nbatches) < 0)
+		goto epilogue;
+
+	fanOut = (struct FanOut *)calloc(1, sizeof(struct FanOut));
+	if (NULL == fanOut)
+		goto epilogue;
+	fanOut->results = (struct FanOutResult *)calloc((size_t)ntargets, sizeof(struct FanOutResult));
+	for (i = 0; fanOut->results && i < count; i++) {
+		if (AppendPath(&fanOut->paths, &fanOut->pathCount, paths[i]) < 0)
+			break;
+	}
+	if (NULL == fanOut->results || fanOut->pathCount != count) {
+		FreePaths(fanOut->paths, fanOut->pathCount);
+		if (fanOut->results) free(fanOut->results);
+		free(fanOut);
+		goto epilogue;
+	}
+	fanOut->actionType = actionType;
+	fanOut->count = ntargets;
+	fanOut->maxInFlight = g_maxInFlight;
+	fanOut->dispatching = 1;
+	fanOut->start = CtrlPointNow();
+	ithread_mutex_init(&fanOut->mutex, NULL);
+	ithread_cond_init(&fanOut->cond, NULL);
+
+	printf("%s: %d paths in %d requests to each of %d devices, %d in flight\n",
+		CtrlPointActionName(actionType), count, nbatches, ntargets, fanOut->maxInFlight);
+	for (i = 0; i < ntargets; i++) {
+		struct FanOutResult *result = &fanOut->results[i];
+		int sent = 0;
+
+		result->devnum = targets[i].devnum;
+		result->errCode = UPNP_E_SUCCESS;
+		result->start = CtrlPointNow();
+		/* Held until all of the actions of the device are sent */
+		result->pending = 1;
+		for (j = 0; j < nbatches; j++) {
+			if (0 == CtrlPointSendAction(actionType, targets[i].devnum, targets[i].UDN,
+				targets[i].controlURL, batches[j].list.data,
+				(const char **)fanOut->paths + batches[j].first, batches[j].count, fanOut, i))
+				sent++;
+		}
+		CtrlPointFanOutRelease(fanOut, i, sent == nbatches ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR, 0);
+	}
+
+	ithread_mutex_lock(&fanOut->mutex);
+	fanOut->dispatching = 0;
+	finished = fanOut->done == fanOut->count;
+	ithread_mutex_unlock(&fanOut->mutex);
+	if (finished)
+		CtrlPointFanOutFinish(fanOut);
+	rc = 0;
+
+epilogue:
+	CtrlPointFreeBatches(batches, nbatches);
+	if (targets) free(targets);
+	return rc;
+}
+
+void CtrlPointDemuxParameter(const char *path, const char *value, void *cookie)
+{
+	struct ActionRequest *request = (struct ActionRequest *)cookie;
+	size_t len;
+	int i;
+
+	if (request->cache)
+		ParameterCacheCallback(path, value, request->cache);
+	for (i = 0; i < request->count; i++) {
+		/* A path ending with '/' asks for the whole subtree */
+		len = strlen(request->paths[i]);
+		if (0 == strcmp(path, request->paths[i])
+			|| (len > 0 && '/' == request->paths[i][len-1] && 0 == strncmp(path, request->paths[i], len))) {
+			request->found[i]++;
+			if (request->fanOut)
+				printf("\n[%d] %s=%s\n",request->devnum,path,value);
+			else
+				printf("\n%s=%s\n",path,value);
+			return;
+		}
+	}
+	printf("\n%s=%s (not requested)\n",path,value);
+}
+
+int CtrlPointParseValues(struct ActionRequest *request, const char *xml)
+{
+	struct DeviceNode *node;
+	int count;
+
+	DEVICE_LIST_RDLOCK();
+	node = IndexLookup(&g_udnIndex, request->UDN, NULL);
+	if (node) {
+		ithread_mutex_lock(&node->mutex);
+		request->cache = &node->cache;
+	}
+	count = ParseParameterValueList(xml, CtrlPointDemuxParameter, request);
+	request->cache = NULL;
+	if (node)
+		ithread_mutex_unlock(&node->mutex);
+	DEVICE_LIST_UNLOCK();
+	return count;
+}
+
+void CtrlPointUncacheValues(struct ActionRequest *request)
+{
+	struct DeviceNode *node;
+	struct CachedParameter *item;
+	int i;
+
+	/* The values set are read again rather than guessed, but kept as the
+	   old values the next event is compared with */
+	DEVICE_LIST_RDLOCK();
+	node = IndexLookup(&g_udnIndex, request->UDN, NULL);
+	if (node) {
+		ithread_mutex_lock(&node->mutex);
+		for (i = 0; i < request->count; i++) {
+			item = ParameterCacheFind(&node->cache, request->paths[i]);
+			if (item)
+				item->updated = 0;
+		}
+		ithread_mutex_unlock(&node->mutex);
+	}
+	DEVICE_LIST_UNLOCK();
+}
+
+int CtrlPointServeFromCache(int devnum, const char **paths, int count, int maxAge, const char **missing)
+{
+	struct DeviceNode *node;
+	struct CachedParameter *item;
+	time_t now = time(NULL);
+	size_t len;
+	int nmissing = 0;
+	int i;
+
+	DEVICE_LIST_RDLOCK();
+	if (CtrlPointGetDevice(devnum, &node) < 0) {
+		DEVICE_LIST_UNLOCK();
+		return -1;
+	}
+	ithread_mutex_lock(&node->mutex);
+	for (i = 0; i < count; i++) {
+		len = strlen(paths[i]);
+		item = len > 0 && '/' != paths[i][len-1] ? ParameterCacheFind(&node->cache, paths[i]) : NULL;
+		if (item && item->updated > 0 && now - item->updated <= maxAge)
+			printf("\n%s=%s (cached %lds ago)\n", paths[i], item->value, (long)(now - item->updated));
+		else
+			missing[nmissing++] = paths[i];
+	}
+	ithread_mutex_unlock(&node->mutex);
+	DEVICE_LIST_UNLOCK();
+	MetricAdd(METRIC_CACHE_HITS, (unsigned long)(count - nmissing));
+	MetricAdd(METRIC_CACHE_MISSES, (unsigned long)nmissing);
+	return nmissing;
+}
+
+void ParameterListAdd(const char *path, const struct CachedParameter *param, void *cookie)
+{
+	struct ParameterList *list = (struct ParameterList *)cookie;
+	struct ParameterEntry *grown;
+	struct ParameterEntry *entry;
+
+	/* Grow by doubling, the array is sized for powers of 2 */
+	if (0 == (list->count & (list->count - 1))) {
+		grown = (struct ParameterEntry *)realloc(list->entries,
+			(size_t)(list->count ? list->count * 2 : 1) * sizeof(struct ParameterEntry));
+		if (NULL == grown)
+			return;
+		list->entries = grown;
+	}
+	entry = &list->entries[list->count];
+	entry->path = strdup(path);
+	entry->value = strdup(param->value);
+	entry->updated = param->updated;
+	if (NULL == entry->path || NULL == entry->value) {
+		free(entry->path);
+		free(entry->value);
+		return;
+	}
+	list->count++;
+}
+
+void ParameterListFree(struct ParameterList *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		free(list->entries[i].path);
+		free(list->entries[i].value);
+	}
+	free(list->entries);
+	list->entries = NULL;
+	list->count = 0;
+}
+
+int CompareParameterEntry(const void *a, const void *b)
+{
+	return strcmp(((const struct ParameterEntry *)a)->path, ((const struct ParameterEntry *)b)->path);
+}
+
+int CtrlPointCollectCache(int devnum, const char *prefix, struct ParameterList *list)
+{
+	struct DeviceNode *node;
+	char subtree[MAX_VAL_LEN] = {0};
+	size_t len;
+
+	/* <path>/# and <path>/ both mean the subtree */
+	strncpy(subtree, prefix ? prefix : "", sizeof(subtree)-1);
+	len = strlen(subtree);
+	if (len > 0 && '#' == subtree[len-1])
+		subtree[len-1] = '\0';
+
+	DEVICE_LIST_RDLOCK();
+	if (CtrlPointGetDevice(devnum, &node) < 0) {
+		printf("Can't find device %d\n",devnum);
+		DEVICE_LIST_UNLOCK();
+		return -1;
+	}
+	ithread_mutex_lock(&node->mutex);
+	ParameterCacheWalk(&node->cache, subtree, ParameterListAdd, list);
+	ithread_mutex_unlock(&node->mutex);
+	DEVICE_LIST_UNLOCK();
+	qsort(list->entries, (size_t)list->count, sizeof(struct ParameterEntry), CompareParameterEntry);
+	return list->count;
+}
+
+int CtrlPointPrintCache(int devnum, const char *prefix)
+{
+	struct ParameterList list = {NULL, 0};
+	time_t now = time(NULL);
+	int i;
+
+	if (CtrlPointCollectCache(devnum, prefix, &list) < 0)
+		return -1;
+	for (i = 0; i < list.count; i++) {
+		if (list.entries[i].updated > 0)
+			printf("%s=%s (%lds ago)\n", list.entries[i].path, list.entries[i].value,
+				(long)(now - list.entries[i].updated));
+		else
+			printf("%s=%s (stale)\n", list.entries[i].path, list.entries[i].value);
+	}
+	printf("%d values of device %d under %s\n", list.count, devnum, prefix && prefix[0] ? prefix : "/");
+	ParameterListFree(&list);
+	return 0;
+}
+
+int CtrlPointDiffCache(int devnumA, int devnumB, const char *prefix)
+{
+	struct ParameterList a = {NULL, 0};
+	struct ParameterList b = {NULL, 0};
+	int same = 0, differ = 0, onlyA = 0, onlyB = 0;
+	int i = 0, j = 0, cmp;
+
+	if (CtrlPointCollectCache(devnumA, prefix, &a) < 0 || CtrlPointCollectCache(devnumB, prefix, &b) < 0) {
+		ParameterListFree(&a);
+		return -1;
+	}
+	/* Both lists are sorted by path */
+	while (i < a.count || j < b.count) {
+		if (i == a.count)
+			cmp = 1;
+		else if (j == b.count)
+			cmp = -1;
+		else
+			cmp = strcmp(a.entries[i].path, b.entries[j].path);
+		if (cmp < 0) {
+			printf("- %s=%s\n", a.entries[i].path, a.entries[i].value);
+			onlyA++;
+			i++;
+		} else if (cmp > 0) {
+			printf("+ %s=%s\n", b.entries[j].path, b.entries[j].value);
+			onlyB++;
+			j++;
+		} else {
+			if (strcmp(a.entries[i].value, b.entries[j].value) != 0) {
+				printf("! %s: %s -> %s\n", a.entries[i].path, a.entries[i].value, b.entries[j].value);
+				differ++;
+			} else {
+				same++;
+			}
+			i++;
+			j++;
+		}
+	}
+	printf("Device %d vs %d: %d same, %d differ, %d only in %d, %d only in %d\n",
+		devnumA, devnumB, same, differ, onlyA, devnumA, onlyB, devnumB);
+	ParameterListFree(&a);
+	ParameterListFree(&b);
+	return 0;
+}
+
+void CtrlPointHandleActionComplete(struct ActionRequest *request, struct Upnp_Action_Complete *aEvent)
+{
+	char *ParameterValueList = NULL;
+	int answered = 0;
+	int i;
+
+	if (request->fanOut) {
+		/* Counted here, the device is released by the caller */
+		if (SetValues != request->actionType && aEvent->ErrCode == UPNP_E_SUCCESS)
+			CtrlPointCountParameters(request, aEvent);
+		else if (aEvent->ErrCode == UPNP_E_SUCCESS)
+			CtrlPointUncacheValues(request);
+		return;
+	}
+	if (aEvent->ErrCode != UPNP_E_SUCCESS && 0 == request->count) {
+		printf("%s failed for device %d\n", CtrlPointActionName(request->actionType), request->devnum);
+		return;
+	}
+	if (aEvent->ErrCode != UPNP_E_SUCCESS) {
+		printf("%s failed for %d paths of device %d\n",
+			CtrlPointActionName(request->actionType), request->count, request->devnum);
+		return;
+	}
+	if (SetAlarmsEnabled == request->actionType)
+		return;
+	if (SetValues == request->actionType) {
+		char *status = NULL;
+		CtrlPointUncacheValues(request);
+		if (aEvent->ActionResult)
+			status = GetFirstDocumentItem(aEvent->ActionResult,"Status");
+		printf("SetValues: %d parameters of device %d, Status=%s\n",
+			request->count, request->devnum, status ? status : "");
+		if (status) free(status);
+		return;
+	}
+	if (aEvent->ActionResult)
+		ParameterValueList = GetFirstDocumentItem(aEvent->ActionResult,"ParameterValueList");
+	if (ParameterValueList) {
+		if (CtrlPointParseValues(request, ParameterValueList) < 0)
+			printf("Error parsing ParameterValueList\n");
+		free(ParameterValueList);
 	}
-	printf("Config Control Point Registered\n");
-
-	/* start a timer thread */
-	ithread_create(&timerThread, NULL, CtrlPointTimerLoop, NULL);
-	
-	return 0;
+	for (i = 0; i < request->count; i++) {
+		if (request->found[i])
+			answered++;
+		else
+			printf("\n%s: no value\n", request->paths[i]);
+	}
+	if (request->count > 1)
+		printf("GetValues: %d of %d paths answered by device %d\n", answered, request->count, request->devnum);
 }
 
-int CtrlPointStop(void)
+void CtrlPointCountParameters(struct ActionRequest *request, struct Upnp_Action_Complete *aEvent)
 {
-	CtrlPointRemoveAll();
-	UpnpUnRegisterClient(g_cpHandle );
-	UpnpFinish();
-	ithread_mutex_destroy(&g_deviceListMutex);
-	return 0;
+	char *ParameterValueList = NULL;
+	int count = 0;
+
+	if (aEvent->ActionResult)
+		ParameterValueList = GetFirstDocumentItem(aEvent->ActionResult,"ParameterValueList");
+	if (ParameterValueList) {
+		count = CtrlPointParseValues(request, ParameterValueList);
+		free(ParameterValueList);
+	}
+	if (count > 0) {
+		ithread_mutex_lock(&request->fanOut->mutex);
+		request->fanOut->parameters += count;
+		ithread_mutex_unlock(&request->fanOut->mutex);
+	}
 }
 
-void *CtrlPointCommandLoop(void *args)
+int AppendPath(char ***paths, int *count, const char *path)
 {
-	CtrlPointRefresh();
-
-	while (1) {
-		char cmdline[MAX_BUFFER]={0};
-		printf("\n>");
-		fgets(cmdline, sizeof(cmdline)-1, stdin);
-		CtrlPointProcessCommand(cmdline);
+	char **grown;
+
+	/* Grow by doubling, the array is sized for powers of 2 */
+	if (0 == (*count & (*count - 1))) {
+		grown = (char **)realloc(*paths, (size_t)(*count ? *count * 2 : 1) * sizeof(char *));
+		if (NULL == grown)
+			return -1;
+		*paths = grown;
 	}
-	ithread_detach(ithread_self());
-	return NULL;
+	(*paths)[*count] = strdup(path);
+	if (NULL == (*paths)[*count])
+		return -1;
+	(*count)++;
+	return 0;
 }
 
-int GetValueSendAction(ActionParam* action)
+int LoadPathFile(const char *file, char ***paths, int *count)
 {
+	FILE *fp = fopen(file, "r");
+	char line[MAX_BUFFER];
+	char *path;
+	size_t len;
 	int rc = 0;
-	int i;
-	struct DeviceNode *devNode;
-	IXML_Document *actionNode = NULL;
-	int service;
-	char *actionName = NULL;
-	char nodeBuffer[MAX_BUFFER]={0};
-	int numOfCmds = (sizeof g_cmdList)/sizeof (cmdloop_commands);
 
-	ithread_mutex_lock(&g_deviceListMutex);
-	rc = CtrlPointGetDevice(action->devnum, &devNode);
-	if (rc<0) {
-		printf("Can't find device %d\n",action->devnum);
-		ithread_mutex_unlock(&g_deviceListMutex);
+	if (NULL == fp) {
+		printf("Can't open %s\n", file);
 		return -1;
 	}
-
-	service = action->serviceType;
-	for (i = 0; i < numOfCmds; ++i) {
-		if ( action->actionType == g_cmdList[i].command) {
-			actionName=(char *)g_cmdList[i].str;
-			break;
-		}
+	while (0 == rc && fgets(line, sizeof(line), fp)) {
+		/* One path per line, blank lines and # comments are skipped */
+		path = line + strspn(line, " \t");
+		len = strcspn(path, " \t\r\n");
+		path[len] = '\0';
+		if (0 == len || '#' == path[0])
+			continue;
+		rc = AppendPath(paths, count, path);
 	}
+	fclose(fp);
+	return rc;
+}
 
-	actionNode=UpnpMakeAction(actionName, g_serviceType[service],0, NULL);
-	if(actionNode==NULL){
-		printf("UpnpMakeAction failed\n");
-		ithread_mutex_unlock(&g_deviceListMutex);
+int LoadParameterFile(const char *file, char ***paths, char ***values, int *count)
+{
+	FILE *fp = fopen(file, "r");
+	char line[MAX_BUFFER];
+	char *path;
+	char *value;
+	char *end;
+	int valueCount;
+	int rc = 0;
+
+	if (NULL == fp) {
+		printf("Can't open %s\n", file);
 		return -1;
 	}
-
-	snprintf(nodeBuffer, sizeof(nodeBuffer)-1,g_getValuesFormat, action->paramName);
-	rc=UpnpAddToAction(&actionNode,actionName,g_serviceType[service],"Parameters",nodeBuffer);
-
-	rc = UpnpSendActionAsync(g_cpHandle,devNode->device.service[service].controlURL,
-		g_serviceType[service], NULL,actionNode,CtrlPointCallbackEventHandler, NULL);
-	if(rc!=UPNP_E_SUCCESS) printf("Error in UpnpSendActionAsync -- %d\n",rc);
-	ithread_mutex_unlock(&g_deviceListMutex);
-	
-	if (actionNode){
-		ixmlDocument_free(actionNode);
+	while (0 == rc && fgets(line, sizeof(line), fp)) {
+		/* A path and its value on each line, the value running to the end */
+		path = line + strspn(line, " \t");
+		end = path + strcspn(path, " \t\r\n");
+		if (end == path || '#' == path[0])
+			continue;
+		value = end + strspn(end, " \t");
+		*end = '\0';
+		value[strcspn(value, "\r\n")] = '\0';
+		valueCount = *count;
+		rc = AppendPath(values, &valueCount, value);
+		if (0 == rc) {
+			rc = AppendPath(paths, count, path);
+			if (rc < 0)
+				free((*values)[valueCount - 1]);
+		}
 	}
-	return 0;
+	fclose(fp);
+	return rc;
 }
 
-int SetValueSendAction(ActionParam* action)
+int CtrlPointSetOption(const char *name, const char *value)
 {
-	int rc = 0;
+	int numOfOptions = (int)(sizeof(g_optionList) / sizeof(g_optionList[0]));
+	char *end;
+	long number;
 	int i;
-	struct DeviceNode *devNode;
-	IXML_Document *actionNode = NULL;
-	int service;
-	char *actionName = NULL;
-	char nodeBuffer[MAX_BUFFER]={0};
-	int numOfCmds = (sizeof g_cmdList) / sizeof (cmdloop_commands);
 
-	ithread_mutex_lock(&g_deviceListMutex);
-	rc = CtrlPointGetDevice(action->devnum, &devNode);
-	if (rc<0) {
-		printf("Can't find device %d\n",action->devnum);
-		ithread_mutex_unlock(&g_deviceListMutex);
+	for (i = 0; i < numOfOptions; i++) {
+		if (NULL == name || '\0' == name[0])
+			printf("  %-16s %-10d %s\n", g_optionList[i].name, *g_optionList[i].value, g_optionList[i].desc);
+		else if (0 == strcasecmp(name, g_optionList[i].name))
+			break;
+	}
+	if (NULL == name || '\0' == name[0])
+		return 0;
+	if (i == numOfOptions) {
+		printf("Unknown option %s\n", name);
 		return -1;
 	}
-
-	service = action->serviceType;
-	for (i = 0; i < numOfCmds; ++i) {
-		if ( action->actionType == g_cmdList[i].command) {
-			actionName=(char *)g_cmdList[i].str;
-			break;
-		}
+	if (NULL == value || '\0' == value[0]) {
+		printf("%s=%d\n", g_optionList[i].name, *g_optionList[i].value);
+		return 0;
 	}
-
-	actionNode=UpnpMakeAction(actionName, g_serviceType[service],0, NULL);
-	if(actionNode==NULL){
-		printf("UpnpMakeAction failed\n");
-		ithread_mutex_unlock(&g_deviceListMutex);
+	number = strtol(value, &end, 0);
+	if ('\0' != *end || number < g_optionList[i].min || number > g_optionList[i].max) {
+		printf("%s must be between %d and %d\n", g_optionList[i].name, g_optionList[i].min, g_optionList[i].max);
 		return -1;
 	}
+	*g_optionList[i].value = (int)number;
+	if (&g_dispatchWorkers == g_optionList[i].value)
+		CtrlPointResizeDispatch();
+	return 0;
+}
 
-	snprintf(nodeBuffer, sizeof(nodeBuffer)-1, g_setValuesFormat, action->paramName,action->paramValue);
-	rc=UpnpAddToAction(&actionNode,actionName,g_serviceType[service],"ParameterValueList",nodeBuffer);
+void FreePaths(char **paths, int count)
+{
+	int i;
 
-	rc = UpnpSendActionAsync(g_cpHandle,devNode->device.service[service].controlURL,
-		g_serviceType[service], NULL,actionNode,CtrlPointCallbackEventHandler, NULL);
-	if(rc!=UPNP_E_SUCCESS) printf("Error in UpnpSendActionAsync -- %d\n",rc);
-	ithread_mutex_unlock(&g_deviceListMutex);
+	for (i = 0; i < count; i++)
+		free(paths[i]);
+	if (paths) free(paths);
+}
 
-	if (actionNode){
-		ixmlDocument_free(actionNode);
-	}
-	return 0;
+int SetValueSendAction(ActionParam* action)
+{
+	const char *path = action->paramName;
+	const char *value = action->paramValue;
+
+	return SetValuesSendAction(action->devnum, &path, &value, 1) < 0 ? -1 : 0;
 }
 
 int SetAlarmsEnabledSendAction(ActionParam* action)
@@ -924,13 +4287,14 @@ int SetAlarmsEnabledSendAction(ActionParam* action)
 	IXML_Document *actionNode = NULL;
 	int service;
 	char *actionName = NULL;
+	struct ActionRequest *request;
 	int numOfCmds = (sizeof g_cmdList) /sizeof (cmdloop_commands);
 
-	ithread_mutex_lock(&g_deviceListMutex);
+	DEVICE_LIST_RDLOCK();
 	rc = CtrlPointGetDevice(action->devnum, &devNode);
 	if (rc<0) {
 		printf("Can't find device %d\n",action->devnum);
-		ithread_mutex_unlock(&g_deviceListMutex);
+		DEVICE_LIST_UNLOCK();
 		return -1;
 	}
 
@@ -945,17 +4309,29 @@ int SetAlarmsEnabledSendAction(ActionParam* action)
 	actionNode=UpnpMakeAction(actionName, g_serviceType[service],0, NULL);
 	if(actionNode==NULL){
 		printf("UpnpMakeAction failed\n");
-		ithread_mutex_unlock(&g_deviceListMutex);
+		DEVICE_LIST_UNLOCK();
 		return -1;
 	}
 
 	rc=UpnpAddToAction(&actionNode,actionName,g_serviceType[service],
 		action->paramName,action->paramValue);
 
+	request = CtrlPointNewRequest(action->actionType, action->devnum, devNode->device.UDN, NULL, 0, 1);
+	if (NULL == request) {
+		DEVICE_LIST_UNLOCK();
+		ixmlDocument_free(actionNode);
+		return -1;
+	}
+	request->sendTime = CtrlPointNow();
 	rc = UpnpSendActionAsync(g_cpHandle,devNode->device.service[service].controlURL,
-		g_serviceType[service], NULL,actionNode,CtrlPointCallbackEventHandler, NULL);
-	if(rc!=UPNP_E_SUCCESS) printf("Error in UpnpSendActionAsync -- %d\n",rc);
-	ithread_mutex_unlock(&g_deviceListMutex);
+		g_serviceType[service], NULL,actionNode,CtrlPointCallbackEventHandler, request);
+	if(rc!=UPNP_E_SUCCESS) {
+		printf("Error in UpnpSendActionAsync -- %d\n",rc);
+		CtrlPointFreeRequest(request);
+	} else {
+		MetricAdd(METRIC_ACTIONS_SENT, 1);
+	}
+	DEVICE_LIST_UNLOCK();
 
 	if (actionNode){
 		ixmlDocument_free(actionNode);
@@ -975,6 +4351,16 @@ char *GetElementValue(IXML_Element *element)
 	return temp;
 }
 
+const char *GetElementText(IXML_Element *element)
+{
+	IXML_Node *child = ixmlNode_getFirstChild((IXML_Node *)element);
+
+	if (child != 0 && ixmlNode_getNodeType(child) == eTEXT_NODE)
+		return ixmlNode_getNodeValue(child);
+
+	return NULL;
+}
+
 IXML_NodeList *GetFirstServiceList(IXML_Document *doc)
 {
 	IXML_NodeList *ServiceList = NULL;
@@ -1120,59 +4506,340 @@ void NotifyStateUpdate(const char *varName,const char *varValue,const char *UDN,
 	printf("NotifyState %s=%s,UDN=%s,type=%d\n",varName,varValue,UDN,type);
 }
 
+void NotifyParameterChange(const char *UDN,const char *path,const char *oldValue,const char *newValue,long version)
+{
+	printf("NotifyChange %s: %s '%s' -> '%s', version %ld\n",
+		UDN,path,oldValue ? oldValue : "(none)",newValue,version);
+}
+
+void PrintParameter(const char *path, const char *value, void *cookie)
+{
+	/* With a cache, values that did not change are not printed again */
+	if (NULL == cookie || ParameterCacheChange((struct ParameterCache *)cookie, path, value) != 0)
+		printf("\n%s=%s\n",path,value);
+}
+
 void PrintParameters(const char *buffer)
 {
-	IXML_Document *doc = NULL;
+	if (ParseParameterValueList(buffer, PrintParameter, NULL) < 0)
+		printf("Error parsing ParameterValueList\n");
+}
 
-	//Parses an XML text buffer converting it into an IXML DOM 
-	doc = ixmlParseBuffer(buffer); 
-	if(NULL != doc){
-		IXML_NodeList *params = NULL;
-		params = ixmlDocument_getElementsByTagName(doc,"Parameter");
-		if (params) { 
-			unsigned int numOfElem = 0;
-			unsigned int i = 0;
-			numOfElem = ixmlNodeList_length(params);
-			for (i = 0; i < numOfElem; i++) { //Parameter
-				IXML_Element *element = NULL;
-				element = (IXML_Element *)ixmlNodeList_item(params, i);
-				if( NULL != element){
-					IXML_NodeList *pathNodeList = NULL;
-					pathNodeList = ixmlElement_getElementsByTagName((IXML_Element *)element,"ParameterPath");
-					if (NULL !=pathNodeList) { // ParameterPath & Value
-						char *pathNodeValue = NULL;
-						IXML_NodeList *valueNodeList = NULL;
-						IXML_Element *pathElement = NULL;
-						pathElement = (IXML_Element *)ixmlNodeList_item(pathNodeList, 0);
-						pathNodeValue = GetElementValue(pathElement);
-						valueNodeList = ixmlElement_getElementsByTagName((IXML_Element *)element,"Value");
-						if (NULL != valueNodeList) {
-							IXML_Element *valueElement = NULL;
-							char *valueNodeValue = NULL;
-							
-							valueElement = (IXML_Element *)ixmlNodeList_item(valueNodeList, 0);
-							valueNodeValue = GetElementValue(valueElement);
-							if( valueNodeValue) {
-								printf("\n%s=%s\n",pathNodeValue,valueNodeValue);
-								free(valueNodeValue);
-							}
-							ixmlNodeList_free(valueNodeList);
-						}
-						if( pathNodeValue) free(pathNodeValue);
-						ixmlNodeList_free(pathNodeList);
-					}
+struct DispatchItem *CtrlPointCopyEvent(Upnp_EventType eventType, const void *event, void *cookie)
+{
+	struct DispatchItem *item;
+
+	switch (eventType) {
+		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE:
+		case UPNP_DISCOVERY_SEARCH_RESULT:
+		case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE:
+		case UPNP_EVENT_RECEIVED:
+		case UPNP_CONTROL_ACTION_COMPLETE:
+		case UPNP_CONTROL_GET_VAR_COMPLETE:
+		case UPNP_EVENT_SUBSCRIBE_COMPLETE:
+		case UPNP_EVENT_RENEWAL_COMPLETE:
+		case UPNP_EVENT_AUTORENEWAL_FAILED:
+		case UPNP_EVENT_SUBSCRIPTION_EXPIRED:
+			break;
+		default:
+			return NULL;
+	}
+	item = (struct DispatchItem *)malloc(sizeof(struct DispatchItem));
+	if (NULL == item)
+		return NULL;
+	item->type = eventType;
+	item->cookie = cookie;
+	item->queueTime = CtrlPointNow();
+	switch (eventType) {
+		case UPNP_EVENT_RECEIVED:
+			item->u.event = *(const struct Upnp_Event *)event;
+			item->u.event.ChangedVariables = (IXML_Document *)ixmlNode_cloneNode(
+				(IXML_Node *)((const struct Upnp_Event *)event)->ChangedVariables, 1);
+			if (NULL == item->u.event.ChangedVariables) {
+				free(item);
+				return NULL;
+			}
+			break;
+		case UPNP_CONTROL_ACTION_COMPLETE:
+			/* Only the result is read */
+			item->u.action = *(const struct Upnp_Action_Complete *)event;
+			item->u.action.ActionRequest = NULL;
+			if (item->u.action.ActionResult) {
+				item->u.action.ActionResult = (IXML_Document *)ixmlNode_cloneNode(
+					(IXML_Node *)item->u.action.ActionResult, 1);
+				if (NULL == item->u.action.ActionResult) {
+					free(item);
+					return NULL;
+				}
+			}
+			break;
+		case UPNP_CONTROL_GET_VAR_COMPLETE:
+			item->u.stateVar = *(const struct Upnp_State_Var_Complete *)event;
+			if (item->u.stateVar.CurrentVal) {
+				item->u.stateVar.CurrentVal = ixmlCloneDOMString(item->u.stateVar.CurrentVal);
+				if (NULL == item->u.stateVar.CurrentVal) {
+					free(item);
+					return NULL;
 				}
 			}
-			ixmlNodeList_free(params);
-			params = NULL;
+			break;
+		case UPNP_EVENT_SUBSCRIBE_COMPLETE:
+		case UPNP_EVENT_RENEWAL_COMPLETE:
+		case UPNP_EVENT_AUTORENEWAL_FAILED:
+		case UPNP_EVENT_SUBSCRIPTION_EXPIRED:
+			item->u.subscribe = *(const struct Upnp_Event_Subscribe *)event;
+			break;
+		default:
+			item->u.discovery = *(const struct Upnp_Discovery *)event;
+			break;
+	}
+	return item;
+}
+
+void CtrlPointFreeItem(struct DispatchItem *item)
+{
+	switch (item->type) {
+		case UPNP_EVENT_RECEIVED:
+			ixmlDocument_free(item->u.event.ChangedVariables);
+			break;
+		case UPNP_CONTROL_ACTION_COMPLETE:
+			if (item->u.action.ActionResult)
+				ixmlDocument_free(item->u.action.ActionResult);
+			break;
+		case UPNP_CONTROL_GET_VAR_COMPLETE:
+			if (item->u.stateVar.CurrentVal)
+				ixmlFreeDOMString(item->u.stateVar.CurrentVal);
+			break;
+		default:
+			break;
+	}
+	free(item);
+}
+
+/* Whether g_dispatchPolicy drops this event when the queue is full */
+int CtrlPointDispatchDrops(Upnp_EventType eventType)
+{
+	switch (eventType) {
+		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE:
+		case UPNP_DISCOVERY_SEARCH_RESULT:
+			return DISPATCH_BLOCK != g_dispatchPolicy;
+		case UPNP_EVENT_RECEIVED:
+			return DISPATCH_DROP_EVENTS == g_dispatchPolicy;
+		default:
+			/* Byebyes, subscriptions and completions, which own a cookie, are kept */
+			return 0;
+	}
+}
+
+const char *CtrlPointDispatchKey(Upnp_EventType eventType, const void *event, void *cookie,
+	struct DeviceIndex **index)
+{
+	*index = NULL;
+	switch (eventType) {
+		case UPNP_EVENT_RECEIVED:
+			*index = &g_sidIndex;
+			return ((const struct Upnp_Event *)event)->Sid;
+		case UPNP_EVENT_SUBSCRIBE_COMPLETE:
+		case UPNP_EVENT_RENEWAL_COMPLETE:
+		case UPNP_EVENT_AUTORENEWAL_FAILED:
+		case UPNP_EVENT_SUBSCRIPTION_EXPIRED:
+			/* The SID may not be known yet, the eventURL is */
+			*index = &g_eventURLIndex;
+			return ((const struct Upnp_Event_Subscribe *)event)->PublisherUrl;
+		case UPNP_CONTROL_ACTION_COMPLETE:
+			if (cookie)
+				return ((const struct ActionRequest *)cookie)->UDN;
+			*index = &g_controlURLIndex;
+			return ((const struct Upnp_Action_Complete *)event)->CtrlUrl;
+		case UPNP_CONTROL_GET_VAR_COMPLETE:
+			*index = &g_controlURLIndex;
+			return ((const struct Upnp_State_Var_Complete *)event)->CtrlUrl;
+		default:
+			return ((const struct Upnp_Discovery *)event)->DeviceId;
+	}
+}
+
+unsigned int CtrlPointDispatchHash(Upnp_EventType eventType, const void *event, void *cookie)
+{
+	struct DeviceIndex *index;
+	const char *key = CtrlPointDispatchKey(eventType, event, cookie, &index);
+	unsigned int hash;
+
+	/* Keys not known yet are kept together with their own kind */
+	if (NULL == index || DispatchRouteLookup(key, &hash) < 0)
+		return HashString(key);
+	return hash;
+}
+
+int CtrlPointDispatch(Upnp_EventType eventType, const void *event, void *cookie)
+{
+	struct DispatchShard *shard;
+	struct DispatchItem *item;
+	unsigned int hash = CtrlPointDispatchHash(eventType, event, cookie);
+	int blocked = 0;
+	int rc = 0;
+
+	ithread_mutex_lock(&g_dispatchGate);
+	ithread_rwlock_rdlock(&g_dispatchLock);
+	ithread_mutex_unlock(&g_dispatchGate);
+	if (0 == g_dispatchShardCount) {
+		ithread_rwlock_unlock(&g_dispatchLock);
+		return -1;
+	}
+	shard = &g_dispatchShards[hash % g_dispatchShardCount];
+	/* Dropped before the copy when the shard is plainly full */
+	if (shard->count >= g_dispatchDepth && CtrlPointDispatchDrops(eventType)) {
+		ithread_rwlock_unlock(&g_dispatchLock);
+		MetricAdd(METRIC_DISPATCH_DROPPED, 1);
+		return 0;
+	}
+	item = CtrlPointCopyEvent(eventType, event, cookie);
+	if (NULL == item) {
+		ithread_rwlock_unlock(&g_dispatchLock);
+		return -1;
+	}
+
+	ithread_mutex_lock(&shard->mutex);
+	while (shard->count >= g_dispatchDepth && !CtrlPointDispatchDrops(eventType)) {
+		blocked = 1;
+		ithread_cond_wait(&shard->notFull, &shard->mutex);
+	}
+	if (shard->count >= g_dispatchDepth) {
+		rc = 1;
+	} else {
+		shard->ring[(shard->head + shard->count) & (DISPATCH_QUEUE_SIZE - 1)] = item;
+		shard->count++;
+		if (shard->count > shard->highWater)
+			shard->highWater = shard->count;
+		ithread_cond_signal(&shard->notEmpty);
+	}
+	ithread_mutex_unlock(&shard->mutex);
+	ithread_rwlock_unlock(&g_dispatchLock);
+
+	if (rc) {
+		MetricAdd(METRIC_DISPATCH_DROPPED, 1);
+		CtrlPointFreeItem(item);
+		return 0;
+	}
+	MetricAdd(METRIC_DISPATCH_QUEUED, 1);
+	if (blocked)
+		MetricAdd(METRIC_DISPATCH_BLOCKED, 1);
+	return 0;
+}
+
+void CtrlPointProcessItem(struct DispatchItem *item)
+{
+	LatencyRecord(&g_dispatchWait, CtrlPointNow() - item->queueTime, UPNP_E_SUCCESS);
+	/* Adverts left at shutdown are not worth a download */
+	if (g_dispatchRun || (UPNP_DISCOVERY_ADVERTISEMENT_ALIVE != item->type
+		&& UPNP_DISCOVERY_SEARCH_RESULT != item->type))
+		CtrlPointProcessEvent(item->type, &item->u, item->cookie);
+	CtrlPointFreeItem(item);
+}
+
+void *CtrlPointDispatchLoop(void *arg)
+{
+	struct DispatchShard *shard = (struct DispatchShard *)arg;
+	struct DispatchItem *item;
+
+	ithread_mutex_lock(&shard->mutex);
+	for (;;) {
+		while (shard->run && 0 == shard->count)
+			ithread_cond_wait(&shard->notEmpty, &shard->mutex);
+		/* Stopped with nothing left */
+		if (0 == shard->count)
+			break;
+		item = shard->ring[shard->head];
+		shard->head = (shard->head + 1) & (DISPATCH_QUEUE_SIZE - 1);
+		shard->count--;
+		ithread_cond_signal(&shard->notFull);
+		ithread_mutex_unlock(&shard->mutex);
+		CtrlPointProcessItem(item);
+		shard->processed++;
+		ithread_mutex_lock(&shard->mutex);
+	}
+	ithread_mutex_unlock(&shard->mutex);
+	return NULL;
+}
+
+void CtrlPointResizeDispatch(void)
+{
+	struct DispatchShard *shards;
+	int workers;
+	int i;
+
+	/* Queueing waits until the shards are drained and remade, so that the
+	 * events of a key are never processed by two workers at once */
+	ithread_mutex_lock(&g_dispatchGate);
+	ithread_rwlock_wrlock(&g_dispatchLock);
+	for (i = 0; i < g_dispatchShardCount; i++) {
+		ithread_mutex_lock(&g_dispatchShards[i].mutex);
+		g_dispatchShards[i].run = 0;
+		ithread_cond_signal(&g_dispatchShards[i].notEmpty);
+		ithread_mutex_unlock(&g_dispatchShards[i].mutex);
+	}
+	for (i = 0; i < g_dispatchShardCount; i++) {
+		ithread_join(g_dispatchShards[i].thread, NULL);
+		ithread_mutex_destroy(&g_dispatchShards[i].mutex);
+		ithread_cond_destroy(&g_dispatchShards[i].notEmpty);
+		ithread_cond_destroy(&g_dispatchShards[i].notFull);
+	}
+	free(g_dispatchShards);
+	g_dispatchShards = NULL;
+	g_dispatchShardCount = 0;
+
+	workers = g_dispatchRun ? g_dispatchWorkers : 0;
+	shards = workers > 0 ? (struct DispatchShard *)calloc((size_t)workers, sizeof(struct DispatchShard)) : NULL;
+	for (i = 0; shards && i < workers; i++) {
+		ithread_mutex_init(&shards[i].mutex, NULL);
+		ithread_cond_init(&shards[i].notEmpty, NULL);
+		ithread_cond_init(&shards[i].notFull, NULL);
+		shards[i].run = 1;
+		if (ithread_create(&shards[i].thread, NULL, CtrlPointDispatchLoop, &shards[i]) != 0) {
+			ithread_mutex_destroy(&shards[i].mutex);
+			ithread_cond_destroy(&shards[i].notEmpty);
+			ithread_cond_destroy(&shards[i].notFull);
+			break;
 		}
-		ixmlDocument_free(doc);
-		doc = NULL;
 	}
-	return;
+	if (shards && 0 == i) {
+		free(shards);
+		shards = NULL;
+	}
+	g_dispatchShards = shards;
+	g_dispatchShardCount = shards ? i : 0;
+	ithread_rwlock_unlock(&g_dispatchLock);
+	ithread_mutex_unlock(&g_dispatchGate);
+}
+
+void CtrlPointStartDispatch(void)
+{
+	ithread_mutex_lock(&g_dispatchGate);
+	ithread_rwlock_wrlock(&g_dispatchLock);
+	g_dispatchRun = 1;
+	ithread_rwlock_unlock(&g_dispatchLock);
+	ithread_mutex_unlock(&g_dispatchGate);
+	CtrlPointResizeDispatch();
+}
+
+void CtrlPointStopDispatch(void)
+{
+	ithread_mutex_lock(&g_dispatchGate);
+	ithread_rwlock_wrlock(&g_dispatchLock);
+	g_dispatchRun = 0;
+	ithread_rwlock_unlock(&g_dispatchLock);
+	ithread_mutex_unlock(&g_dispatchGate);
+	CtrlPointResizeDispatch();
 }
 
 int CtrlPointCallbackEventHandler(Upnp_EventType eventType, void *event, void *cookie)
+{
+	if (g_dispatchShardCount > 0 && 0 == CtrlPointDispatch(eventType, event, cookie))
+		return 0;
+	return CtrlPointProcessEvent(eventType, event, cookie);
+}
+
+int CtrlPointProcessEvent(Upnp_EventType eventType, void *event, void *cookie)
 {
 	int ret;
 	struct Upnp_Discovery *dEvent = NULL;
@@ -1181,18 +4848,29 @@ int CtrlPointCallbackEventHandler(Upnp_EventType eventType, void *event, void *c
 	struct Upnp_State_Var_Complete *svEvent = NULL;
 	struct Upnp_Event_Subscribe *esEvent = NULL;
 	IXML_Document *doc = NULL;
-	int timeOut = g_defaultTimeout;
-	Upnp_SID newSID;
 
 	switch(eventType ) {
 		/* SSDP Stuff */
 		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE:
 		case UPNP_DISCOVERY_SEARCH_RESULT: 
 			dEvent = (struct Upnp_Discovery *)event;
-			ret = UpnpDownloadXmlDoc(dEvent->Location, &doc);
+			/* A known device only gets its timeout refreshed */
+			if (0 == CtrlPointRefreshDevice(dEvent->DeviceId,dEvent->Location,dEvent->Expires))
+				break;
+			/* Unrelated devices are dropped before any download */
+			if (CtrlPointFilterDiscovery(dEvent) < 0)
+				break;
+			/* The other adverts of a device that is being fetched are dropped */
+			if (CtrlPointBeginDownload(dEvent->Location) < 0)
+				break;
+			ret = g_downloadXmlDoc(dEvent->Location, &doc);
+			MetricAdd(ret == UPNP_E_SUCCESS ?
+				METRIC_DESCRIPTIONS_DOWNLOADED : METRIC_DESCRIPTION_ERRORS, 1);
 			if (ret == UPNP_E_SUCCESS){
-				CtrlPointAddDevice(doc,dEvent->Location,dEvent->Expires);
+				if (CtrlPointAddDevice(doc,dEvent->Location,dEvent->Expires) < 0)
+					CtrlPointRejectLocation(dEvent->Location,dEvent->Expires);
 			}
+			CtrlPointEndDownload(dEvent->Location);
 			if (doc) ixmlDocument_free(doc);
 			break;
 		case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE: 
@@ -1206,7 +4884,14 @@ int CtrlPointCallbackEventHandler(Upnp_EventType eventType, void *event, void *c
 		case UPNP_CONTROL_ACTION_COMPLETE:
 			aEvent = (struct Upnp_Action_Complete *)event;
 			printf("ErrCode = %s(%d)\n",UpnpGetErrorMessage(aEvent->ErrCode),aEvent->ErrCode);
-			if (aEvent->ActionResult) {
+			if (cookie) { //actions are sent with a request context
+				struct ActionRequest *request = (struct ActionRequest *)cookie;
+				CtrlPointRecordLatency(request, aEvent->ErrCode);
+				CtrlPointHandleActionComplete(request, aEvent);
+				if (request->fanOut)
+					CtrlPointFanOutRelease(request->fanOut, request->slot, aEvent->ErrCode, 1);
+				CtrlPointFreeRequest(request);
+			} else if (aEvent->ActionResult) {
 				char* ParameterValueList = NULL;
 				ParameterValueList = GetFirstDocumentItem(aEvent->ActionResult,"ParameterValueList");
 				if( NULL != ParameterValueList) { //GetValues
@@ -1217,9 +4902,12 @@ int CtrlPointCallbackEventHandler(Upnp_EventType eventType, void *event, void *c
 			break;
 		case UPNP_CONTROL_GET_VAR_COMPLETE: 
 			svEvent = (struct Upnp_State_Var_Complete *)event;
-			if (svEvent->ErrCode == UPNP_E_SUCCESS) {
-				CtrlPointHandleGetVar(svEvent->CtrlUrl,svEvent->StateVarName,svEvent->CurrentVal);
+			if (cookie) {
+				CtrlPointRecordLatency((struct ActionRequest *)cookie, svEvent->ErrCode);
+				CtrlPointFreeRequest((struct ActionRequest *)cookie);
 			}
+			CtrlPointHandleGetVar(svEvent->CtrlUrl,svEvent->StateVarName,
+				svEvent->ErrCode == UPNP_E_SUCCESS ? svEvent->CurrentVal : NULL);
 			break;
 		case UPNP_CONTROL_GET_VAR_REQUEST:
 		case UPNP_CONTROL_ACTION_REQUEST:
@@ -1230,21 +4918,22 @@ int CtrlPointCallbackEventHandler(Upnp_EventType eventType, void *event, void *c
 			CtrlPointHandleEvent(eEvent->Sid,eEvent->EventKey,eEvent->ChangedVariables);
 			break;
 		case UPNP_EVENT_SUBSCRIBE_COMPLETE:
-		case UPNP_EVENT_UNSUBSCRIBE_COMPLETE:
 		case UPNP_EVENT_RENEWAL_COMPLETE: 
 			esEvent = (struct Upnp_Event_Subscribe *)event;
 			if (esEvent->ErrCode == UPNP_E_SUCCESS) {
 				CtrlPointHandleSubscribeUpdate(esEvent->PublisherUrl,esEvent->Sid,esEvent->TimeOut);
+			} else {
+				CtrlPointHandleSubscribeFailed(esEvent->PublisherUrl,esEvent->ErrCode);
 			}
 			break;
+		case UPNP_EVENT_UNSUBSCRIBE_COMPLETE:
+			break;
 		case UPNP_EVENT_AUTORENEWAL_FAILED:
 		case UPNP_EVENT_SUBSCRIPTION_EXPIRED: 
 			esEvent = (struct Upnp_Event_Subscribe *)event;
-			ret = UpnpSubscribe(g_cpHandle,esEvent->PublisherUrl,&timeOut,newSID);
-			if (ret == UPNP_E_SUCCESS) {
-				printf("Subscribed to eventURL with SID=%s\n", newSID);
-				CtrlPointHandleSubscribeUpdate(esEvent->PublisherUrl,newSID,timeOut);
-			} 
+			if (UPNP_EVENT_AUTORENEWAL_FAILED == eventType)
+				MetricAdd(METRIC_RENEW_FAILURES, 1);
+			CtrlPointSubscribe(esEvent->PublisherUrl, SUBSCRIBE_RENEWING);
 			break;
 		case UPNP_EVENT_SUBSCRIPTION_REQUEST:
 			break;
@@ -1259,6 +4948,7 @@ int CtrlPointProcessCommand(char *cmdline)
 	char cmd[MAX_BUFFER]={0};
 	char strarg[NAME_SIZE]={0};
 	int arg1 = -1;
+	int arg2 = -1;
 	int command = -1;
 	int numOfCmds = (sizeof g_cmdList) /sizeof (cmdloop_commands);
 	int i;
@@ -1309,30 +4999,125 @@ int CtrlPointProcessCommand(char *cmdline)
 			break;
 		case GetValues:
 			{
-				char path[NAME_SIZE]={0};
-				validargs = sscanf(cmdline, "%s %d %s", cmd, &arg1, path);
-				action.devnum = arg1;
-				action.serviceType=SERVICE_CONTROL;
-				action.actionType = GetValues;
-				strncpy(action.paramName, path, sizeof(action.paramName)-1 );
-				ret=GetValueSendAction(&action);
-				if(ret<0)	printf("GetValueSendAction failed %d\n",ret);
+				char **paths = NULL;
+				char *token;
+				char *saveptr = NULL;
+				int count = 0;
+				int n = 0;
+
+				rc = 0;
+				validargs = sscanf(cmdline, "%s %s %n", cmd, strarg, &n);
+				arg1 = atoi(strarg);
+				/* The paths and @files after the devnum or devset */
+				token = validargs >= 2 ? strtok_r(cmdline + n, " \t\r\n", &saveptr) : NULL;
+				for (; token && 0 == rc; token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+					if ('@' == token[0])
+						rc = LoadPathFile(token + 1, &paths, &count);
+					else
+						rc = AppendPath(&paths, &count, token);
+				}
+				if (0 == rc && count > 0 && CtrlPointIsDevSet(strarg))
+					ret=CtrlPointFanOut(GetValues, strarg, (const char **)paths, NULL, count);
+				else if (0 == rc && count > 0)
+					ret=GetValuesSendAction(arg1, (const char **)paths, count);
+				if(ret<0)	printf("GetValuesSendAction failed %d\n",ret);
+				FreePaths(paths, count);
 			}
 			break;	
 		case SetValues:
 			{
-				char path[NAME_SIZE]={0};
-				char value[NAME_SIZE]={0};
-				validargs = sscanf(cmdline, "%s %d %s %s", cmd, &arg1, path, value);
-				action.devnum = arg1;
-				action.serviceType=SERVICE_CONTROL;
-				action.actionType = SetValues;
-				strncpy(action.paramName, path, sizeof(action.paramName)-1 );
-				strncpy(action.paramValue, value, sizeof(action.paramValue)-1 );
-				ret=SetValueSendAction(&action);
-				if(ret<0)	printf("GetValueSendAction failed %d\n",ret);
+				char **paths = NULL;
+				char **values = NULL;
+				char *token;
+				char *value;
+				char *saveptr = NULL;
+				int count = 0;
+				int valueCount;
+				int n = 0;
+
+				rc = 0;
+				validargs = sscanf(cmdline, "%s %s %n", cmd, strarg, &n);
+				arg1 = atoi(strarg);
+				/* The path/value pairs and @files after the devnum or devset */
+				token = validargs >= 2 ? strtok_r(cmdline + n, " \t\r\n", &saveptr) : NULL;
+				for (; token && 0 == rc; token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+					if ('@' == token[0]) {
+						rc = LoadParameterFile(token + 1, &paths, &values, &count);
+						continue;
+					}
+					value = strtok_r(NULL, " \t\r\n", &saveptr);
+					if (NULL == value) {
+						printf("No value for %s\n", token);
+						rc = -1;
+						break;
+					}
+					valueCount = count;
+					rc = AppendPath(&values, &valueCount, value);
+					if (0 == rc) {
+						rc = AppendPath(&paths, &count, token);
+						if (rc < 0)
+							free(values[valueCount - 1]);
+					}
+				}
+				if (0 == rc && count > 0 && CtrlPointIsDevSet(strarg))
+					ret=CtrlPointFanOut(SetValues, strarg, (const char **)paths, (const char **)values, count);
+				else if (0 == rc && count > 0)
+					ret=SetValuesSendAction(arg1, (const char **)paths, (const char **)values, count);
+				if(ret<0)	printf("SetValuesSendAction failed %d\n",ret);
+				FreePaths(values, count);
+				FreePaths(paths, count);
 			}
 			break;	
+		case Filter:
+			{
+				char name[NAME_SIZE]={0};
+				char value[NAME_SIZE]={0};
+				validargs = sscanf(cmdline, "%s %s %[^\r\n]", cmd, name, value);
+				CtrlPointSetFilter(name, value);
+			}
+			break;
+		case Option:
+			{
+				char name[NAME_SIZE]={0};
+				char value[NAME_SIZE]={0};
+				validargs = sscanf(cmdline, "%s %s %s", cmd, name, value);
+				CtrlPointSetOption(name, value);
+			}
+			break;
+		case Latency:
+			validargs = sscanf(cmdline, "%s %s", cmd, strarg);
+			CtrlPointPrintLatency(strarg);
+			break;
+		case Stats:
+			{
+				char file[LINE_SIZE]={0};
+				validargs = sscanf(cmdline, "%s %s", cmd, file);
+				if (validargs < 2) {
+					MetricsWrite(stdout);
+					break;
+				}
+				/* The file of the periodic dump too */
+				ithread_mutex_lock(&g_statsFileMutex);
+				strcpy(g_statsFile, file);
+				ithread_mutex_unlock(&g_statsFileMutex);
+				CtrlPointDumpStats(file);
+			}
+			break;
+		case Locks:
+			validargs = sscanf(cmdline, "%s %s", cmd, strarg);
+			CtrlPointPrintLocks(strarg);
+			break;
+		case Cache:
+			validargs = sscanf(cmdline, "%s %d %s", cmd, &arg1, strarg);
+			CtrlPointPrintCache(arg1, strarg);
+			break;
+		case Diff:
+			validargs = sscanf(cmdline, "%s %d %d %s", cmd, &arg1, &arg2, strarg);
+			if (validargs >= 3)
+				CtrlPointDiffCache(arg1, arg2, strarg);
+			else
+				printf("Diff needs two devices\n");
+			break;
 		default:
 			printf("Command not implemented; see 'Help'\n");
 			break;
@@ -1340,6 +5125,7 @@ int CtrlPointProcessCommand(char *cmdline)
 	return 0;
 }
 
+#ifndef CMS_CP_NO_MAIN
 int main(int argc, char **argv)
 {
 	int rc;
@@ -1369,4 +5155,4 @@ int main(int argc, char **argv)
 
 	return rc;
 }
-
+#endif /* CMS_CP_NO_MAIN */
@@ -12,11 +12,15 @@ extern "C" {
 #include "UpnpString.h"
 #include "upnptools.h"
 
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
 
 
 typedef enum {
@@ -26,6 +30,15 @@ typedef enum {
 	GET_VAR_COMPLETE = 3
 } eventType;
 
+/* Life cycle of the GENA subscription of a service */
+typedef enum {
+	SUBSCRIBE_NONE = 0,		/* the service has no eventURL */
+	SUBSCRIBE_PENDING,		/* UpnpSubscribeAsync sent */
+	SUBSCRIBE_SUBSCRIBED,	/* SID known, events are routed */
+	SUBSCRIBE_RENEWING,		/* auto renewal failed, subscribing again */
+	SUBSCRIBE_FAILED		/* retried from the timer thread */
+} subscribeState;
+
 
 #define CONTROL_VARCOUNT	(6)
 #define CP_MAXVARS			CONTROL_VARCOUNT
@@ -33,6 +46,22 @@ typedef enum {
 #define SERVICE_SERVCOUNT	(1)
 #define SERVICE_CONTROL		(0)
 #define MAX_VAL_LEN			(1024)
+#define DEVICE_HASH_SIZE	(4096)	/* buckets per device index, power of 2 */
+#define MAX_ACTION_SIZE		(16384)	/* default bound of a GetValues/SetValues list */
+#define MAX_IN_FLIGHT		(64)	/* default window of a fan-out */
+#define DEVICE_RENEW_LEAD	(60)	/* search for a device this long before it expires */
+#define DEVICE_RENEW_JITTER	(20)	/* ...less up to this, depending on the UDN */
+#define SEARCH_RATE			(10)	/* default budget of renewal searches per second */
+#define RENEW_BURST			(16)	/* default renewals due at once for a type search */
+#define SUBSCRIBE_RETRY_DELAY	(30)	/* seconds before a failed subscription is retried */
+#define REJECTED_PURGE_PERIOD	(30)	/* seconds between purges of the rejected locations */
+#define CACHE_MAX_AGE		(0)		/* default age of a cached value GetValues answers with, 0 for none */
+#define DISPATCH_QUEUE_SIZE	(4096)	/* slots of the ring of a dispatch worker, power of 2 */
+#define DISPATCH_DEPTH		(1024)	/* default events queued per worker before the policy applies */
+#define DISPATCH_WORKERS	(4)		/* default threads processing the queued events */
+#define DISPATCH_MAX_WORKERS	(64)
+#define INTERN_HASH_SIZE	(4096)	/* buckets of the path component table, power of 2 */
+#define PARAMETER_MAX_DEPTH	(32)	/* components of a cached parameter path */
 
 struct Service {
     char serviceId[NAME_SIZE];
@@ -41,6 +70,10 @@ struct Service {
     char eventURL[NAME_SIZE];
     char controlURL[NAME_SIZE];
     char SID[NAME_SIZE];
+    subscribeState subState;
+    int  subTimeOut;
+    int  eventKey;	/* last EventKey applied for SID, -1 before the first */
+    int  resync;	/* a GetVar of ConfigurationUpdate is in flight after missed events */
 };
 
 struct Device {
@@ -48,13 +81,85 @@ struct Device {
     char descDocURL[NAME_SIZE];
     char friendlyName[NAME_SIZE];
     char presURL[NAME_SIZE];
-    int  advrTimeOut;
+    int  advrTimeOut;		/* max-age of the last advertisement */
     struct Service service[SERVICE_SERVCOUNT];
 };
 
+/* A parameter value last seen in an event or a GetValues answer */
+struct CachedParameter {
+	char *value;
+	time_t updated;		/* when it was seen, 0 once it is known to be stale */
+	long version;		/* ConfigurationUpdate version it was seen with */
+};
+
+/* Node of the parameter tree of a device. The edge from the parent carries
+ * one or more interned path components, a chain without branches or values
+ * taking a single node. */
+struct ParameterNode {
+	const char **label;		/* interned components of the edge from the parent */
+	int labelCount;
+	struct ParameterNode **children;	/* sorted by the address of their first component */
+	int childCount;
+	struct CachedParameter *param;	/* NULL if no value ends here */
+};
+
+/* Parameter values of a device, in a radix tree of their paths */
+struct ParameterCache {
+	struct ParameterNode root;	/* with an empty label */
+	int count;			/* values in the tree */
+	long version;		/* last ConfigurationUpdate version, -1 before any */
+	const char *owner;	/* UDN changes are notified for, NULL for none */
+};
+
+/* Interned path component */
+struct InternEntry {
+	char *name;
+	struct InternEntry *next;
+};
+
 struct DeviceNode {
     struct Device device;
+    ithread_mutex_t mutex;	/* guards the service state and the cache of the device */
+    struct ParameterCache cache;
+    /* Timer state, guarded by g_timerMutex */
+    time_t expireTime;		/* the advertisement expires */
+    time_t renewTime;		/* a search is sent to renew the advertisement */
+    time_t retryTime;		/* failed subscriptions are retried, 0 if none */
+    time_t deadline;		/* the earliest of the above, key of the heap */
+    int renewSent;			/* a search for the UDN was sent */
+    int heapIndex;			/* position in the timer heap, -1 if not in it */
+    struct LatencyHistogram *latency;	/* made on the first answer, NULL before */
     struct DeviceNode *next;
+    struct DeviceNode *prev;
+};
+
+/* One key of a device index. The key string is owned by the device node. */
+struct IndexEntry {
+	const char *key;
+	struct DeviceNode *node;
+	int service;
+	struct IndexEntry *next;
+};
+
+/* Chained hash table from a string key to a device node (and service) */
+struct DeviceIndex {
+	struct IndexEntry *bucket[DEVICE_HASH_SIZE];
+	int count;
+};
+
+/* A subscription of a deleted device, cancelled once the list is unlocked */
+struct OrphanSID {
+	Upnp_SID SID;
+	int service;
+	struct OrphanSID *next;
+};
+
+/* One SID, controlURL or eventURL of a device and the hash of its UDN,
+ * copied so that it is looked up without the device list lock */
+struct DispatchRoute {
+	char *key;
+	unsigned int hash;
+	struct DispatchRoute *next;
 };
 
 typedef struct{
@@ -65,6 +170,159 @@ typedef struct{
 	char paramValue[NAME_SIZE];
 }ActionParam;
 
+/* Result of one device of a fan-out */
+struct FanOutResult {
+	int devnum;
+	int pending;	/* actions not completed yet */
+	int errCode;	/* first error, UPNP_E_SUCCESS if none */
+	double start;
+	double latency;	/* seconds from the first send to the last answer */
+};
+
+/* A command sent to a set of devices, with at most maxInFlight actions outstanding */
+struct FanOut {
+	int actionType;
+	int count;			/* devices */
+	int done;			/* devices whose actions all completed */
+	int dispatching;	/* actions are still being sent */
+	int inFlight;
+	int maxInFlight;
+	int parameters;		/* parameters returned by GetValues */
+	char **paths;		/* shared by the requests of the fan-out */
+	int pathCount;
+	double start;
+	ithread_mutex_t mutex;
+	ithread_cond_t cond;	/* signalled when an action completes */
+	struct FanOutResult *results;
+};
+
+/* A device selected by a fan-out */
+struct FanOutTarget {
+	int devnum;
+	char UDN[NAME_SIZE];
+	char controlURL[NAME_SIZE];
+};
+
+#define LATENCY_SUB_COUNT	(16)	/* buckets of each power of two, doubled below it */
+#define LATENCY_BUCKETS		(16 + 8 * 32)	/* up to 2^36 us, about 19 hours */
+
+/*
+ * Log-linear histogram of latencies in microseconds, within 1/8 of the
+ * value above LATENCY_SUB_COUNT. Updated with atomic adds, never locked.
+ */
+struct LatencyHistogram {
+	unsigned long counts[LATENCY_BUCKETS];
+	unsigned long errors;
+	unsigned long sumUs;
+	unsigned long maxUs;
+};
+
+#define STATS_FILE	"cms_cp.prom"	/* default file of the Stats command */
+
+/* Counters of the control point, exported by name in g_metricList */
+enum MetricId {
+	METRIC_EVENTS_RECEIVED,
+	METRIC_EVENTS_ROUTED,
+	METRIC_EVENTS_UNKNOWN_SID,
+	METRIC_DESCRIPTIONS_DOWNLOADED,
+	METRIC_DESCRIPTION_ERRORS,
+	METRIC_SUBSCRIBE_FAILURES,
+	METRIC_RENEW_FAILURES,
+	METRIC_ACTIONS_SENT,
+	METRIC_ACTIONS_COMPLETED,
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_MISSES,
+	METRIC_DISPATCH_QUEUED,
+	METRIC_DISPATCH_DROPPED,
+	METRIC_DISPATCH_BLOCKED,
+	METRIC_EVENTS_STALE,
+	METRIC_EVENTS_MISSED,
+	METRIC_RESYNCS,
+	METRIC_PARAMETERS_CHANGED,
+	METRIC_PARAMETERS_UNCHANGED,
+	METRIC_COUNT
+};
+
+/* The counters of one thread, summed over all threads on read */
+struct MetricSlot {
+	unsigned long counts[METRIC_COUNT];
+	struct MetricSlot *next;
+};
+
+extern ithread_rwlock_t g_deviceListLock;
+extern int (*g_downloadXmlDoc)(const char *url, IXML_Document **xmlDoc);
+
+#ifdef CMS_LOCK_PROFILE
+/* ithread has no try variants of its rwlocks, which are mutexes where
+ * UPNP_USE_RWLOCK is 0 */
+#if defined(UPNP_USE_RWLOCK) && !UPNP_USE_RWLOCK
+#define ithread_rwlock_tryrdlock	ithread_mutex_trylock
+#define ithread_rwlock_trywrlock	ithread_mutex_trylock
+#else
+#define ithread_rwlock_tryrdlock	pthread_rwlock_tryrdlock
+#define ithread_rwlock_trywrlock	pthread_rwlock_trywrlock
+#endif
+
+#define LOCK_PROFILE_DEPTH	(8)	/* locks held at once by a thread that are timed */
+#define LOCK_PROFILE_TOP	(8)	/* longest holds kept */
+
+/* Waits and holds of the device list lock at one call site */
+struct LockSite {
+	const char *file;
+	int line;
+	const char *func;
+	const char *kind;		/* "rd" or "wr" */
+	int registered;			/* pushed on g_lockSites */
+	unsigned long acquired;
+	unsigned long contended;	/* acquisitions that had to wait */
+	unsigned long waitUs;
+	unsigned long maxWaitUs;
+	unsigned long holdUs;
+	unsigned long maxHoldUs;
+	struct LockSite *next;
+};
+
+/* One of the longest holds */
+struct LockHold {
+	struct LockSite *site;
+	unsigned long holdUs;
+	time_t when;
+};
+
+#define LOCK_PROFILE_SITE(kind) \
+	static struct LockSite lockSite_ = { __FILE__, __LINE__, __func__, kind, 0, 0, 0, 0, 0, 0, 0, NULL }
+#define DEVICE_LIST_RDLOCK() \
+	do { LOCK_PROFILE_SITE("rd"); LockProfileRdLock(&g_deviceListLock, &lockSite_); } while (0)
+#define DEVICE_LIST_WRLOCK() \
+	do { LOCK_PROFILE_SITE("wr"); LockProfileWrLock(&g_deviceListLock, &lockSite_); } while (0)
+#define DEVICE_LIST_UNLOCK()	LockProfileUnlock(&g_deviceListLock)
+
+void LockProfileRdLock(ithread_rwlock_t *lock, struct LockSite *site);
+void LockProfileWrLock(ithread_rwlock_t *lock, struct LockSite *site);
+void LockProfileUnlock(ithread_rwlock_t *lock);
+void LockProfileAcquired(void *lock, struct LockSite *site, double start, int contended);
+int CompareLockSite(const void *a, const void *b);
+#else
+#define DEVICE_LIST_RDLOCK()	ithread_rwlock_rdlock(&g_deviceListLock)
+#define DEVICE_LIST_WRLOCK()	ithread_rwlock_wrlock(&g_deviceListLock)
+#define DEVICE_LIST_UNLOCK()	ithread_rwlock_unlock(&g_deviceListLock)
+#endif
+
+/* Context of an action or GetVar in flight, passed to libupnp as the cookie */
+struct ActionRequest {
+	int actionType;
+	int devnum;
+	char UDN[NAME_SIZE];
+	int count;		/* number of paths */
+	char **paths;	/* paths asked for */
+	int ownsPaths;	/* else the paths belong to the fan-out */
+	int *found;		/* parameters returned for each path */
+	double sendTime;
+	struct FanOut *fanOut;	/* NULL for a single device */
+	int slot;		/* index of the device in the fan-out */
+	struct ParameterCache *cache;	/* of the device, while its answer is parsed */
+};
+
 /**
 * @fn int str_sub(char *st, char *orig, char *repl)
 * @brief substitute a substring by another substring into a string
@@ -75,22 +333,180 @@ typedef struct{
 */
 char *str_sub(const char *st, const char *orig, char *repl) ;
 
+/**
+* @fn const char *FindEntityChar(const char *st, const char *end, int escape)
+* @brief find the first '&' in [st, end), or with escape set the first
+* character Escaped replaces, 16 or 32 bytes at a time with SSE2 or AVX2
+* @return the character found, or end
+*/
+const char *FindEntityChar(const char *st, const char *end, int escape);
+
+const char *EntityOf(char ch);
+
 /**
 * @fn char *Escaped(const char *st) 
-* @brief unescaped a string
+* @brief escape & ' < > " in a single pass, the result being sized first
 * @param st   : string
-* @return the Eescaped string
+* @return the Eescaped string, to be freed by the caller
 */
 char *Escaped(const char *st) ;
 
 /**
 * @fn char *Unescaped(const char *st) 
-* @brief unescaped a string
+* @brief decode the predefined and numeric entities in a single pass;
+* "&amp;lt;" gives "&lt;", each entity is decoded once
 * @param st   : string
-* @return the Unescaped string
+* @return the Unescaped string, to be freed by the caller
 */
 char *Unescaped(const char *st);
 
+/*! Growable string buffer */
+struct StrBuf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+void StrBufInit(struct StrBuf *buf);
+void StrBufReset(struct StrBuf *buf);
+void StrBufFree(struct StrBuf *buf);
+
+/**
+* @fn int StrBufAppend(struct StrBuf *buf, const char *st, size_t len)
+* @brief append len bytes of st, keeping the buffer NUL terminated
+* @return 0 on success, -1 if out of memory
+*/
+int StrBufAppend(struct StrBuf *buf, const char *st, size_t len);
+
+/**
+* @fn int StrBufAppendDecoded(struct StrBuf *buf, const char *st, const char *end)
+* @brief append the character data [st, end), decoding the predefined and
+* numeric entities
+* @return 0 on success, -1 if out of memory
+*/
+int StrBufAppendDecoded(struct StrBuf *buf, const char *st, const char *end);
+
+int DecodeEntity(const char *name, size_t len, char *out);
+int TagNameIs(const char *name, size_t len, const char *tag);
+
+/*! The fields of a ConfigurationUpdate value, pointing into the value */
+struct ConfigurationUpdate {
+	const char *version;
+	size_t versionLen;
+	const char *dateTime;
+	size_t dateTimeLen;
+	/*! The ParameterValueList document up to the end of the value, or NULL */
+	const char *xml;
+};
+
+/**
+* @fn int ParseConfigurationUpdate(const char *st, struct ConfigurationUpdate *update)
+* @brief split a "version,dateTime[,xml]" value without copying it
+* @return 0 on success, -1 if st has no version
+*/
+int ParseConfigurationUpdate(const char *st, struct ConfigurationUpdate *update);
+
+/*! Receives the path and value of a Parameter, both entity decoded */
+typedef void (*ParameterCallback)(const char *path, const char *value, void *cookie);
+
+/**
+* @fn int ParseParameterValueList(const char *xml, ParameterCallback callback, void *cookie)
+* @brief stream a cms:ParameterValueList document, calling callback for each
+* Parameter as soon as it is closed, without building a DOM
+* @return the number of parameters, -1 if the document is truncated
+*/
+int ParseParameterValueList(const char *xml, ParameterCallback callback, void *cookie);
+
+/**
+* @fn const char *ParameterIntern(const char *name, int add)
+* @brief the shared copy of a path component, so that components compare by
+* address; with add unset, a name never seen is not added
+* @return the interned name, NULL if not found or out of memory
+*/
+const char *ParameterIntern(const char *name, int add);
+
+const char *ParameterInternFind(const char *name);
+
+/*! \brief Free the interned components, once no tree is left */
+void ParameterInternClear(void);
+
+/**
+* @fn int ParameterSplitPath(const char *path, const char **components, int add)
+* @brief split path at '/' into at most PARAMETER_MAX_DEPTH interned components
+* @return the number of components, -1 if too long or one was never interned
+*/
+int ParameterSplitPath(const char *path, const char **components, int add);
+
+int ParameterNodeChild(const struct ParameterNode *node, const char *component, int *pos);
+struct ParameterNode *ParameterNodeFind(struct ParameterCache *cache, const char **components, int count);
+struct ParameterNode *ParameterNodeNew(const char **label, int labelCount);
+int ParameterNodeAddChild(struct ParameterNode *node, struct ParameterNode *child, int pos);
+int ParameterNodeRemove(struct ParameterNode *node, const char **components, int count);
+void ParameterNodeFree(struct ParameterNode *node);
+void ParameterNodeStale(struct ParameterNode *node);
+
+/*! Receives the path and the cached value of a parameter */
+typedef void (*CachedParameterCallback)(const char *path, const struct CachedParameter *param, void *cookie);
+
+int ParameterNodeWalk(struct ParameterNode *node, struct StrBuf *path, CachedParameterCallback callback, void *cookie);
+
+/**
+* @fn int ParameterCacheWalk(struct ParameterCache *cache, const char *prefix, CachedParameterCallback callback, void *cookie)
+* @brief call callback for each value under prefix, all of them if prefix is
+* NULL, in the order of the tree
+* @return the number of values, -1 if out of memory
+*/
+int ParameterCacheWalk(struct ParameterCache *cache, const char *prefix, CachedParameterCallback callback, void *cookie);
+
+/**
+* @fn struct CachedParameter *ParameterCacheFind(struct ParameterCache *cache, const char *path)
+* @brief look path up in the tree, one node per branch point
+* @return the entry, NULL if path is not cached
+*/
+struct CachedParameter *ParameterCacheFind(struct ParameterCache *cache, const char *path);
+
+/**
+* @fn int ParameterCacheUpdate(struct ParameterCache *cache, const char *path, const char *value, long version, time_t now, char **previous)
+* @brief set the value of path, inserting it in order if it is new; when
+* previous is not NULL it gets the value replaced, to be freed, or NULL
+* @return 1 if the value is new or changed, 0 if it is the same, -1 if out of memory
+*/
+int ParameterCacheUpdate(struct ParameterCache *cache, const char *path, const char *value, long version, time_t now,
+	char **previous);
+
+/**
+* @fn int ParameterCacheChange(struct ParameterCache *cache, const char *path, const char *value)
+* @brief cache a value with the version of the cache, calling
+* NotifyParameterChange for the owner of the cache if it is new or changed
+* @return as ParameterCacheUpdate
+*/
+int ParameterCacheChange(struct ParameterCache *cache, const char *path, const char *value);
+
+/**
+* @fn int ParameterCacheApply(struct ParameterCache *cache, const char *configurationUpdate)
+* @brief take a "version,dateTime[,xml]" value into the cache: the values of
+* the xml are cached, a new version without them makes every value stale
+* @return 0 if taken, 1 if older than the version of the cache and dropped,
+* -1 if it cannot be parsed
+*/
+int ParameterCacheApply(struct ParameterCache *cache, const char *configurationUpdate);
+
+/*! \brief ParameterCallback caching a value with the version of the cache */
+void ParameterCacheCallback(const char *path, const char *value, void *cookie);
+
+/*! \brief Whether version comes before current, the ui4 version wrapping to 0 */
+int ParameterVersionOlder(long version, long current);
+
+/*! \brief Take the version of update, making every value stale when it
+ * does not follow the last one or comes without a ParameterValueList */
+void ParameterCacheSetVersion(struct ParameterCache *cache, const struct ConfigurationUpdate *update);
+
+/*! \brief Remove path from the cache, after it was set on the device */
+void ParameterCacheRemove(struct ParameterCache *cache, const char *path);
+
+/*! \brief Free the entries of the cache, leaving it empty */
+void ParameterCacheFree(struct ParameterCache *cache);
+
 /*!
  * \brief Given a DOM node such as <Channel>11</Channel>, this routine
  * extracts the value (e.g., 11) from the node and returns it as 
@@ -102,6 +518,14 @@ char *GetElementValue(
 	/*! [in] The DOM node from which to extract the value. */
 	IXML_Element *element);
 
+/*!
+ * \brief Same as GetElementValue, but returns the text of the node itself,
+ * which lives as long as the document.
+ */
+const char *GetElementText(
+	/*! [in] The DOM node from which to extract the value. */
+	IXML_Element *element);
+
 /*!
  * \brief Given a document node, this routine searches for the first element
  * named by the input string item, and returns its value as a string.
@@ -157,6 +581,142 @@ void NotifyStateUpdate(
 	/*! [in] . */
 	eventType type);
 
+/*!
+ * \brief Called for each parameter of a device whose value is new or
+ * differs from the one last received, from an event, a GetVar or a
+ * GetValues answer.
+ */
+void NotifyParameterChange(
+	/*! [in] The UDN of the device. */
+	const char *UDN,
+	/*! [in] The path of the parameter. */
+	const char *path,
+	/*! [in] The value it had, NULL if it was not known. */
+	const char *oldValue,
+	/*! [in] The value it has now. */
+	const char *newValue,
+	/*! [in] The ConfigurationUpdate version the value was received with. */
+	long version);
+
+/*!
+ * \brief FNV-1a hash of a NUL terminated string.
+ */
+unsigned int HashString(const char *str);
+
+/*!
+ * \brief Add a key to a device index. Empty keys are ignored.
+ *
+ * \return 0 on success, -1 if out of memory.
+ */
+int IndexInsert(
+	/*! [in] The index to update. */
+	struct DeviceIndex *index,
+	/*! [in] The key, it must stay valid until it is removed. */
+	const char *key,
+	/*! [in] The device node the key belongs to. */
+	struct DeviceNode *node,
+	/*! [in] The service of the device the key belongs to. */
+	int service);
+
+/*!
+ * \brief Find the device node for a key in a device index.
+ *
+ * \return The device node, or NULL if the key is unknown.
+ */
+struct DeviceNode *IndexLookup(
+	/*! [in] The index to search. */
+	struct DeviceIndex *index,
+	/*! [in] The key to search for. */
+	const char *key,
+	/*! [out] The service the key belongs to, may be NULL. */
+	int *service);
+
+/*!
+ * \brief Remove the key of a device node from a device index.
+ *
+ * \return 0 if the key was removed, -1 if it was not found.
+ */
+int IndexRemove(
+	/*! [in] The index to update. */
+	struct DeviceIndex *index,
+	/*! [in] The key to remove. */
+	const char *key,
+	/*! [in] The device node the key belongs to. */
+	const struct DeviceNode *node);
+
+/*!
+ * \brief Remove all keys from a device index.
+ */
+void IndexClear(struct DeviceIndex *index);
+
+/*!
+ * \brief Route the events with key to the worker of the device UDN. Empty
+ * keys are ignored. Takes g_dispatchRouteMutex.
+ *
+ * \return 0 on success, -1 if out of memory.
+ */
+int DispatchRouteAdd(const char *key, const char *UDN);
+
+/*!
+ * \brief Find the hash of the UDN the events with key are routed to.
+ *
+ * \return 0 if the key is known, -1 if not.
+ */
+int DispatchRouteLookup(const char *key, unsigned int *hash);
+
+/*! \brief Remove the route of key to the device UDN, if any. */
+void DispatchRouteRemove(const char *key, const char *UDN);
+
+/*! \brief Remove all routes. */
+void DispatchRouteClear(void);
+
+/*!
+ * \brief Allocate a device node with an empty state table. The node is not
+ * inserted in the global device list.
+ *
+ * \return The new device node, or NULL if out of memory.
+ */
+struct DeviceNode *CtrlPointCreateNode(
+	/*! [in] The Unique Device Name of the device. */
+	const char *UDN,
+	/*! [in] The location of the description document. */
+	const char *location,
+	/*! [in] The friendly name of the device. */
+	const char *friendlyName,
+	/*! [in] The presentation URL of the device. */
+	const char *presURL,
+	/*! [in] The expiration time of the advertisement. */
+	int expires);
+
+/********************************************************************************
+* CtrlPointInsertNode
+*
+* Description:
+*       Append a device node to the tail of the global device list and add it
+*       to the device indexes.  Note that this function is NOT thread safe,
+*       and should be called from another function that has already locked
+*       the global device list.
+*
+* Parameters:
+*   node -- The device node
+*
+********************************************************************************/
+int	CtrlPointInsertNode(struct DeviceNode *);
+
+/********************************************************************************
+* CtrlPointUnlinkNode
+*
+* Description:
+*       Unlink a device node from the global device list and the device
+*       indexes without freeing it.  Note that this function is NOT thread
+*       safe, and should be called from another function that has already
+*       locked the global device list.
+*
+* Parameters:
+*   node -- The device node
+*
+********************************************************************************/
+void	CtrlPointUnlinkNode(struct DeviceNode *);
 
 /********************************************************************************
 * CtrlPointDeleteNode
@@ -168,9 +728,25 @@ void NotifyStateUpdate(
 *
 * Parameters:
 *   node -- The device node
+*   orphans -- Where the SIDs of the node are moved to, for
+*       CtrlPointUnsubscribeOrphans once the list is unlocked.
+*       NULL to unsubscribe here, waiting for the device.
+*
+********************************************************************************/
+int	CtrlPointDeleteNode(struct DeviceNode *, struct OrphanSID **);
+
+/********************************************************************************
+* CtrlPointUnsubscribeOrphans
+*
+* Description: 
+*       Cancel the subscriptions of deleted devices without waiting for
+*       the devices, and free the list. Called without the device list lock.
+*
+* Parameters:
+*   orphans -- The SIDs collected by CtrlPointDeleteNode
 *
 ********************************************************************************/
-int	CtrlPointDeleteNode(struct DeviceNode *);
+void	CtrlPointUnsubscribeOrphans(struct OrphanSID *);
 
 /********************************************************************************
 * CtrlPointRemoveDevice
@@ -225,6 +801,14 @@ int	CtrlPointRefresh(void);
 ********************************************************************************/
 int	CtrlPointGetVar(int, int, const char *);
 
+/*!
+ * \brief Send a GetVar request to a service of a device node, with the
+ * device list locked.
+ *
+ * \return 0 if the request was sent, -1 otherwise.
+ */
+int CtrlPointSendGetVar(struct DeviceNode *devNode, int devnum, int service, const char *varname);
+
 /********************************************************************************
 * CtrlPointGetDevice
 *
@@ -281,16 +865,87 @@ int	CtrlPointPrintDevice(int);
 *   location -- The location of the description document URL
 *   expires -- The expiration time for this advertisement
 *
+* Returns:
+*   0 if the device is managed, -1 if its deviceType or friendlyName do
+*   not match the discovery filter.
+*
 ********************************************************************************/
-void	CtrlPointAddDevice(IXML_Document *, const char *, int); 
+int	CtrlPointAddDevice(IXML_Document *, const char *, int); 
+
+/*!
+ * \brief Refresh the advertisement timeout of a known device without
+ * downloading its description again. The device is found by the UDN of
+ * the advertisement, or by its location for embedded devices and services.
+ *
+ * \return 0 if the device is known at this location, else -1 and the
+ * description document has to be downloaded.
+ */
+int CtrlPointRefreshDevice(
+	/*! [in] The DeviceId of the advertisement. */
+	const char *UDN,
+	/*! [in] The location of the description document. */
+	const char *location,
+	/*! [in] The expiration time for this advertisement. */
+	int expires);
+
+/*!
+ * \brief First stage of the discovery filter, run on the SSDP fields before
+ * the description is downloaded. Rejects adverts for other device types
+ * or service types, and locations rejected by CtrlPointRejectLocation.
+ *
+ * \return 0 if the description should be downloaded, else -1.
+ */
+int CtrlPointFilterDiscovery(const struct Upnp_Discovery *dEvent);
+
+/*!
+ * \brief Remember a location whose description did not match the filter,
+ * so that it is not downloaded again until the advertisement expires.
+ */
+void CtrlPointRejectLocation(
+	/*! [in] The location of the description document. */
+	const char *location,
+	/*! [in] The expiration time of the advertisement. */
+	int expires);
+
+/*!
+ * \brief Forget the rejected locations that have expired, or all of them.
+ */
+void CtrlPointPurgeRejected(int all);
+
+/*!
+ * \brief Print the discovery filter if name is empty, or change it.
+ * Changing the filter forgets the rejected locations.
+ *
+ * \return 0 on success, -1 for an unknown filter name.
+ */
+int CtrlPointSetFilter(
+	/*! [in] "deviceType", "friendlyName", "clear" or empty. */
+	const char *name,
+	/*! [in] The new value. */
+	const char *value);
+
+/*!
+ * \brief Claim the download of a description document, so that the many
+ * advertisements a device sends at once cause a single download.
+ *
+ * \return 0 if the caller should download it, -1 if it is in progress.
+ */
+int CtrlPointBeginDownload(const char *location);
+
+/*!
+ * \brief Release a download claimed by CtrlPointBeginDownload.
+ */
+void CtrlPointEndDownload(const char *location);
 
+/* varValue is NULL when the GetVar failed */
 void  CtrlPointHandleGetVar(const char *, const char *, const DOMString);
 
 /*!
  * \brief Update a state table. Called when an event is received.
  *
  * Note: this function is NOT thread save. It must be called from another
- * function that has locked the global device list.
+ * function that has locked the global device list for reading and holds
+ * the mutex of the device node.
  **/
 void StateVarUpdate(
 	/*! [in] The UDN of the parent device. */
@@ -300,7 +955,9 @@ void StateVarUpdate(
 	/*! [out] DOM document representing the XML received with the event. */
 	IXML_Document *changedVariables,
 	/*! [out] pointer to the state table for the  service to update. */
-	char **state);
+	char **state,
+	/*! [out] the parameter cache of the device, or NULL. */
+	struct ParameterCache *cache);
 
 
 /********************************************************************************
@@ -316,15 +973,23 @@ void StateVarUpdate(
 *   changes -- The DOM document representing the changes
 *
 ********************************************************************************/
-void	CtrlPointHandleEvent(const char *, int, IXML_Document *); 
+void	CtrlPointHandleEvent(const char *, int, IXML_Document *);
+
+/*!
+ * \brief Check an EventKey against the last one applied for a subscription.
+ *
+ * \return The number of events missed in between, -1 if the event is a
+ * duplicate or older than the last one.
+ */
+int EventKeyMissed(int last, int key); 
 
 /********************************************************************************
 * CtrlPointHandleSubscribeUpdate
 *
 * Description: 
 *       Handle a UPnP subscription update that was received.  Find the 
-*       service the update belongs to, and update its subscription
-*       timeout.
+*       service the update belongs to, and update its SID, subscription
+*       state and timeout.
 *
 * Parameters:
 *   eventURL -- The event URL for the subscription
@@ -334,14 +999,129 @@ void	CtrlPointHandleEvent(const char *, int, IXML_Document *);
 ********************************************************************************/
 void	CtrlPointHandleSubscribeUpdate(const char *, const Upnp_SID, int); 
 
+/*!
+ * \brief Mark the subscription of a service as failed after an unsuccessful
+ * UPNP_EVENT_SUBSCRIBE_COMPLETE or UPNP_EVENT_RENEWAL_COMPLETE. Failed
+ * subscriptions are retried by CtrlPointVerifyTimeouts.
+ */
+void CtrlPointHandleSubscribeFailed(
+	/*! [in] The event URL of the subscription. */
+	const char *eventURL,
+	/*! [in] The error reported by the SDK. */
+	int errCode);
+
+/*!
+ * \brief Start an asynchronous subscription to the service owning eventURL.
+ * The SID is filled in by CtrlPointHandleSubscribeUpdate when
+ * UPNP_EVENT_SUBSCRIBE_COMPLETE arrives. Must be called without the global
+ * device list locked.
+ *
+ * \return 0 if the request was sent, else -1.
+ */
+int CtrlPointSubscribe(
+	/*! [in] The event URL of the service. */
+	const char *eventURL,
+	/*! [in] SUBSCRIBE_PENDING or SUBSCRIBE_RENEWING. */
+	subscribeState state);
+
+
+/* What a full dispatch queue does with a new event */
+typedef enum {
+	DISPATCH_BLOCK = 0,		/* the SDK thread waits for room */
+	DISPATCH_DROP_DISCOVERY,	/* adverts and search results are dropped, they come again */
+	DISPATCH_DROP_EVENTS,	/* GENA events are dropped as well */
+} dispatchPolicy;
+
+/* A callback event copied for the dispatch workers */
+struct DispatchItem {
+	Upnp_EventType type;
+	void *cookie;
+	double queueTime;
+	union {
+		struct Upnp_Discovery discovery;
+		struct Upnp_Event event;
+		struct Upnp_Action_Complete action;
+		struct Upnp_State_Var_Complete stateVar;
+		struct Upnp_Event_Subscribe subscribe;
+	} u;
+};
+
+/* The ring of one dispatch worker. Events are hashed to a worker by their
+ * device, so those of a device are processed in order. */
+struct DispatchShard {
+	ithread_mutex_t mutex;
+	ithread_cond_t notEmpty;
+	ithread_cond_t notFull;
+	struct DispatchItem *ring[DISPATCH_QUEUE_SIZE];
+	int head;
+	int count;
+	int highWater;
+	int run;				/* cleared to stop the worker once the ring is empty */
+	unsigned long processed;	/* written by the worker only */
+	ithread_t thread;
+};
+
+/*!
+ * \brief Copy an event of the SDK into a DispatchItem, cloning the documents
+ * and strings the SDK frees when the callback returns.
+ *
+ * \return The item, NULL for other event types or when out of memory.
+ */
+struct DispatchItem *CtrlPointCopyEvent(Upnp_EventType eventType, const void *event, void *cookie);
+void CtrlPointFreeItem(struct DispatchItem *item);
+
+/*!
+ * \brief The key of an event: the UDN of adverts and of actions sent with an
+ * ActionRequest, else the SID, eventURL or controlURL of the event, which
+ * the dispatch routes map to its device.
+ */
+const char *CtrlPointDispatchKey(Upnp_EventType eventType, const void *event, void *cookie,
+	/*! [out] The index of the key in the device list, NULL if it is a UDN. */
+	struct DeviceIndex **index);
+
+/*!
+ * \brief The hash that picks the worker of an event: that of the UDN of its
+ * device, so the events of a device are processed in order, or that of its
+ * key when the device is not known. Only the dispatch routes are looked up,
+ * not the device list, so that SDK threads do not wait for its lock.
+ */
+unsigned int CtrlPointDispatchHash(Upnp_EventType eventType, const void *event, void *cookie);
+
+/*!
+ * \brief Queue an event for the worker of its key, applying g_dispatchPolicy
+ * when g_dispatchDepth events are already queued there.
+ *
+ * \return 0 if the event was queued or dropped, -1 if the caller must
+ * process it itself.
+ */
+int CtrlPointDispatch(Upnp_EventType eventType, const void *event, void *cookie);
+void *CtrlPointDispatchLoop(void *arg);
+
+/*!
+ * \brief Replace the workers by g_dispatchWorkers new ones, once the events
+ * queued for the old ones are processed.
+ */
+void CtrlPointResizeDispatch(void);
+
+/*! \brief Start g_dispatchWorkers workers, the callback then queues events */
+void CtrlPointStartDispatch(void);
+
+/*! \brief Stop the workers once the queued events are processed */
+void CtrlPointStopDispatch(void);
+
+/*!
+ * \brief Process an event of the SDK, on the SDK thread or on a dispatch
+ * worker. Passes the request on to the appropriate function.
+ */
+int CtrlPointProcessEvent(Upnp_EventType eventType, void *event, void *cookie);
 
 /********************************************************************************
 * CtrlPointCallbackEventHandler
 *
 * Description: 
 *       The callback handler registered with the SDK while registering
-*       the control point.  Detects the type of callback, and passes the 
-*       request on to the appropriate function.
+*       the control point.  Queues the event for the dispatch workers, or
+*       processes it in place when there are none.
 *
 * Parameters:
 *   eventType -- The type of callback event
@@ -352,23 +1132,56 @@ void	CtrlPointHandleSubscribeUpdate(const char *, const Upnp_SID, int);
 int	CtrlPointCallbackEventHandler(Upnp_EventType, void *, void *);
 
 /*!
- * \brief Checks the advertisement each device in the global device list.
+ * \brief Handles the devices of the timer heap whose deadline has come.
  *
  * If an advertisement expires, the device is removed from the list.
  *
  * If an advertisement is about to expire, a search request is sent for that
- * device.
+ * device. When more devices are due at once than g_renewBurst or the search
+ * budget allow, one search for the device type renews all of them.
+ *
+ * Failed subscriptions of the device are retried.
  */
 void CtrlPointVerifyTimeouts(
-	/*! [in] The increment to subtract from the timeouts each time the
-	 * function is called. */
-	int incr);
+	/*! [in] The current time. */
+	time_t now);
+
+/*!
+ * \brief Put a device in the timer heap, or move it, on its next deadline.
+ * The caller holds g_timerMutex.
+ */
+int CtrlPointScheduleNode(struct DeviceNode *node);
+
+/*!
+ * \brief Restart the advertisement timeout of a device for expires seconds.
+ */
+void CtrlPointRenewNode(struct DeviceNode *node, int expires);
+
+/*!
+ * \brief The time the renewal search of a device is due, DEVICE_RENEW_LEAD
+ * before it expires plus a jitter derived from its UDN.
+ */
+time_t CtrlPointRenewTime(struct DeviceNode *node);
+
+/*!
+ * \brief Take count searches from the budget of g_searchRate per second.
+ * The caller holds g_timerMutex.
+ *
+ * \return 0 if the budget allows them, else -1 and nothing is taken.
+ */
+int CtrlPointTakeSearchTokens(int count);
+
+void TimerHeapSwap(int i, int j);
+void TimerHeapUp(int i);
+void TimerHeapDown(int i);
+void TimerHeapRemove(struct DeviceNode *node);
 
 void* CtrlPointCommandLoop(void *);
 
 /*!
 * \brief Function that runs in its own thread and monitors advertisement
 * and subscription timeouts for devices in the global device list.
+* It sleeps until the earliest deadline of the timer heap.
 */
 void *CtrlPointTimerLoop(void *args);
 
@@ -392,6 +1205,256 @@ void CtrlPointPrintHelp(void);
  */
 void *CtrlPointCommandLoop(void *args);
 
+void PrintParameter(const char *path, const char *value, void *cookie);
+
+/*!
+ * \brief Read the values of several paths of a device. The paths cached no
+ * longer than g_cacheMaxAge ago are answered from the cache, the others are
+ * packed into the ContentPathList of as few GetValues actions as
+ * g_maxActionSize allows, each action carrying an ActionRequest that
+ * matches the returned parameters back to the paths.
+ *
+ * \return The number of actions sent, 0 if the cache answered all the
+ * paths, -1 if none was sent.
+ */
+int GetValuesSendAction(
+	/*! [in] The device number. */
+	int devnum,
+	/*! [in] The paths, a trailing '/' asks for a subtree. */
+	const char **paths,
+	/*! [in] The number of paths. */
+	int count);
+
+/*!
+ * \brief Set several parameters of a device. The pairs are packed into the
+ * ParameterValueList of as few SetValues actions as g_maxActionSize allows,
+ * paths and values being escaped.
+ *
+ * \return The number of actions sent, -1 if none was.
+ */
+int SetValuesSendAction(
+	/*! [in] The device number. */
+	int devnum,
+	/*! [in] The parameter paths. */
+	const char **paths,
+	/*! [in] The values, one per path. */
+	const char **values,
+	/*! [in] The number of parameters. */
+	int count);
+
+/* The list of one GetValues/SetValues action, for paths [first, first+count) */
+struct ActionBatch {
+	struct StrBuf list;
+	int first;
+	int count;
+};
+
+/*!
+ * \brief Split paths (and values for SetValues) into the lists of size
+ * bounded GetValues or SetValues actions.
+ */
+int CtrlPointBuildBatches(int actionType, const char **paths, const char **values, int count,
+	struct ActionBatch **batches, int *nbatches);
+int CtrlPointAddBatch(struct ActionBatch **batches, int *nbatches, int actionType, int first);
+void CtrlPointFreeBatches(struct ActionBatch *batches, int nbatches);
+
+/*!
+ * \brief Send the batches of paths (and values) to device devnum.
+ */
+int CtrlPointSendBatch(int actionType, int devnum, const char **paths, const char **values, int count);
+
+/*!
+ * \brief Send one GetValues or SetValues action. Within a fan-out, waits
+ * for room in its window first.
+ */
+int CtrlPointSendAction(int actionType, int devnum, const char *UDN, const char *controlURL,
+	const char *list, const char **paths, int count, struct FanOut *fanOut, int slot);
+int CtrlPointAppendEntry(struct StrBuf *list, const char *path, const char *value);
+const char *CtrlPointActionName(int actionType);
+double CtrlPointNow(void);
+
+/*!
+ * \brief Bucket of a latency in microseconds, and the highest latency that
+ * falls into a bucket.
+ */
+int LatencyBucket(unsigned long us);
+unsigned long LatencyBucketValue(int bucket);
+void LatencyRecord(struct LatencyHistogram *histogram, double seconds, int errCode);
+void LatencyReset(struct LatencyHistogram *histogram);
+unsigned long LatencyPercentile(const unsigned long *counts, unsigned long total, double percentile);
+void LatencyPrint(const char *name, const struct LatencyHistogram *histogram);
+
+/*!
+ * \brief Record the send to complete latency of a request in the histogram
+ * of its action type and in that of its device.
+ */
+void CtrlPointRecordLatency(struct ActionRequest *request, int errCode);
+
+/*!
+ * \brief Print the latencies of each action type, of device arg, or of all
+ * devices for "devices"; "reset" clears them.
+ */
+int CtrlPointPrintLatency(const char *arg);
+
+/*!
+ * \brief The metric slot of the calling thread, made and linked into the
+ * slot list on first use. NULL if it could not be allocated.
+ */
+struct MetricSlot *MetricThreadSlot(void);
+
+/*!
+ * \brief Add n to counter id of the calling thread, without a lock.
+ */
+void MetricAdd(int id, unsigned long n);
+
+/*!
+ * \brief The sum of counter id over all threads.
+ */
+unsigned long MetricRead(int id);
+
+/*!
+ * \brief Write the counters, gauges and latency summaries in Prometheus
+ * text format.
+ */
+int MetricsWrite(FILE *fp);
+void MetricsWriteSummary(FILE *fp, const char *name, const char *label,
+	const struct LatencyHistogram *histogram);
+
+/*!
+ * \brief Print the device list lock profile by call site, most time waited
+ * first, and the longest holds; "reset" clears it.
+ */
+int CtrlPointPrintLocks(const char *arg);
+
+/*!
+ * \brief Replace file with the current metrics.
+ */
+int CtrlPointDumpStats(const char *file);
+
+/*!
+ * \brief Send GetValues or SetValues to every device of devset, with at
+ * most g_maxInFlight actions outstanding, and print a summary of the
+ * results and latencies once the last device answered.
+ *
+ * \return 0 if the actions were sent, else -1.
+ */
+int CtrlPointFanOut(
+	/*! [in] GetValues or SetValues. */
+	int actionType,
+	/*! [in] "*" or numbers and ranges such as "1-10,15,20-". */
+	const char *devset,
+	/*! [in] The paths. */
+	const char **paths,
+	/*! [in] The values for SetValues, else NULL. */
+	const char **values,
+	/*! [in] The number of paths. */
+	int count);
+
+int CtrlPointInDevSet(const char *devset, int devnum);
+
+/*!
+ * \brief Tell a devset from a single device number.
+ */
+int CtrlPointIsDevSet(const char *devset);
+void CtrlPointFanOutAcquire(struct FanOut *fanOut, int slot);
+
+/*!
+ * \brief Account for the end of an action of device slot, freeing the
+ * fan-out after its last device.
+ */
+void CtrlPointFanOutRelease(struct FanOut *fanOut, int slot, int errCode, int inFlight);
+void CtrlPointFanOutFinish(struct FanOut *fanOut);
+void CtrlPointCountParameters(struct ActionRequest *request, struct Upnp_Action_Complete *aEvent);
+int CompareDouble(const void *a, const void *b);
+
+struct ActionRequest *CtrlPointNewRequest(int actionType, int devnum, const char *UDN,
+	const char **paths, int count, int copy);
+void CtrlPointFreeRequest(struct ActionRequest *request);
+
+/*!
+ * \brief Print the parameters returned for an ActionRequest, each matched
+ * to the path asked for, and the paths that got no value.
+ */
+void CtrlPointHandleActionComplete(struct ActionRequest *request, struct Upnp_Action_Complete *aEvent);
+void CtrlPointDemuxParameter(const char *path, const char *value, void *cookie);
+
+/*!
+ * \brief Parse a ParameterValueList answered for request, caching the
+ * values in its device when it is still known.
+ *
+ * \return The number of parameters, -1 if the document is truncated.
+ */
+int CtrlPointParseValues(struct ActionRequest *request, const char *xml);
+
+/*! \brief Mark the paths set by request stale in the cache of its device. */
+void CtrlPointUncacheValues(struct ActionRequest *request);
+
+/*!
+ * \brief Print the values of a device cached no longer than maxAge seconds
+ * ago and put the other paths in missing, subtrees always being missing.
+ *
+ * \return The number of missing paths, -1 if the device is unknown.
+ */
+int CtrlPointServeFromCache(int devnum, const char **paths, int count, int maxAge, const char **missing);
+
+/* A copy of a cached value */
+struct ParameterEntry {
+	char *path;
+	char *value;
+	time_t updated;
+};
+
+/* Copies of the cached values of a subtree */
+struct ParameterList {
+	struct ParameterEntry *entries;
+	int count;
+};
+
+void ParameterListAdd(const char *path, const struct CachedParameter *param, void *cookie);
+void ParameterListFree(struct ParameterList *list);
+int CompareParameterEntry(const void *a, const void *b);
+
+/*!
+ * \brief Copy the cached values of device devnum under prefix into list,
+ * sorted by path. A trailing '#' of prefix is ignored.
+ *
+ * \return The number of values, -1 if the device is unknown.
+ */
+int CtrlPointCollectCache(int devnum, const char *prefix, struct ParameterList *list);
+
+/*!
+ * \brief Print the cached values of a device under prefix with their age.
+ */
+int CtrlPointPrintCache(int devnum, const char *prefix);
+
+/*!
+ * \brief Print the differences between the cached values of two devices
+ * under prefix, and a count of the same and different ones.
+ */
+int CtrlPointDiffCache(int devnumA, int devnumB, const char *prefix);
+
+/*!
+ * \brief Append a copy of path to a growing array of paths.
+ */
+int AppendPath(char ***paths, int *count, const char *path);
+
+/*!
+ * \brief Append the paths of a file, one per line, '#' starting a comment.
+ */
+int LoadPathFile(const char *file, char ***paths, int *count);
+
+/*!
+ * \brief Append the "path value" lines of a file to paths and values.
+ */
+int LoadParameterFile(const char *file, char ***paths, char ***values, int *count);
+void FreePaths(char **paths, int count);
+
+/*!
+ * \brief Print the run time options if name is empty, print or set one.
+ *
+ * \return 0 on success, -1 for an unknown option or a value out of range.
+ */
+int CtrlPointSetOption(const char *name, const char *value);
 void PrintParameters(const char *buffer);
 
 #ifdef __cplusplus
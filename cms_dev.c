@@ -0,0 +1,758 @@
+/*
+ * ManageableDevice:2 emulator for load and scale testing of cms_cp.
+ *
+ * libupnp registers one root device per process, so N devices are N
+ * processes forked from this one, each with its own UpnpInit and port.
+ * Every device exposes the ConfigurationManagement:2 service with the six
+ * state variables cms_cp knows, answers GetValues, SetValues and
+ * SetAlarmsEnabled, and emits ConfigurationUpdate events at a fixed rate.
+ */
+#include "ithread.h"
+#include "ixml.h"
+#include "upnp.h"
+#include "upnptools.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DEV_DEVICE_TYPE		"urn:schemas-upnp-org:device:ManageableDevice:2"
+#define DEV_SERVICE_TYPE	"urn:schemas-upnp-org:service:ConfigurationManagement:2"
+#define DEV_SERVICE_ID		"urn:upnp-org:serviceId:ConfigurationManagement"
+#define DEV_VARCOUNT		(6)
+#define DEV_DEFAULT_EXPIRES	(1800)
+#define DEV_DESC_SIZE		(4096)
+#define DEV_SCPD_FILE		"ConfigurationManagement.xml"
+
+/* The state variables, in the order of g_varName of cms_cp */
+enum {
+	DEV_CONFIGURATION_UPDATE = 0,
+	DEV_SUPPORTED_DATA_MODELS_UPDATE,
+	DEV_SUPPORTED_PARAMETERS_UPDATE,
+	DEV_ATTRIBUTE_VALUES_UPDATE,
+	DEV_INCONSISTENT_STATUS,
+	DEV_ALARMS_ENABLED
+};
+
+const char *g_devVarName[DEV_VARCOUNT] = {
+	"ConfigurationUpdate","SupportedDataModelsUpdate","SupportedParametersUpdate",
+	"AttributeValuesUpdate","InconsistentStatus","AlarmsEnabled"
+};
+
+/* One parameter of the data model, kept sorted by path */
+struct DevParameter {
+	char *path;
+	char *value;
+};
+
+/* Growing string, for the XML built here */
+struct DevBuf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/* State of the device of this process, guarded by g_devMutex */
+ithread_mutex_t g_devMutex;
+UpnpDevice_Handle g_devHandle = -1;
+char g_devUDN[NAME_SIZE];
+char *g_devVarVal[DEV_VARCOUNT];
+struct DevParameter *g_devParams = NULL;
+int g_devParamCount = 0;
+int g_devParamSize = 0;
+int g_devVersion = 0;
+
+/* Command line settings */
+int g_devCount = 1;
+int g_devParamTotal = 100;
+double g_devEventRate = 1.0;
+int g_devExpires = DEV_DEFAULT_EXPIRES;
+const char *g_devHostIP = NULL;
+const char *g_devName = "B2BUA emulator";
+/* Directory the SDK web server serves DEV_SCPD_FILE from, shared by all devices */
+char g_devWebRoot[NAME_SIZE] = "";
+
+/* The service description, with the actions and variables emulated here */
+static const char g_devSCPD[] =
+"<?xml version=\"1.0\"?>\n"
+"<scpd xmlns=\"urn:schemas-upnp-org:service-1-0\">\n"
+"<specVersion><major>1</major><minor>0</minor></specVersion>\n"
+"<actionList>\n"
+"<action><name>GetValues</name><argumentList>\n"
+"<argument><name>Parameters</name><direction>in</direction>"
+"<relatedStateVariable>A_ARG_TYPE_ContentPathList</relatedStateVariable></argument>\n"
+"<argument><name>ParameterValueList</name><direction>out</direction>"
+"<relatedStateVariable>A_ARG_TYPE_ParameterValueList</relatedStateVariable></argument>\n"
+"</argumentList></action>\n"
+"<action><name>SetValues</name><argumentList>\n"
+"<argument><name>ParameterValueList</name><direction>in</direction>"
+"<relatedStateVariable>A_ARG_TYPE_ParameterValueList</relatedStateVariable></argument>\n"
+"<argument><name>Status</name><direction>out</direction>"
+"<relatedStateVariable>A_ARG_TYPE_Status</relatedStateVariable></argument>\n"
+"</argumentList></action>\n"
+"<action><name>SetAlarmsEnabled</name><argumentList>\n"
+"<argument><name>StateVariableValue</name><direction>in</direction>"
+"<relatedStateVariable>AlarmsEnabled</relatedStateVariable></argument>\n"
+"</argumentList></action>\n"
+"</actionList>\n"
+"<serviceStateTable>\n"
+"<stateVariable sendEvents=\"yes\"><name>ConfigurationUpdate</name><dataType>string</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"yes\"><name>SupportedDataModelsUpdate</name><dataType>string</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"yes\"><name>SupportedParametersUpdate</name><dataType>string</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"yes\"><name>AttributeValuesUpdate</name><dataType>string</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"yes\"><name>InconsistentStatus</name><dataType>boolean</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"yes\"><name>AlarmsEnabled</name><dataType>boolean</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_ContentPathList</name><dataType>string</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_ParameterValueList</name><dataType>string</dataType></stateVariable>\n"
+"<stateVariable sendEvents=\"no\"><name>A_ARG_TYPE_Status</name><dataType>string</dataType>"
+"<allowedValueList><allowedValue>ChangesApplied</allowedValue>"
+"<allowedValue>ChangesAppliedButNotEffective</allowedValue></allowedValueList></stateVariable>\n"
+"</serviceStateTable>\n"
+"</scpd>\n";
+
+static const char g_devParameterValueListHeader[] =
+"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\
+<cms:ParameterValueList xmlns:cms=\"urn:schemas-upnp-org:dm:cms\" \
+xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"urn:schemas-upnp-org:dm:cms http://www.upnp.org/schemas/dm/cms.xsd\">";
+static const char g_devParameterValueListFooter[] = "</cms:ParameterValueList>";
+
+int DevBufAppend(struct DevBuf *buf, const char *data, size_t len)
+{
+	char *grown;
+	size_t size;
+
+	if (buf->len + len + 1 > buf->size) {
+		size = buf->size ? buf->size : 256;
+		while (buf->len + len + 1 > size)
+			size *= 2;
+		grown = (char *)realloc(buf->data, size);
+		if (NULL == grown)
+			return -1;
+		buf->data = grown;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+	return 0;
+}
+
+int DevBufAppendStr(struct DevBuf *buf, const char *str)
+{
+	return DevBufAppend(buf, str, strlen(str));
+}
+
+/* Append str with the five XML entities escaped */
+int DevBufAppendEscaped(struct DevBuf *buf, const char *str)
+{
+	const char *entity;
+	int rc = 0;
+
+	for (; *str && 0 == rc; str++) {
+		switch (*str) {
+			case '<': entity = "&lt;"; break;
+			case '>': entity = "&gt;"; break;
+			case '&': entity = "&amp;"; break;
+			case '"': entity = "&quot;"; break;
+			case '\'': entity = "&apos;"; break;
+			default: entity = NULL; break;
+		}
+		rc = entity ? DevBufAppendStr(buf, entity) : DevBufAppend(buf, str, 1);
+	}
+	return rc;
+}
+
+/* Copy [st, st+len) with the five XML entities decoded */
+char *DevUnescape(const char *st, size_t len)
+{
+	static const struct {
+		const char *entity;
+		char c;
+	} entities[] = {
+		{"&lt;", '<'}, {"&gt;", '>'}, {"&amp;", '&'}, {"&quot;", '"'}, {"&apos;", '\''}
+	};
+	char *out = (char *)malloc(len + 1);
+	size_t i = 0;
+	size_t j = 0;
+	size_t e;
+	size_t n;
+
+	if (NULL == out)
+		return NULL;
+	while (i < len) {
+		for (e = 0; '&' == st[i] && e < sizeof(entities)/sizeof(entities[0]); e++) {
+			n = strlen(entities[e].entity);
+			if (i + n <= len && 0 == strncmp(st + i, entities[e].entity, n))
+				break;
+		}
+		if ('&' == st[i] && e < sizeof(entities)/sizeof(entities[0])) {
+			out[j++] = entities[e].c;
+			i += strlen(entities[e].entity);
+		} else {
+			out[j++] = st[i++];
+		}
+	}
+	out[j] = '\0';
+	return out;
+}
+
+/* Find the text of the next <tag>...</tag> at or after *pos */
+char *DevNextElement(const char **pos, const char *tag)
+{
+	char open[NAME_SIZE];
+	char close[NAME_SIZE];
+	const char *start;
+	const char *end;
+
+	snprintf(open, sizeof(open), "<%s>", tag);
+	snprintf(close, sizeof(close), "</%s>", tag);
+	start = strstr(*pos, open);
+	if (NULL == start)
+		return NULL;
+	start += strlen(open);
+	end = strstr(start, close);
+	if (NULL == end)
+		return NULL;
+	*pos = end + strlen(close);
+	return DevUnescape(start, (size_t)(end - start));
+}
+
+/* The value of argument name of an action request, unescaped by ixml */
+char *DevGetArgument(IXML_Document *doc, const char *name)
+{
+	IXML_NodeList *nodeList;
+	IXML_Node *child;
+	char *value = NULL;
+
+	nodeList = ixmlDocument_getElementsByTagName(doc, (DOMString)name);
+	if (NULL == nodeList)
+		return NULL;
+	child = ixmlNode_getFirstChild(ixmlNodeList_item(nodeList, 0));
+	if (child && eTEXT_NODE == ixmlNode_getNodeType(child))
+		value = strdup(ixmlNode_getNodeValue(child));
+	else
+		value = strdup("");
+	ixmlNodeList_free(nodeList);
+	return value;
+}
+
+void DevDateTime(char *buf, size_t size)
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+
+int CompareDevParameter(const void *a, const void *b)
+{
+	return strcmp(((const struct DevParameter *)a)->path, ((const struct DevParameter *)b)->path);
+}
+
+/* Index of the first parameter whose path is not below path */
+int DevLowerBound(const char *path)
+{
+	int low = 0;
+	int high = g_devParamCount;
+	int mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (strcmp(g_devParams[mid].path, path) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Set path to value, adding the parameter if it is new. Caller holds g_devMutex. */
+int DevSetParameter(const char *path, const char *value)
+{
+	struct DevParameter *grown;
+	char *copy, *dup;
+	int i = DevLowerBound(path);
+
+	if (i < g_devParamCount && 0 == strcmp(g_devParams[i].path, path)) {
+		copy = strdup(value);
+		if (NULL == copy)
+			return -1;
+		free(g_devParams[i].value);
+		g_devParams[i].value = copy;
+		return 0;
+	}
+	if (g_devParamCount == g_devParamSize) {
+		grown = (struct DevParameter *)realloc(g_devParams,
+			(size_t)(g_devParamSize ? g_devParamSize * 2 : 64) * sizeof(struct DevParameter));
+		if (NULL == grown)
+			return -1;
+		g_devParams = grown;
+		g_devParamSize = g_devParamSize ? g_devParamSize * 2 : 64;
+	}
+	/* Copied first, so that a failure leaves the table as it was */
+	copy = strdup(path);
+	if (NULL == copy)
+		return -1;
+	dup = strdup(value);
+	if (NULL == dup) {
+		free(copy);
+		return -1;
+	}
+	memmove(&g_devParams[i + 1], &g_devParams[i], (size_t)(g_devParamCount - i) * sizeof(struct DevParameter));
+	g_devParams[i].path = copy;
+	g_devParams[i].value = dup;
+	g_devParamCount++;
+	return 0;
+}
+
+int DevInitParameters(int index, int total)
+{
+	char path[NAME_SIZE];
+	char value[NAME_SIZE];
+	int rc = 0;
+	int i;
+
+	rc |= DevSetParameter("/BBF/VoiceService/0/SIP/Network/0/ProxyServer", "192.168.9.130");
+	rc |= DevSetParameter("/BBF/VoiceService/0/SIP/Network/0/Status", "Up");
+	snprintf(value, sizeof(value), "%s %d", g_devName, index);
+	rc |= DevSetParameter("/UPnP/DM/DeviceInfo/FriendlyName", value);
+	for (i = 0; i < total && 0 == rc; i++) {
+		snprintf(path, sizeof(path), "/BBF/Emulator/Parameter/%d/Value", i);
+		snprintf(value, sizeof(value), "%d", i);
+		rc = DevSetParameter(path, value);
+	}
+	return rc;
+}
+
+int DevAppendParameter(struct DevBuf *buf, const struct DevParameter *param)
+{
+	int rc = DevBufAppendStr(buf, "<Parameter><ParameterPath>");
+
+	if (0 == rc) rc = DevBufAppendEscaped(buf, param->path);
+	if (0 == rc) rc = DevBufAppendStr(buf, "</ParameterPath><Value>");
+	if (0 == rc) rc = DevBufAppendEscaped(buf, param->value);
+	if (0 == rc) rc = DevBufAppendStr(buf, "</Value></Parameter>");
+	return rc;
+}
+
+/* Set a state variable and notify the subscribers of it */
+void DevNotify(int var, const char *value)
+{
+	const char *name = g_devVarName[var];
+	char *copy = strdup(value);
+
+	if (NULL == copy)
+		return;
+	ithread_mutex_lock(&g_devMutex);
+	free(g_devVarVal[var]);
+	g_devVarVal[var] = copy;
+	ithread_mutex_unlock(&g_devMutex);
+	UpnpNotify(g_devHandle, g_devUDN, DEV_SERVICE_ID, &name, &value, 1);
+}
+
+/* A new ConfigurationUpdate for the parameters in list, of version version */
+void DevNotifyUpdate(int version, const char *list)
+{
+	struct DevBuf update = {NULL, 0, 0};
+	char dateTime[NAME_SIZE];
+	char head[NAME_SIZE * 2];
+
+	DevDateTime(dateTime, sizeof(dateTime));
+	snprintf(head, sizeof(head), "%d,%s,", version, dateTime);
+	if (0 == DevBufAppendStr(&update, head)
+		&& 0 == DevBufAppendStr(&update, g_devParameterValueListHeader)
+		&& 0 == DevBufAppendStr(&update, list)
+		&& 0 == DevBufAppendStr(&update, g_devParameterValueListFooter))
+		DevNotify(DEV_CONFIGURATION_UPDATE, update.data);
+	free(update.data);
+}
+
+int DevGetValues(struct Upnp_Action_Request *request)
+{
+	struct DevBuf list = {NULL, 0, 0};
+	char *paths = DevGetArgument(request->ActionRequest, "Parameters");
+	const char *pos = paths;
+	char *path;
+	size_t len;
+	int rc = 0;
+	int i;
+
+	if (NULL == paths)
+		return UPNP_SOAP_E_INVALID_ARGS;
+	rc = DevBufAppendStr(&list, g_devParameterValueListHeader);
+	ithread_mutex_lock(&g_devMutex);
+	while (0 == rc && (path = DevNextElement(&pos, "ContentPath"))) {
+		len = strlen(path);
+		i = DevLowerBound(path);
+		/* A path ending with '/' asks for the whole subtree */
+		for (; 0 == rc && i < g_devParamCount; i++) {
+			if (len > 0 && '/' == path[len-1] ? strncmp(g_devParams[i].path, path, len) != 0
+				: strcmp(g_devParams[i].path, path) != 0)
+				break;
+			rc = DevAppendParameter(&list, &g_devParams[i]);
+		}
+		free(path);
+	}
+	ithread_mutex_unlock(&g_devMutex);
+	if (0 == rc) rc = DevBufAppendStr(&list, g_devParameterValueListFooter);
+	if (0 == rc)
+		rc = UpnpAddToActionResponse(&request->ActionResult, request->ActionName,
+			DEV_SERVICE_TYPE, "ParameterValueList", list.data);
+	free(list.data);
+	free(paths);
+	return UPNP_E_SUCCESS == rc ? 0 : UPNP_SOAP_E_ACTION_FAILED;
+}
+
+int DevSetValues(struct Upnp_Action_Request *request)
+{
+	struct DevBuf changed = {NULL, 0, 0};
+	struct DevParameter param;
+	char *list = DevGetArgument(request->ActionRequest, "ParameterValueList");
+	const char *pos = list;
+	char *parameter;
+	const char *inner;
+	int version;
+	int rc = 0;
+
+	if (NULL == list)
+		return UPNP_SOAP_E_INVALID_ARGS;
+	ithread_mutex_lock(&g_devMutex);
+	while (0 == rc && (parameter = DevNextElement(&pos, "Parameter"))) {
+		inner = parameter;
+		param.path = DevNextElement(&inner, "ParameterPath");
+		inner = parameter;
+		param.value = DevNextElement(&inner, "Value");
+		if (param.path && param.value) {
+			rc = DevSetParameter(param.path, param.value);
+			if (0 == rc) rc = DevAppendParameter(&changed, &param);
+		}
+		free(param.path);
+		free(param.value);
+		free(parameter);
+	}
+	version = ++g_devVersion;
+	ithread_mutex_unlock(&g_devMutex);
+	free(list);
+	if (rc < 0) {
+		free(changed.data);
+		return UPNP_SOAP_E_ACTION_FAILED;
+	}
+	rc = UpnpAddToActionResponse(&request->ActionResult, request->ActionName,
+		DEV_SERVICE_TYPE, "Status", "ChangesApplied");
+	if (changed.data)
+		DevNotifyUpdate(version, changed.data);
+	free(changed.data);
+	return UPNP_E_SUCCESS == rc ? 0 : UPNP_SOAP_E_ACTION_FAILED;
+}
+
+int DevSetAlarmsEnabled(struct Upnp_Action_Request *request)
+{
+	char *value = DevGetArgument(request->ActionRequest, "StateVariableValue");
+	int rc;
+
+	if (NULL == value || (strcmp(value, "0") != 0 && strcmp(value, "1") != 0)) {
+		free(value);
+		return UPNP_SOAP_E_INVALID_ARGS;
+	}
+	rc = UpnpAddToActionResponse(&request->ActionResult, request->ActionName,
+		DEV_SERVICE_TYPE, NULL, NULL);
+	DevNotify(DEV_ALARMS_ENABLED, value);
+	free(value);
+	return UPNP_E_SUCCESS == rc ? 0 : UPNP_SOAP_E_ACTION_FAILED;
+}
+
+int DevHandleAction(struct Upnp_Action_Request *request)
+{
+	int errCode;
+
+	if (0 == strcmp(request->ActionName, "GetValues"))
+		errCode = DevGetValues(request);
+	else if (0 == strcmp(request->ActionName, "SetValues"))
+		errCode = DevSetValues(request);
+	else if (0 == strcmp(request->ActionName, "SetAlarmsEnabled"))
+		errCode = DevSetAlarmsEnabled(request);
+	else
+		errCode = UPNP_SOAP_E_INVALID_ACTION;
+	request->ErrCode = errCode;
+	if (errCode) {
+		snprintf(request->ErrStr, sizeof(request->ErrStr), "%.*s failed",
+			(int)sizeof(request->ErrStr) - 8, request->ActionName);
+		if (request->ActionResult) {
+			ixmlDocument_free(request->ActionResult);
+			request->ActionResult = NULL;
+		}
+	}
+	return 0;
+}
+
+int DevHandleGetVar(struct Upnp_State_Var_Request *request)
+{
+	int var;
+
+	for (var = 0; var < DEV_VARCOUNT; var++) {
+		if (0 == strcmp(request->StateVarName, g_devVarName[var]))
+			break;
+	}
+	if (DEV_VARCOUNT == var) {
+		request->ErrCode = UPNP_SOAP_E_INVALID_VAR;
+		strcpy(request->ErrStr, "Invalid Variable");
+		return 0;
+	}
+	ithread_mutex_lock(&g_devMutex);
+	/* The SDK frees the value after answering */
+	request->CurrentVal = ixmlCloneDOMString(g_devVarVal[var]);
+	ithread_mutex_unlock(&g_devMutex);
+	request->ErrCode = UPNP_E_SUCCESS;
+	return 0;
+}
+
+int DevHandleSubscription(struct Upnp_Subscription_Request *request)
+{
+	if (strcmp(request->UDN, g_devUDN) != 0 || strcmp(request->ServiceId, DEV_SERVICE_ID) != 0)
+		return 0;
+	ithread_mutex_lock(&g_devMutex);
+	UpnpAcceptSubscription(g_devHandle, request->UDN, request->ServiceId,
+		g_devVarName, (const char **)g_devVarVal, DEV_VARCOUNT, request->Sid);
+	ithread_mutex_unlock(&g_devMutex);
+	return 0;
+}
+
+int DevCallbackEventHandler(Upnp_EventType eventType, void *event, void *cookie)
+{
+	(void)cookie;
+	switch (eventType) {
+		case UPNP_CONTROL_ACTION_REQUEST:
+			DevHandleAction((struct Upnp_Action_Request *)event);
+			break;
+		case UPNP_CONTROL_GET_VAR_REQUEST:
+			DevHandleGetVar((struct Upnp_State_Var_Request *)event);
+			break;
+		case UPNP_EVENT_SUBSCRIPTION_REQUEST:
+			DevHandleSubscription((struct Upnp_Subscription_Request *)event);
+			break;
+		default:
+			break;
+	}
+	return 0;
+}
+
+int DevDescription(int index, char *desc, size_t size)
+{
+	int len = snprintf(desc, size,
+		"<?xml version=\"1.0\"?>\n"
+		"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+		"<specVersion><major>1</major><minor>0</minor></specVersion>\n"
+		"<device>\n"
+		"<deviceType>%s</deviceType>\n"
+		"<friendlyName>%s %d</friendlyName>\n"
+		"<manufacturer>cms_dev</manufacturer>\n"
+		"<modelName>ManageableDevice emulator</modelName>\n"
+		"<UDN>%s</UDN>\n"
+		"<serviceList><service>\n"
+		"<serviceType>%s</serviceType>\n"
+		"<serviceId>%s</serviceId>\n"
+		"<SCPDURL>/ConfigurationManagement.xml</SCPDURL>\n"
+		"<controlURL>/ConfigurationManagement/control</controlURL>\n"
+		"<eventSubURL>/ConfigurationManagement/event</eventSubURL>\n"
+		"</service></serviceList>\n"
+		"</device>\n"
+		"</root>\n",
+		DEV_DEVICE_TYPE, g_devName, index, g_devUDN, DEV_SERVICE_TYPE, DEV_SERVICE_ID);
+	return len > 0 && (size_t)len < size ? 0 : -1;
+}
+
+/* Write the SCPD in a new directory, for the web server of every device */
+int DevWriteSCPD(void)
+{
+	char file[NAME_SIZE * 2];
+	FILE *fp;
+	int rc;
+
+	strcpy(g_devWebRoot, "/tmp/cms_dev.XXXXXX");
+	if (NULL == mkdtemp(g_devWebRoot)) {
+		g_devWebRoot[0] = '\0';
+		return -1;
+	}
+	snprintf(file, sizeof(file), "%s/%s", g_devWebRoot, DEV_SCPD_FILE);
+	fp = fopen(file, "w");
+	if (NULL == fp)
+		return -1;
+	rc = fputs(g_devSCPD, fp) < 0 ? -1 : 0;
+	if (fclose(fp) != 0)
+		rc = -1;
+	return rc;
+}
+
+void DevRemoveSCPD(void)
+{
+	char file[NAME_SIZE * 2];
+
+	if ('\0' == g_devWebRoot[0])
+		return;
+	snprintf(file, sizeof(file), "%s/%s", g_devWebRoot, DEV_SCPD_FILE);
+	unlink(file);
+	rmdir(g_devWebRoot);
+}
+
+/* Run device index in this process until SIGINT or SIGTERM */
+int DevRun(int index, sigset_t *sigs)
+{
+	char desc[DEV_DESC_SIZE];
+	char dateTime[NAME_SIZE];
+	char initial[NAME_SIZE];
+	char param[NAME_SIZE * 3];
+	char path[NAME_SIZE];
+	struct timespec period;
+	struct DevParameter changed;
+	unsigned int seed = (unsigned int)(getpid() ^ time(NULL));
+	int version;
+	int var;
+	int rc;
+
+	ithread_mutex_init(&g_devMutex, NULL);
+	snprintf(g_devUDN, sizeof(g_devUDN), "uuid:cms-dev-%08x-%06d", (unsigned int)getppid(), index);
+	DevDateTime(dateTime, sizeof(dateTime));
+	snprintf(initial, sizeof(initial), "0,%.*s", (int)sizeof(initial) - 3, dateTime);
+	for (var = 0; var < DEV_VARCOUNT; var++)
+		g_devVarVal[var] = strdup(var < DEV_INCONSISTENT_STATUS ? initial : "0");
+	if (DevInitParameters(index, g_devParamTotal) < 0 || DevDescription(index, desc, sizeof(desc)) < 0) {
+		printf("device %d: out of memory\n", index);
+		return -1;
+	}
+
+	rc = UpnpInit(g_devHostIP, 0);
+	if (UPNP_E_SUCCESS != rc) {
+		printf("device %d: UpnpInit() Error: %d\n", index, rc);
+		return -1;
+	}
+	/* The SDK serves the SCPD from the web root, the description from memory */
+	if (g_devWebRoot[0] && UpnpSetWebServerRootDir(g_devWebRoot) != UPNP_E_SUCCESS)
+		printf("device %d: Error serving %s from %s\n", index, DEV_SCPD_FILE, g_devWebRoot);
+	/* The SDK serves the description and sets URLBase to its own address */
+	rc = UpnpRegisterRootDevice2(UPNPREG_BUF_DESC, desc, strlen(desc), 1,
+		DevCallbackEventHandler, NULL, &g_devHandle);
+	if (UPNP_E_SUCCESS != rc) {
+		printf("device %d: Error registering the root device: %d\n", index, rc);
+		UpnpFinish();
+		return -1;
+	}
+	rc = UpnpSendAdvertisement(g_devHandle, g_devExpires);
+	if (UPNP_E_SUCCESS != rc)
+		printf("device %d: Error sending advertisements: %d\n", index, rc);
+	printf("device %d: %s on %s:%u\n", index, g_devUDN,
+		UpnpGetServerIpAddress(), UpnpGetServerPort());
+
+	period.tv_sec = g_devEventRate > 0 ? (time_t)(1 / g_devEventRate) : 3600;
+	period.tv_nsec = g_devEventRate > 0 ? (long)((1 / g_devEventRate - period.tv_sec) * 1e9) : 0;
+	while (1) {
+		/* The signals end the device, the timeout emits the next event */
+		if (sigtimedwait(sigs, NULL, &period) >= 0)
+			break;
+		if (errno != EAGAIN || g_devEventRate <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/BBF/Emulator/Parameter/%d/Value",
+			g_devParamTotal > 0 ? (int)(rand_r(&seed) % g_devParamTotal) : 0);
+		snprintf(param, sizeof(param), "%d", (int)rand_r(&seed));
+		changed.path = path;
+		changed.value = param;
+		ithread_mutex_lock(&g_devMutex);
+		DevSetParameter(changed.path, changed.value);
+		version = ++g_devVersion;
+		ithread_mutex_unlock(&g_devMutex);
+		{
+			struct DevBuf list = {NULL, 0, 0};
+			if (0 == DevAppendParameter(&list, &changed))
+				DevNotifyUpdate(version, list.data);
+			free(list.data);
+		}
+	}
+
+	/* Says byebye */
+	UpnpUnRegisterRootDevice(g_devHandle);
+	UpnpFinish();
+	return 0;
+}
+
+void DevUsage(const char *prog)
+{
+	printf("Usage: %s [-n devices] [-r events/s] [-p parameters] [-e expires] [-i ip] [-f friendlyName]\n"
+		"  -n  devices to run, one process each (default 1)\n"
+		"  -r  ConfigurationUpdate events per second of each device, 0 for none (default 1)\n"
+		"  -p  parameters of the data model besides the built in ones (default 100)\n"
+		"  -e  advertisement expiry in seconds (default %d)\n"
+		"  -i  address to run on, e.g. 127.0.0.1 (default the first interface)\n"
+		"  -f  friendlyName prefix, followed by the device number (default \"B2BUA emulator\")\n",
+		prog, DEV_DEFAULT_EXPIRES);
+}
+
+int main(int argc, char **argv)
+{
+	sigset_t sigs;
+	pid_t *pids;
+	int sig;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:r:p:e:i:f:h")) != -1) {
+		switch (opt) {
+			case 'n': g_devCount = atoi(optarg); break;
+			case 'r': g_devEventRate = atof(optarg); break;
+			case 'p': g_devParamTotal = atoi(optarg); break;
+			case 'e': g_devExpires = atoi(optarg); break;
+			case 'i': g_devHostIP = optarg; break;
+			case 'f': g_devName = optarg; break;
+			default:
+				DevUsage(argv[0]);
+				return 1;
+		}
+	}
+	if (g_devCount < 1 || g_devParamTotal < 0 || g_devExpires < 1) {
+		DevUsage(argv[0]);
+		return 1;
+	}
+
+	/* Blocked here, so that every process takes them with sigtimedwait */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (DevWriteSCPD() < 0)
+		printf("Error writing %s, control points fetching it get a 404\n", DEV_SCPD_FILE);
+	pids = (pid_t *)calloc((size_t)g_devCount, sizeof(pid_t));
+	if (NULL == pids) {
+		DevRemoveSCPD();
+		return 1;
+	}
+	for (i = 0; i < g_devCount; i++) {
+		pids[i] = fork();
+		if (0 == pids[i])
+			return DevRun(i + 1, &sigs) < 0 ? 1 : 0;
+		if (pids[i] < 0) {
+			printf("fork failed for device %d\n", i + 1);
+			break;
+		}
+	}
+	printf("%d devices running, Ctrl-C to stop\n", i);
+
+	sigwait(&sigs, &sig);
+	for (i = 0; i < g_devCount; i++) {
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	}
+	for (i = 0; i < g_devCount; i++) {
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	}
+	free(pids);
+	DevRemoveSCPD();
+	return 0;
+}
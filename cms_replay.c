@@ -0,0 +1,689 @@
+/*
+Offline replay of captured SSDP and GENA traffic into the control point.
+Same license as cms_cp.c.
+
+1.Compile:(assumed that libupnp are installed in /usr/local)
+	gcc -O2 -DCMS_CP_NO_MAIN -I/usr/local/include -I/usr/local/include/upnp -L/usr/local/lib \
+	cms_cp.c cms_replay.c -o cms_replay -lupnp -lthreadutil -lixml -lpthread
+
+2.Run:
+	export LD_LIBRARY_PATH=/usr/local/lib:$LD_LIBRARY_PATH
+	./cms_replay [-r <rate>] [-n <loops>] [-w <workers>] [-v] [<pcap>]
+
+  Reads <pcap> (doc/cms.pcap by default), an Ethernet capture in the
+  classic pcap format, and extracts:
+    - SSDP NOTIFY alive/byebye and M-SEARCH responses, as discovery events;
+    - the answers to GET requests, as the description documents, which
+      g_downloadXmlDoc then serves instead of downloading them;
+    - the answers to SUBSCRIBE requests, as subscribe or renewal completions;
+    - GENA NOTIFY requests, as UPNP_EVENT_RECEIVED with their SID and SEQ.
+  TCP streams are put back together by sequence number first.
+
+  The events are passed to CtrlPointCallbackEventHandler in capture order,
+  as fast as possible (-r 0, the default) or at <rate> times the captured
+  pace (-r 1 is real time), <loops> times over.  No socket is opened.
+  Past the first loop the NOTIFYs repeat EventKeys already seen, so they
+  are dropped as stale unless the capture subscribes again.
+  With -w, the callback only queues the events for that many dispatch
+  workers, as it does in cms_cp.
+  The time each callback takes is kept in a latency histogram per event
+  type and printed at the end with the events per second.  The output of
+  the control point goes to /dev/null unless -v is given.
+*/
+#include "cms_cp.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+extern ithread_mutex_t g_downloadMutex;
+extern ithread_mutex_t g_filterMutex;
+extern ithread_mutex_t g_timerMutex;
+extern ithread_cond_t g_timerCond;
+extern ithread_rwlock_t g_dispatchLock;
+extern ithread_mutex_t g_dispatchGate;
+extern ithread_mutex_t g_dispatchRouteMutex;
+extern ithread_rwlock_t g_internLock;
+extern int g_eventLog;
+extern int g_deviceCount;
+extern int g_dispatchWorkers;
+
+#define REPLAY_PCAP_MAGIC	(0xa1b2c3d4)
+#define REPLAY_LINKTYPE_ETHERNET	(1)
+
+/* One event to pass to the callback */
+struct ReplayEvent {
+	double time;			/* capture time, seconds */
+	Upnp_EventType type;
+	struct Upnp_Discovery discovery;
+	struct Upnp_Event_Subscribe subscribe;
+	struct Upnp_Event event;	/* ChangedVariables parsed once */
+};
+
+/* A description document served by ReplayDownloadXmlDoc */
+struct ReplayDescription {
+	char url[LINE_SIZE];
+	char *xml;
+	struct ReplayDescription *next;
+};
+
+/* One TCP segment of a stream */
+struct ReplaySegment {
+	uint32_t seq;
+	double time;
+	char *data;
+	size_t len;
+};
+
+/* One direction of a TCP connection, reassembled in data */
+struct ReplayStream {
+	uint32_t src, dst;
+	uint16_t sport, dport;
+	struct ReplaySegment *segments;
+	int count;
+	int size;
+	char *data;
+	size_t len;
+	double *times;			/* capture time of each byte of data */
+	struct ReplayStream *next;
+};
+
+static FILE *g_report = NULL;
+static struct ReplayEvent *g_events = NULL;
+static int g_eventCount = 0;
+static int g_eventSize = 0;
+static struct ReplayDescription *g_descriptions = NULL;
+static struct ReplayStream *g_streams = NULL;
+
+static double NowSeconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int ReplayDownloadXmlDoc(const char *url, IXML_Document **xmlDoc)
+{
+	struct ReplayDescription *desc;
+
+	for (desc = g_descriptions; desc; desc = desc->next) {
+		if (0 == strcmp(desc->url, url)) {
+			*xmlDoc = ixmlParseBuffer(desc->xml);
+			return *xmlDoc ? UPNP_E_SUCCESS : UPNP_E_INVALID_DESC;
+		}
+	}
+	return UPNP_E_NETWORK_ERROR;
+}
+
+static struct ReplayEvent *ReplayAddEvent(double time, Upnp_EventType type)
+{
+	struct ReplayEvent *grown;
+	struct ReplayEvent *event;
+
+	if (g_eventCount == g_eventSize) {
+		grown = (struct ReplayEvent *)realloc(g_events,
+			(size_t)(g_eventSize ? g_eventSize * 2 : 64) * sizeof(struct ReplayEvent));
+		if (NULL == grown)
+			return NULL;
+		g_events = grown;
+		g_eventSize = g_eventSize ? g_eventSize * 2 : 64;
+	}
+	event = &g_events[g_eventCount++];
+	memset(event, 0, sizeof(*event));
+	event->time = time;
+	event->type = type;
+	return event;
+}
+
+/* Copy the value of header name from the headers of an HTTP message */
+static int ReplayHeader(const char *headers, size_t len, const char *name, char *value, size_t size)
+{
+	const char *line = headers;
+	const char *end = headers + len;
+	const char *eol;
+	const char *st;
+	size_t nameLen = strlen(name);
+	size_t n;
+
+	for (; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', (size_t)(end - line));
+		if (NULL == eol)
+			eol = end;
+		if ((size_t)(eol - line) > nameLen && ':' == line[nameLen]
+			&& 0 == strncasecmp(line, name, nameLen)) {
+			for (st = line + nameLen + 1; st < eol && (' ' == *st || '\t' == *st); st++)
+				;
+			n = (size_t)(eol - st);
+			while (n > 0 && ('\r' == st[n-1] || ' ' == st[n-1]))
+				n--;
+			if (n >= size)
+				n = size - 1;
+			memcpy(value, st, n);
+			value[n] = '\0';
+			return 0;
+		}
+	}
+	value[0] = '\0';
+	return -1;
+}
+
+static void ReplayAddress(uint32_t addr, uint16_t port, char *buf, size_t size)
+{
+	struct in_addr in;
+
+	in.s_addr = addr;
+	snprintf(buf, size, "%s:%u", inet_ntoa(in), (unsigned int)ntohs(port));
+}
+
+/* SSDP advertisements and search responses */
+static void ReplaySsdp(double time, const char *data, size_t len)
+{
+	struct ReplayEvent *event;
+	char nts[NAME_SIZE];
+	char nt[LINE_SIZE];	/* the size of the Upnp_Discovery fields */
+	char usn[LINE_SIZE];
+	char cache[NAME_SIZE];
+	const char *maxAge;
+	char *sep;
+	Upnp_EventType type;
+
+	if (len > 9 && 0 == strncmp(data, "NOTIFY * ", 9)) {
+		ReplayHeader(data, len, "NTS", nts, sizeof(nts));
+		ReplayHeader(data, len, "NT", nt, sizeof(nt));
+		type = strstr(nts, "byebye") ? UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE : UPNP_DISCOVERY_ADVERTISEMENT_ALIVE;
+	} else if (len > 12 && 0 == strncmp(data, "HTTP/1.1 200", 12)) {
+		ReplayHeader(data, len, "ST", nt, sizeof(nt));
+		type = UPNP_DISCOVERY_SEARCH_RESULT;
+	} else {
+		return;
+	}
+	if (ReplayHeader(data, len, "USN", usn, sizeof(usn)) < 0)
+		return;
+	event = ReplayAddEvent(time, type);
+	if (NULL == event)
+		return;
+	/* Filled the way libupnp fills them from the headers */
+	sep = strstr(usn, "::");
+	if (sep)
+		*sep = '\0';
+	snprintf(event->discovery.DeviceId, sizeof(event->discovery.DeviceId), "%s", usn);
+	if (strstr(nt, ":device:"))
+		snprintf(event->discovery.DeviceType, sizeof(event->discovery.DeviceType), "%s", nt);
+	else if (strstr(nt, ":service:"))
+		snprintf(event->discovery.ServiceType, sizeof(event->discovery.ServiceType), "%s", nt);
+	ReplayHeader(data, len, "LOCATION", event->discovery.Location, sizeof(event->discovery.Location));
+	ReplayHeader(data, len, "CACHE-CONTROL", cache, sizeof(cache));
+	maxAge = strstr(cache, "max-age=");
+	event->discovery.Expires = maxAge ? atoi(maxAge + strlen("max-age=")) : 0;
+	ReplayHeader(data, len, "SERVER", event->discovery.Os, sizeof(event->discovery.Os));
+}
+
+static struct ReplayStream *ReplayFindStream(uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport, int create)
+{
+	struct ReplayStream *stream;
+
+	for (stream = g_streams; stream; stream = stream->next) {
+		if (stream->src == src && stream->sport == sport && stream->dst == dst && stream->dport == dport)
+			return stream;
+	}
+	if (!create)
+		return NULL;
+	stream = (struct ReplayStream *)calloc(1, sizeof(struct ReplayStream));
+	if (NULL == stream)
+		return NULL;
+	stream->src = src;
+	stream->sport = sport;
+	stream->dst = dst;
+	stream->dport = dport;
+	stream->next = g_streams;
+	g_streams = stream;
+	return stream;
+}
+
+static int ReplayAddSegment(double time, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport,
+	uint32_t seq, const char *data, size_t len)
+{
+	struct ReplayStream *stream = ReplayFindStream(src, sport, dst, dport, 1);
+	struct ReplaySegment *grown;
+	struct ReplaySegment *segment;
+
+	if (NULL == stream)
+		return -1;
+	if (stream->count == stream->size) {
+		grown = (struct ReplaySegment *)realloc(stream->segments,
+			(size_t)(stream->size ? stream->size * 2 : 16) * sizeof(struct ReplaySegment));
+		if (NULL == grown)
+			return -1;
+		stream->segments = grown;
+		stream->size = stream->size ? stream->size * 2 : 16;
+	}
+	segment = &stream->segments[stream->count];
+	segment->data = (char *)malloc(len);
+	if (NULL == segment->data)
+		return -1;
+	memcpy(segment->data, data, len);
+	segment->len = len;
+	segment->seq = seq;
+	segment->time = time;
+	stream->count++;
+	return 0;
+}
+
+static int CompareSegment(const void *a, const void *b)
+{
+	const struct ReplaySegment *segA = (const struct ReplaySegment *)a;
+	const struct ReplaySegment *segB = (const struct ReplaySegment *)b;
+	int32_t diff = (int32_t)(segA->seq - segB->seq);
+
+	if (diff != 0)
+		return diff < 0 ? -1 : 1;
+	return segA->time < segB->time ? -1 : (segA->time > segB->time);
+}
+
+/* Lay the segments of a stream end to end, dropping retransmitted bytes */
+static int ReplayReassemble(struct ReplayStream *stream)
+{
+	struct ReplaySegment *segment;
+	uint32_t next = 0;
+	size_t total = 0;
+	size_t skip;
+	size_t i;
+	int k;
+
+	qsort(stream->segments, (size_t)stream->count, sizeof(struct ReplaySegment), CompareSegment);
+	for (k = 0; k < stream->count; k++)
+		total += stream->segments[k].len;
+	stream->data = (char *)malloc(total + 1);
+	stream->times = (double *)malloc((total + 1) * sizeof(double));
+	if (NULL == stream->data || NULL == stream->times)
+		return -1;
+	for (k = 0; k < stream->count; k++) {
+		segment = &stream->segments[k];
+		skip = 0;
+		if (k > 0 && (int32_t)(next - segment->seq) > 0)
+			skip = (size_t)(next - segment->seq);
+		if (skip >= segment->len)
+			continue;
+		memcpy(stream->data + stream->len, segment->data + skip, segment->len - skip);
+		for (i = 0; i < segment->len - skip; i++)
+			stream->times[stream->len + i] = segment->time;
+		stream->len += segment->len - skip;
+		next = segment->seq + (uint32_t)segment->len;
+	}
+	stream->data[stream->len] = '\0';
+	return 0;
+}
+
+/* The next HTTP message of data from *pos: its headers and body */
+static int ReplayNextMessage(const char *data, size_t len, size_t *pos, int isResponse,
+	size_t *start, size_t *headerLen, char **body, size_t *bodyLen)
+{
+	char value[NAME_SIZE];
+	const char *end;
+	const char *chunk;
+	const char *limit = data + len;
+	char *out;
+	size_t n;
+
+	if (*pos >= len)
+		return -1;
+	*start = *pos;
+	end = strstr(data + *pos, "\r\n\r\n");
+	if (NULL == end)
+		return -1;
+	*headerLen = (size_t)(end - (data + *pos)) + 2;
+	end += 4;
+	*body = NULL;
+	*bodyLen = 0;
+	if (0 == ReplayHeader(data + *start, *headerLen, "CONTENT-LENGTH", value, sizeof(value))) {
+		n = (size_t)strtoul(value, NULL, 10);
+		if (n > (size_t)(limit - end))
+			n = (size_t)(limit - end);
+		*body = strndup(end, n);
+		*bodyLen = n;
+		*pos = (size_t)(end + n - data);
+	} else if (0 == ReplayHeader(data + *start, *headerLen, "TRANSFER-ENCODING", value, sizeof(value))
+		&& 0 == strcasecmp(value, "chunked")) {
+		out = (char *)malloc((size_t)(limit - end) + 1);
+		if (NULL == out)
+			return -1;
+		for (chunk = end; chunk < limit; ) {
+			n = (size_t)strtoul(chunk, NULL, 16);
+			chunk = strstr(chunk, "\r\n");
+			if (NULL == chunk)
+				break;
+			chunk += 2;
+			if (0 == n || n > (size_t)(limit - chunk))
+				break;
+			memcpy(out + *bodyLen, chunk, n);
+			*bodyLen += n;
+			chunk += n + 2;
+		}
+		out[*bodyLen] = '\0';
+		*body = out;
+		chunk = chunk ? strstr(chunk, "\r\n\r\n") : NULL;
+		*pos = chunk ? (size_t)(chunk + 4 - data) : len;
+	} else if (isResponse) {
+		/* Up to the close of the connection */
+		*body = strndup(end, (size_t)(limit - end));
+		*bodyLen = (size_t)(limit - end);
+		*pos = len;
+	} else {
+		*pos = (size_t)(end - data);
+	}
+	return 0;
+}
+
+/* Pair the requests of a client stream with the responses of its reverse */
+static void ReplayHttp(struct ReplayStream *requests)
+{
+	struct ReplayStream *responses;
+	struct ReplayEvent *event;
+	struct ReplayDescription *desc;
+	char method[NAME_SIZE];
+	/* "http://" host path fits in LINE_SIZE, read with %139s below */
+	char path[LINE_SIZE - 40];
+	char host[32];		/* address:port */
+	char value[NAME_SIZE];
+	char sid[NAME_SIZE];
+	Upnp_SID eventSid;
+	const char *timeout;
+	size_t reqPos = 0, respPos = 0;
+	size_t reqStart, reqHeaderLen, reqBodyLen;
+	size_t respStart = 0, respHeaderLen = 0, respBodyLen = 0;
+	char *reqBody, *respBody;
+	int haveResponse;
+
+	responses = ReplayFindStream(requests->dst, requests->dport, requests->src, requests->sport, 0);
+	ReplayAddress(requests->dst, requests->dport, host, sizeof(host));
+	while (0 == ReplayNextMessage(requests->data, requests->len, &reqPos, 0,
+		&reqStart, &reqHeaderLen, &reqBody, &reqBodyLen)) {
+		respBody = NULL;
+		haveResponse = responses && 0 == ReplayNextMessage(responses->data, responses->len, &respPos, 1,
+			&respStart, &respHeaderLen, &respBody, &respBodyLen);
+		if (2 != sscanf(requests->data + reqStart, "%255s %139s", method, path)) {
+			free(reqBody);
+			free(respBody);
+			continue;
+		}
+
+		if (0 == strcmp(method, "GET") && haveResponse && respBody
+			&& 0 == strncmp(responses->data + respStart, "HTTP/1.1 200", 12)) {
+			desc = (struct ReplayDescription *)calloc(1, sizeof(struct ReplayDescription));
+			if (desc) {
+				snprintf(desc->url, sizeof(desc->url), "http://%s%s", host, path);
+				desc->xml = respBody;
+				respBody = NULL;
+				desc->next = g_descriptions;
+				g_descriptions = desc;
+			}
+		} else if (0 == strcmp(method, "SUBSCRIBE") && haveResponse
+			&& 0 == ReplayHeader(responses->data + respStart, respHeaderLen, "SID", eventSid, sizeof(eventSid))) {
+			/* A request with a SID renews, without one subscribes */
+			event = ReplayAddEvent(responses->times[respStart],
+				0 == ReplayHeader(requests->data + reqStart, reqHeaderLen, "SID", sid, sizeof(sid))
+				? UPNP_EVENT_RENEWAL_COMPLETE : UPNP_EVENT_SUBSCRIBE_COMPLETE);
+			if (event) {
+				strcpy(event->subscribe.Sid, eventSid);
+				snprintf(event->subscribe.PublisherUrl, sizeof(event->subscribe.PublisherUrl),
+					"http://%s%s", host, path);
+				ReplayHeader(responses->data + respStart, respHeaderLen, "TIMEOUT", value, sizeof(value));
+				timeout = strstr(value, "Second-");
+				event->subscribe.TimeOut = timeout ? atoi(timeout + strlen("Second-")) : 0;
+			}
+		} else if (0 == strcmp(method, "NOTIFY") && reqBody
+			&& 0 == ReplayHeader(requests->data + reqStart, reqHeaderLen, "SID", eventSid, sizeof(eventSid))) {
+			event = ReplayAddEvent(requests->times[reqStart], UPNP_EVENT_RECEIVED);
+			if (event) {
+				strcpy(event->event.Sid, eventSid);
+				ReplayHeader(requests->data + reqStart, reqHeaderLen, "SEQ", value, sizeof(value));
+				event->event.EventKey = atoi(value);
+				event->event.ChangedVariables = ixmlParseBuffer(reqBody);
+				if (NULL == event->event.ChangedVariables)
+					g_eventCount--;
+			}
+		}
+		free(reqBody);
+		free(respBody);
+	}
+}
+
+static int ReplayLoad(const char *file)
+{
+	struct {
+		uint32_t magic;
+		uint16_t major, minor;
+		int32_t zone;
+		uint32_t sigfigs, snaplen, linktype;
+	} header;
+	struct {
+		uint32_t sec, usec, incl, orig;
+	} record;
+	unsigned char packet[65536];
+	struct ReplayStream *stream;
+	const unsigned char *ip, *l4;
+	uint32_t src, dst, seq;
+	uint16_t sport, dport, total;
+	size_t ihl, thl, payload;
+	double time;
+	FILE *fp = fopen(file, "rb");
+
+	if (NULL == fp)
+		return -1;
+	if (1 != fread(&header, sizeof(header), 1, fp) || REPLAY_PCAP_MAGIC != header.magic
+		|| REPLAY_LINKTYPE_ETHERNET != header.linktype) {
+		fprintf(g_report, "%s is not a little endian Ethernet pcap\n", file);
+		fclose(fp);
+		return -1;
+	}
+	while (1 == fread(&record, sizeof(record), 1, fp)) {
+		if (record.incl > sizeof(packet) || record.incl != fread(packet, 1, record.incl, fp))
+			break;
+		time = record.sec + record.usec / 1e6;
+		/* IPv4 over Ethernet only */
+		if (record.incl < 14 + 20 || 0x08 != packet[12] || 0x00 != packet[13])
+			continue;
+		ip = packet + 14;
+		ihl = (size_t)(ip[0] & 0x0f) * 4;
+		total = (uint16_t)(ip[2] << 8 | ip[3]);
+		if (total > record.incl - 14)
+			total = (uint16_t)(record.incl - 14);
+		memcpy(&src, ip + 12, 4);
+		memcpy(&dst, ip + 16, 4);
+		l4 = ip + ihl;
+		if (17 == ip[9] && total >= ihl + 8) {
+			ReplaySsdp(time, (const char *)l4 + 8, total - ihl - 8);
+		} else if (6 == ip[9] && total >= ihl + 20) {
+			memcpy(&sport, l4, 2);
+			memcpy(&dport, l4 + 2, 2);
+			seq = (uint32_t)l4[4] << 24 | (uint32_t)l4[5] << 16 | (uint32_t)l4[6] << 8 | l4[7];
+			thl = (size_t)(l4[12] >> 4) * 4;
+			payload = total > ihl + thl ? total - ihl - thl : 0;
+			if (payload > 0)
+				ReplayAddSegment(time, src, sport, dst, dport, seq, (const char *)l4 + thl, payload);
+		}
+	}
+	fclose(fp);
+
+	for (stream = g_streams; stream; stream = stream->next) {
+		if (ReplayReassemble(stream) < 0)
+			return -1;
+	}
+	/* Requests start with a method, responses with HTTP/ */
+	for (stream = g_streams; stream; stream = stream->next) {
+		if (stream->len > 5 && strncmp(stream->data, "HTTP/", 5) != 0)
+			ReplayHttp(stream);
+	}
+	return 0;
+}
+
+static int CompareEvent(const void *a, const void *b)
+{
+	const struct ReplayEvent *evA = (const struct ReplayEvent *)a;
+	const struct ReplayEvent *evB = (const struct ReplayEvent *)b;
+
+	return evA->time < evB->time ? -1 : (evA->time > evB->time);
+}
+
+static const char *ReplayEventName(Upnp_EventType type)
+{
+	switch (type) {
+		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE: return "alive";
+		case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE: return "byebye";
+		case UPNP_DISCOVERY_SEARCH_RESULT: return "search result";
+		case UPNP_EVENT_SUBSCRIBE_COMPLETE: return "subscribe";
+		case UPNP_EVENT_RENEWAL_COMPLETE: return "renewal";
+		case UPNP_EVENT_RECEIVED: return "event";
+		default: return "other";
+	}
+}
+
+static void *ReplayEventData(struct ReplayEvent *event)
+{
+	switch (event->type) {
+		case UPNP_EVENT_SUBSCRIBE_COMPLETE:
+		case UPNP_EVENT_RENEWAL_COMPLETE:
+			return &event->subscribe;
+		case UPNP_EVENT_RECEIVED:
+			return &event->event;
+		default:
+			return &event->discovery;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct LatencyHistogram histograms[UPNP_EVENT_SUBSCRIPTION_EXPIRED + 1];
+	struct ReplayStream *stream;
+	struct ReplayDescription *desc;
+	struct timespec pause;
+	const char *file = "doc/cms.pcap";
+	double rate = 0;
+	double start, sent, elapsed, wait, span;
+	int loops = 1;
+	int workers = 0;
+	int verbose = 0;
+	int opt;
+	int loop;
+	int i;
+	int k;
+
+	while ((opt = getopt(argc, argv, "r:n:w:v")) != -1) {
+		switch (opt) {
+			case 'r': rate = atof(optarg); break;
+			case 'n': loops = atoi(optarg); break;
+			case 'w': workers = atoi(optarg); break;
+			case 'v': verbose = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s [-r <rate>] [-n <loops>] [-w <workers>] [-v] [<pcap>]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc)
+		file = argv[optind];
+	if (rate < 0 || loops < 1 || workers < 0 || workers > DISPATCH_MAX_WORKERS)
+		return 1;
+
+	/* Keep the report, silence the control point unless asked */
+	g_report = fdopen(dup(fileno(stdout)), "w");
+	if (NULL == g_report || (!verbose && NULL == freopen("/dev/null", "w", stdout)))
+		return 1;
+	g_eventLog = verbose;
+	ithread_rwlock_init(&g_deviceListLock, NULL);
+	ithread_mutex_init(&g_downloadMutex, NULL);
+	ithread_mutex_init(&g_filterMutex, NULL);
+	ithread_mutex_init(&g_timerMutex, NULL);
+	ithread_cond_init(&g_timerCond, NULL);
+	ithread_rwlock_init(&g_dispatchLock, NULL);
+	ithread_mutex_init(&g_dispatchGate, NULL);
+	ithread_mutex_init(&g_dispatchRouteMutex, NULL);
+	ithread_rwlock_init(&g_internLock, NULL);
+	g_downloadXmlDoc = ReplayDownloadXmlDoc;
+
+	if (ReplayLoad(file) < 0 || 0 == g_eventCount) {
+		fprintf(g_report, "No SSDP or GENA traffic read from %s\n", file);
+		return 1;
+	}
+	qsort(g_events, (size_t)g_eventCount, sizeof(struct ReplayEvent), CompareEvent);
+	for (k = 0, desc = g_descriptions; desc; desc = desc->next)
+		k++;
+	fprintf(g_report, "# replay: %s, %d events, %d descriptions, rate=%g loops=%d workers=%d\n",
+		file, g_eventCount, k, rate, loops, workers);
+
+	if (workers > 0) {
+		g_dispatchWorkers = workers;
+		CtrlPointStartDispatch();
+	}
+	memset(histograms, 0, sizeof(histograms));
+	span = g_events[g_eventCount - 1].time - g_events[0].time + 1;
+	start = NowSeconds();
+	for (loop = 0; loop < loops; loop++) {
+		for (i = 0; i < g_eventCount; i++) {
+			if (rate > 0) {
+				/* Keep the captured pace, scaled */
+				wait = start + (loop * span + g_events[i].time - g_events[0].time) / rate - NowSeconds();
+				if (wait > 0) {
+					pause.tv_sec = (time_t)wait;
+					pause.tv_nsec = (long)((wait - pause.tv_sec) * 1e9);
+					nanosleep(&pause, NULL);
+				}
+			}
+			sent = NowSeconds();
+			CtrlPointCallbackEventHandler(g_events[i].type, ReplayEventData(&g_events[i]), NULL);
+			LatencyRecord(&histograms[g_events[i].type], NowSeconds() - sent, UPNP_E_SUCCESS);
+		}
+	}
+	/* The queued events count in the elapsed time */
+	if (workers > 0)
+		CtrlPointStopDispatch();
+	elapsed = NowSeconds() - start;
+
+	fprintf(g_report, "%-40s %8s %6s %9s %9s %9s %9s %9s\n", "callback", "count", "errors",
+		"mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	fflush(g_report);
+	/* LatencyPrint writes to stdout */
+	fflush(stdout);
+	if (!verbose)
+		dup2(fileno(g_report), fileno(stdout));
+	for (k = 0; k <= UPNP_EVENT_SUBSCRIPTION_EXPIRED; k++) {
+		for (i = 0; i < g_eventCount && g_events[i].type != (Upnp_EventType)k; i++)
+			;
+		if (i < g_eventCount)
+			LatencyPrint(ReplayEventName((Upnp_EventType)k), &histograms[k]);
+	}
+	fflush(stdout);
+	fprintf(g_report, "%d callbacks in %.3f s, %.0f/s, %d devices known\n",
+		g_eventCount * loops, elapsed, elapsed > 0 ? g_eventCount * loops / elapsed : 0, g_deviceCount);
+	fprintf(g_report, "%lu descriptions downloaded, %lu events routed, %lu with an unknown SID\n",
+		MetricRead(METRIC_DESCRIPTIONS_DOWNLOADED), MetricRead(METRIC_EVENTS_ROUTED),
+		MetricRead(METRIC_EVENTS_UNKNOWN_SID));
+	fprintf(g_report, "%lu events dropped as already seen, %lu missed, %lu resyncs\n",
+		MetricRead(METRIC_EVENTS_STALE), MetricRead(METRIC_EVENTS_MISSED), MetricRead(METRIC_RESYNCS));
+	if (workers > 0)
+		fprintf(g_report, "%lu callbacks queued, %lu dropped, %lu waited for room\n",
+			MetricRead(METRIC_DISPATCH_QUEUED), MetricRead(METRIC_DISPATCH_DROPPED),
+			MetricRead(METRIC_DISPATCH_BLOCKED));
+
+	for (i = 0; i < g_eventCount; i++) {
+		if (UPNP_EVENT_RECEIVED == g_events[i].type)
+			ixmlDocument_free(g_events[i].event.ChangedVariables);
+	}
+	free(g_events);
+	while ((desc = g_descriptions)) {
+		g_descriptions = desc->next;
+		free(desc->xml);
+		free(desc);
+	}
+	while ((stream = g_streams)) {
+		g_streams = stream->next;
+		for (k = 0; k < stream->count; k++)
+			free(stream->segments[k].data);
+		free(stream->segments);
+		free(stream->data);
+		free(stream->times);
+		free(stream);
+	}
+	fclose(g_report);
+	return 0;
+}